@@ -0,0 +1,362 @@
+/******************************************************************
+//
+//
+//  Copyright(C) 2018, Institute for Defense Analyses
+//  4850 Mark Center Drive, Alexandria, VA; 703-845-2500
+//  This material may be reproduced by or for the US Government
+//  pursuant to the copyright license under the clauses at DFARS
+//  252.227-7013 and 252.227-7014.
+// 
+//
+//  All rights reserved.
+//  
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//    * Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in the
+//      documentation and/or other materials provided with the distribution.
+//    * Neither the name of the copyright holder nor the
+//      names of its contributors may be used to endorse or promote products
+//      derived from this software without specific prior written permission.
+// 
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+//  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+//  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+//  COPYRIGHT HOLDER NOR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+//  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+//  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+//  STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+//  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+//  OF THE POSSIBILITY OF SUCH DAMAGE.
+// 
+ *****************************************************************/ 
+
+/*! \file histo.cpp
+ * \brief Distributed histogram (scatter-add): counts[index[i]] += 1 for every update.
+ *
+ * Models, selected with -M:
+ *  1  AGP: one shmem_int64_atomic_add per update
+ *  2  conveyor: IndexScatter<int64_t, AddOp> from index_gather.h
+ *  4  conveyor with a requester-side combining buffer: a direct mapped cache
+ *     of (pe, local index, count) that merges updates to the same remote
+ *     slot and only pushes an entry when it is evicted or flushed at the end
+ * Every model's counts are compared with the first model's, and the counts
+ * must add up to the number of updates. With -Z s > 0 the indices follow a
+ * Zipf law with exponent s instead of the uniform distribution.
+ */
+#include <math.h>
+#include <vector>
+#include <shmem.h>
+extern "C" {
+#include <spmat.h>
+#include <convey.h>
+}
+#include "index_gather.h"
+#include "index_gen.h"
+
+#define THREADS shmem_n_pes()
+#define MYTHREAD shmem_my_pe()
+
+#define HISTO_AGP_MODEL       1
+#define HISTO_CONVEY_MODEL    2
+#define HISTO_COMBINE_MODEL   4
+#define HISTO_ALL_MODELS      7
+
+typedef struct histo_pkg_t {
+  int64_t lindx;
+  int64_t val;
+} histo_pkg_t;
+
+typedef struct histo_slot_t {
+  int64_t pe;       /*!< -1 for an empty slot */
+  int64_t lindx;
+  int64_t val;
+} histo_slot_t;
+
+static double histo_uniform() { return rand() / ((double)RAND_MAX + 1.0); }
+
+/*!
+ * \brief This routine implements the AGP variant of histogram with a remote atomic add per update.
+ * \param *pckindx array of packed indices for the updates
+ * \param T the number of updates on this thread
+ * \param *lcounts localized pointer to the count array
+ * \return average run time
+ */
+static double histo_agp(int64_t *pckindx, int64_t T, int64_t *lcounts) {
+  double tm;
+  int64_t i;
+  minavgmaxD_t stat[1];
+
+  lgp_barrier();
+  tm = wall_seconds();
+
+  for (i = 0; i < T; i++)
+    shmem_int64_atomic_add(lcounts + (pckindx[i] >> 16), 1, pckindx[i] & 0xffff);
+
+  lgp_barrier();
+  tm = wall_seconds() - tm;
+  lgp_min_avg_max_d( stat, tm, THREADS );
+  return( stat->avg );
+}
+
+/*!
+ * \brief This routine implements the conveyor variant of histogram as a client of IndexScatter.
+ * The plan is built inside the timed region, as a one-shot histogram has to.
+ * \param *pckindx array of packed indices for the updates
+ * \param T the number of updates on this thread
+ * \param *lcounts localized pointer to the count array
+ * \return average run time
+ */
+static double histo_conveyor(int64_t *pckindx, int64_t T, int64_t *lcounts) {
+  double tm;
+  minavgmaxD_t stat[1];
+  IndexScatter<int64_t, AddOp> scatter;
+  std::vector<int64_t> ones(T, 1);
+
+  lgp_barrier();
+  tm = wall_seconds();
+
+  {
+    ConveyPhase ph("histo_conveyor");
+    scatter.plan(pckindx, T);
+    scatter.scatter(ones.data(), lcounts);
+  }
+
+  lgp_barrier();
+  tm = wall_seconds() - tm;
+  lgp_min_avg_max_d( stat, tm, THREADS );
+  return( stat->avg );
+}
+
+/*!
+ * \brief This routine implements the conveyor variant of histogram with a combining buffer.
+ * Updates go through a direct mapped cache keyed by the packed index. A hit
+ * adds to the cached count; a miss evicts the old entry into the conveyor.
+ * Once all updates are in, the cache is flushed.
+ * \param *pckindx array of packed indices for the updates
+ * \param T the number of updates on this thread
+ * \param *lcounts localized pointer to the count array
+ * \param slots number of cache entries, rounded up to a power of two
+ * \param *pushed set to the number of packages this thread pushed
+ * \return average run time
+ */
+static double histo_conveyor_combining(int64_t *pckindx, int64_t T, int64_t *lcounts, int64_t slots, int64_t *pushed) {
+  double tm;
+  minavgmaxD_t stat[1];
+  int64_t log_slots = 0;
+  while ((1L << log_slots) < slots)
+    log_slots++;
+  slots = 1L << log_slots;
+
+  convey_t *conv = mem_convey_new(SIZE_MAX, 0, NULL, 0, "combined");
+  assert( conv != NULL );
+  histo_slot_t empty = { -1, 0, 0 };
+  std::vector<histo_slot_t> cache(slots, empty);
+  mem_private("cache", slots * sizeof(histo_slot_t), MEM_FIXED);
+
+  lgp_barrier();
+  tm = wall_seconds();
+
+  ConveyPhase ph("histo_combining");
+  int64_t i = 0, flush = 0;
+  bool have_pending = false;
+  histo_pkg_t pend;
+  int64_t pend_pe = 0;
+  histo_pkg_t *pkg;
+  *pushed = 0;
+
+  cprof_begin(conv, sizeof(histo_pkg_t), alignof(histo_pkg_t), "updates");
+  while (cprof_advance(conv, flush == slots && !have_pending)) {
+    for (;;) {
+      if (have_pending) {
+        if (! cprof_push(conv, &pend, pend_pe))
+          break;
+        have_pending = false;
+        (*pushed)++;
+      }
+      if (i < T) {
+        uint64_t key = (uint64_t)pckindx[i];
+        histo_slot_t &s = cache[log_slots ? (key * 0x9E3779B97F4A7C15ULL) >> (64 - log_slots) : 0];
+        int64_t pe = key & 0xffff;
+        int64_t lindx = key >> 16;
+        i++;
+        if (s.pe == pe && s.lindx == lindx) {
+          s.val++;
+          continue;
+        }
+        if (s.pe >= 0) {
+          pend.lindx = s.lindx;
+          pend.val = s.val;
+          pend_pe = s.pe;
+          have_pending = true;
+        }
+        s.pe = pe;
+        s.lindx = lindx;
+        s.val = 1;
+      } else if (flush < slots) {
+        histo_slot_t &s = cache[flush++];
+        if (s.pe >= 0) {
+          pend.lindx = s.lindx;
+          pend.val = s.val;
+          pend_pe = s.pe;
+          have_pending = true;
+          s.pe = -1;
+        }
+      } else {
+        break;
+      }
+    }
+
+    while ((pkg = (histo_pkg_t*)cprof_apull(conv, NULL)) != NULL)
+      lcounts[pkg->lindx] += pkg->val;
+  }
+  convey_reset(conv);
+
+  lgp_barrier();
+  tm = wall_seconds() - tm;
+  mem_convey_free(conv);
+  mem_private("cache", 0);
+  lgp_min_avg_max_d( stat, tm, THREADS );
+  return( stat->avg );
+}
+
+/*!
+ * \brief Check the counts against the first model's and their total, then zero them.
+ * \return the number of errors on this thread
+ */
+static int64_t histo_check_and_zero(int64_t use_model, int64_t *lcounts, int64_t *ref, int64_t ltab_siz, int64_t total) {
+  int64_t i, errors = 0, sum = 0;
+  for (i = 0; i < ltab_siz; i++) {
+    sum += lcounts[i];
+    if (ref != NULL && lcounts[i] != ref[i]) {
+      errors++;
+      if (errors < 5)
+        fprintf(stderr,"ERROR: model %ld: Thread %d: counts[%ld] = %ld differs from the first model's %ld\n",
+                use_model, MYTHREAD, i, lcounts[i], ref[i]);
+    }
+  }
+  sum = lgp_reduce_add_l(sum);
+  if (sum != total) {
+    if (MYTHREAD == 0)
+      fprintf(stderr,"ERROR: model %ld: counts add up to %ld, not %ld\n", use_model, sum, total);
+    errors++;
+  }
+  lgp_barrier();
+  memset(lcounts, 0, ltab_siz*sizeof(int64_t));
+  lgp_barrier();
+  return(errors);
+}
+
+int main(int argc, char * argv[]) {
+
+  lgp_init(argc, argv);
+
+  int64_t i;
+  int64_t models_mask = 0;        // run all the models
+  int64_t ltab_siz = 100000;
+  int64_t l_num_ups = 1000000;    // number of updates per thread
+  int64_t cache_slots = 4096;
+  double zipf_s = 0.0;            // 0 for uniform indices
+  char *prof_file = NULL;
+  int64_t total_errors = 0L;
+
+  int opt;
+  while( (opt = getopt(argc, argv, "M:n:T:Z:B:P:")) != -1 ) {
+    switch(opt) {
+    case 'M': sscanf(optarg,"%ld" ,&models_mask);  break;
+    case 'n': sscanf(optarg,"%ld" ,&l_num_ups);   break;
+    case 'T': sscanf(optarg,"%ld" ,&ltab_siz);   break;
+    case 'Z': sscanf(optarg,"%lf" ,&zipf_s);   break;
+    case 'B': sscanf(optarg,"%ld" ,&cache_slots);   break;
+    case 'P': prof_file = optarg; break;
+    default:  break;
+    }
+  }
+
+  T0_fprintf(stderr,"Running histo on %d threads\n", THREADS);
+  T0_fprintf(stderr,"Number of updates / thread           (-n)= %ld\n", l_num_ups);
+  T0_fprintf(stderr,"Table size / thread                  (-T)= %ld\n", ltab_siz);
+  T0_fprintf(stderr,"Zipf exponent, 0 for uniform         (-Z)= %lf\n", zipf_s);
+  T0_fprintf(stderr,"Combining buffer slots               (-B)= %ld\n", cache_slots);
+  T0_fprintf(stderr,"Conveyor profile file                (-P)= %s\n", prof_file ? prof_file : "none");
+  T0_fprintf(stderr,"models_mask                          (-M)= %ld\n", models_mask);
+  T0_fprintf(stderr,"models_mask is or of 1,2,4 for agp(atomic add),conveyor,conveyor+combining)\n");
+
+  int64_t tab_siz = ltab_siz*THREADS;
+  int64_t *counts  = (int64_t*)mem_lgp_all_alloc(tab_siz, sizeof(int64_t), "counts", MEM_PER_ELT); assert(counts != NULL);
+  int64_t *lcounts = lgp_local_part(int64_t, counts);
+  memset(lcounts, 0, ltab_siz*sizeof(int64_t));
+
+  // block distribution; Zipf ranks are scattered over the table so the hot
+  // slots do not all land on thread 0
+  int64_t *pckindx = (int64_t*)mem_calloc(l_num_ups, sizeof(int64_t), "pckindx", MEM_PER_ELT); assert(pckindx != NULL);
+  srand(MYTHREAD + 5);
+  ZipfSampler zipf(tab_siz, zipf_s > 0.0 ? zipf_s : 1.0);
+  for (i = 0; i < l_num_ups; i++) {
+    int64_t indx = rand() % tab_siz;
+    if (zipf_s > 0.0)
+      indx = (int64_t)(((uint64_t)(zipf.sample(histo_uniform) - 1) * 2654435761ULL) % (uint64_t)tab_siz);
+    pckindx[i] = ((indx % ltab_siz) << 16) | ((indx / ltab_siz) & 0xffff);
+  }
+  lgp_barrier();
+
+  if (models_mask == 0)
+    models_mask = HISTO_ALL_MODELS;
+  int64_t total = l_num_ups * THREADS;
+  int64_t *ref = NULL;
+  double laptime = 0.0;
+  for (int64_t use_model = 1; use_model <= HISTO_ALL_MODELS; use_model *= 2) {
+    if (!(use_model & models_mask))
+      continue;
+    int64_t pushed = 0;
+    switch (use_model) {
+    case HISTO_AGP_MODEL:
+      T0_fprintf(stderr,"AGP atomic add:       ");
+      laptime = histo_agp(pckindx, l_num_ups, lcounts);
+      break;
+    case HISTO_CONVEY_MODEL:
+      T0_fprintf(stderr,"Conveyor:             ");
+      laptime = histo_conveyor(pckindx, l_num_ups, lcounts);
+      break;
+    case HISTO_COMBINE_MODEL:
+      T0_fprintf(stderr,"Conveyor+combining:   ");
+      laptime = histo_conveyor_combining(pckindx, l_num_ups, lcounts, cache_slots, &pushed);
+      break;
+    }
+    T0_fprintf(stderr,"  %8.3lf seconds  %8.3lf M updates/s\n", laptime, 1.0e-6 * total / laptime);
+
+    if (use_model == HISTO_COMBINE_MODEL) {
+      int64_t all_pushed = lgp_reduce_add_l(pushed);
+      T0_fprintf(stderr,"    %ld updates in %ld packages (%5.1lf%% combined), %8.3lf MB saved\n",
+                 total, all_pushed, 100.0 * (total - all_pushed) / (double)total,
+                 1.0e-6 * (double)(total - all_pushed) * sizeof(histo_pkg_t));
+    }
+
+    if (ref == NULL) {
+      ref = (int64_t*)mem_calloc(ltab_siz, sizeof(int64_t), "ref", MEM_PER_ELT); assert(ref != NULL);
+      memcpy(ref, lcounts, ltab_siz*sizeof(int64_t));
+      total_errors += histo_check_and_zero(use_model, lcounts, NULL, ltab_siz, total);
+    } else {
+      total_errors += histo_check_and_zero(use_model, lcounts, ref, ltab_siz, total);
+    }
+  }
+  total_errors = lgp_reduce_add_l(total_errors);
+  if( total_errors ) {
+    T0_fprintf(stderr,"YOU FAILED!!!!\n");
+  }
+
+  cprof_report(stderr, prof_file);
+  mem_report(stderr, l_num_ups*THREADS, 0, 0);
+
+  lgp_barrier();
+  mem_lgp_all_free(counts);
+  mem_free(pckindx);
+  mem_free(ref);
+  lgp_finalize();
+  return(0);
+}
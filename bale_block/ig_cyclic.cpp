@@ -36,107 +36,11 @@
 // 
  *****************************************************************/ 
 
-/*! \file ig_conveyor.upc
- * \brief A conveyor implementation of indexgather.
+/*! \file ig_cyclic.cpp
+ * \brief Index gather on a cyclic distributed table with every programming model in ig_models.h.
  */
-#include <shmem.h>
-extern "C" {
-#include <spmat.h>
-}
-
-#define THREADS shmem_n_pes()
-#define MYTHREAD shmem_my_pe()
-
-/*!
- * \brief This routine implements the conveyor variant of indexgather.
- * \param *tgt array of target locations for the gathered values
- * \param *pckindx array of packed indices for the distributed version of the global array of counts.
- * \param l_num_req the length of the pcindx array
- * \param *ltable localized pointer to the count array.
- * \return average run time
- *
- */
-double ig_conveyor(int64_t *tgt, int64_t *pckindx, int64_t l_num_req,  int64_t *ltable) {
-  double tm;
-  int64_t pe, fromth, fromth2;
-  int64_t i = 0, from;
-  minavgmaxD_t stat[1];
-  bool more;
-
-  typedef struct pkg_t {
-    int64_t idx;
-    int64_t val;
-  } pkg_t;
-  pkg_t pkg;
-  pkg_t *ptr = (pkg_t*)calloc(1, sizeof(pkg_t));
-  
-  //convey_t* requests = convey_new(sizeof(pkg_t), SIZE_MAX, 0, NULL, convey_opt_SCATTER);
-  convey_t* requests = convey_new(SIZE_MAX, 0, NULL, 0);
-  assert( requests != NULL );
-  //convey_t* replies = convey_new(sizeof(pkg_t), SIZE_MAX, 0, NULL, 0);
-  convey_t* replies = convey_new(SIZE_MAX, 0, NULL, 0);
-  assert( replies != NULL );
-
-  convey_begin(requests, sizeof(pkg_t), 0);
-  convey_begin(replies, sizeof(pkg_t), 0);
-  lgp_barrier();
-  
-  tm = wall_seconds();
-
-  i = 0;
-  while (more = convey_advance(requests, (i == l_num_req)),
-         more | convey_advance(replies, !more)) {
-
-    for (; i < l_num_req; i++) {
-      pkg.idx = i;
-      pkg.val = pckindx[i] >> 16;
-      pe = pckindx[i] & 0xffff;
-      if (! convey_push(requests, &pkg, pe))
-        break;
-    }
-
-    while (convey_pull(requests, ptr, &from) == convey_OK) {
-      pkg.idx = ptr->idx;
-      pkg.val = ltable[ptr->val];
-      if (! convey_push(replies, &pkg, from)) {
-        convey_unpull(requests);
-        break;
-      }
-    }
-
-    while (convey_pull(replies, ptr, NULL) == convey_OK)
-      tgt[ptr->idx] = ptr->val;
-  }
-
-  tm = wall_seconds() - tm;
-  free(ptr);
-  lgp_barrier();
-
-  lgp_min_avg_max_d( stat, tm, THREADS );
-  convey_free(requests);
-  convey_free(replies);
-  return( stat->avg );
-}
-
-int64_t ig_check_and_zero(int64_t use_model, int64_t *tgt, int64_t *index, int64_t l_num_req) {
-  int64_t errors=0;
-  int64_t i;
-  lgp_barrier();
-  for(i=0; i<l_num_req; i++){
-    if(tgt[i] != (-1)*(index[i] + 1)){
-      errors++;
-      if(errors < 5)  // print first five errors, report all the errors
-        fprintf(stderr,"ERROR: model %ld: Thread %d: tgt[%ld] = %ld != %ld)\n",
-                use_model,  MYTHREAD, i, tgt[i], (-1)*(index[i] + 1));
-               //use_model,  MYTHREAD, i, tgt[i],(-1)*(i*THREADS+MYTHREAD + 1) );
-    }
-    tgt[i] = 0;
-  }
-  if( errors > 0 )
-    fprintf(stderr,"ERROR: %ld: %ld total errors on thread %d\n", use_model, errors, MYTHREAD);
-  lgp_barrier();
-  return(errors);
-}
+#include "ig_models.h"
+#include "index_gen.h"
 
 int main(int argc, char * argv[]) {
 
@@ -147,12 +51,31 @@ int main(int argc, char * argv[]) {
   int64_t models_mask = 0; // run all the programing models
   int64_t ltab_siz = 100000;
   int64_t l_num_req  = 1000000;      // number of requests per thread
-  int64_t cores_per_node = 0;       // Default to 0 so it won't give misleading bandwidth numbers
-  int64_t num_errors = 0L, total_errors = 0L;
+  int64_t cores_per_node = 0;       // PEs per node for GB/s/node; 0 counts the PEs that share memory
+  int64_t hops = 2;                 // lookups per chain in the multi-hop model
+  int64_t sample_every = 0;         // sample one conveyor round trip in this many requests
+  char *stats_file = NULL;
+  char *prof_file = NULL;           // per thread conveyor profile as CSV
+  char *matrix_prefix = NULL;       // communication matrices of the conveyor models
+  char *trace_prefix = NULL;        // per PE conveyor traces for tools/convey_replay
+  int64_t mem_pes = 0;              // estimate the symmetric heap for this many PEs
+  char *pages = NULL;               // page size policy for the tables and request arrays
+  char *numa = NULL;                // NUMA binding for them
+  int64_t touch_threads = 1;        // threads for their first touch
+  char *pattern = NULL;             // request index pattern, see common/index_gen.h
+  int64_t seed = 208;               // seed of the request indices
+  int64_t gen_threads = 1;          // threads that generate the requests
+  int64_t ig_threads = 4;           // threads per PE in the threaded models
+  char *energy_file = NULL;         // energy and NIC traffic time series, one file per job
+  double energy_interval = 0.01;    // seconds between energy samples
+  int64_t warmup = 0;               // untimed runs of each model
+  int64_t trials = 1;               // timed runs of each model
+  char *json_file = NULL;           // one benchmark record per model, see common/bench_harness.h
+  int64_t total_errors = 0L;
   int64_t printhelp = 0;
 
   int opt; 
-  while( (opt = getopt(argc, argv, "hb:M:n:c:T:")) != -1 ) {
+  while( (opt = getopt(argc, argv, "hb:M:n:c:T:H:S:L:P:C:R:E:i:m:g:N:t:D:s:G:W:w:K:J:")) != -1 ) {
     switch(opt) {
     case 'h': printhelp = 1; break;
     case 'b': sscanf(optarg,"%ld" ,&buf_cnt);   break;
@@ -160,6 +83,25 @@ int main(int argc, char * argv[]) {
     case 'n': sscanf(optarg,"%ld" ,&l_num_req);   break;
     case 'T': sscanf(optarg,"%ld" ,&ltab_siz);   break;
     case 'c': sscanf(optarg,"%ld" ,&cores_per_node); break;
+    case 'H': sscanf(optarg,"%ld" ,&hops); break;
+    case 'S': sscanf(optarg,"%ld" ,&sample_every); break;
+    case 'L': stats_file = optarg; break;
+    case 'P': prof_file = optarg; break;
+    case 'C': matrix_prefix = optarg; break;
+    case 'R': trace_prefix = optarg; break;
+    case 'E': energy_file = optarg; break;
+    case 'i': sscanf(optarg,"%lf" ,&energy_interval); break;
+    case 'm': sscanf(optarg,"%ld" ,&mem_pes); break;
+    case 'g': pages = optarg; break;
+    case 'N': numa = optarg; break;
+    case 't': sscanf(optarg,"%ld" ,&touch_threads); break;
+    case 'D': pattern = optarg; break;
+    case 's': sscanf(optarg,"%ld" ,&seed); break;
+    case 'G': sscanf(optarg,"%ld" ,&gen_threads); break;
+    case 'W': sscanf(optarg,"%ld" ,&ig_threads); break;
+    case 'w': sscanf(optarg,"%ld" ,&warmup); break;
+    case 'K': sscanf(optarg,"%ld" ,&trials); break;
+    case 'J': json_file = optarg; break;
     default:  break;
     }
   }
@@ -168,16 +110,49 @@ int main(int argc, char * argv[]) {
   T0_fprintf(stderr,"buf_cnt (number of buffer pkgs)      (-b)= %ld\n", buf_cnt);
   T0_fprintf(stderr,"Number of Request / thread           (-n)= %ld\n", l_num_req );
   T0_fprintf(stderr,"Table size / thread                  (-T)= %ld\n", ltab_siz);
+  T0_fprintf(stderr,"Hops per chain in the multi-hop model (-H)= %ld\n", hops);
+  T0_fprintf(stderr,"Sample 1 in N conveyor requests      (-S)= %ld\n", sample_every);
+  T0_fprintf(stderr,"Conveyor stats file                  (-L)= %s\n", stats_file ? stats_file : "none");
+  T0_fprintf(stderr,"Conveyor profile file                (-P)= %s\n", prof_file ? prof_file : "none");
+  T0_fprintf(stderr,"Communication matrix prefix          (-C)= %s\n", matrix_prefix ? matrix_prefix : "none");
+  T0_fprintf(stderr,"Conveyor trace prefix                (-R)= %s\n", trace_prefix ? trace_prefix : "none");
+  T0_fprintf(stderr,"Energy time series file              (-E)= %s\n", energy_file ? energy_file : "none");
+  T0_fprintf(stderr,"Seconds between energy samples       (-i)= %lf\n", energy_interval);
+  T0_fprintf(stderr,"Estimate symmetric heap for PEs      (-m)= %ld\n", mem_pes);
+  if (mem_policy_set(pages, numa, (int)touch_threads) != 0) {
+    T0_fprintf(stderr,"ERROR: -g takes default|thp|2m|1g and -N none|local|interleave|<node>\n");
+    lgp_global_exit(1);
+  }
+  T0_fprintf(stderr,"Pages (default|thp|2m|1g)            (-g)= %s\n", mem_policy_name());
+  T0_fprintf(stderr,"NUMA binding                         (-N)= %s\n", numa ? numa : "none");
+  T0_fprintf(stderr,"First touch threads                  (-t)= %ld\n", touch_threads);
+  IndexGen gen;
+  if (!gen.parse(pattern ? pattern : "uniform", (uint64_t)seed)) {
+    T0_fprintf(stderr,"ERROR: -D takes uniform|zipf:s|hotspot:f:p|local:p:w|chapel\n");
+    lgp_global_exit(1);
+  }
+  T0_fprintf(stderr,"Request index pattern                (-D)= %s\n", gen.name());
+  T0_fprintf(stderr,"Seed of the request indices          (-s)= %ld\n", seed);
+  T0_fprintf(stderr,"Threads generating the requests      (-G)= %ld\n", gen_threads);
+  T0_fprintf(stderr,"Threads per PE in threaded models    (-W)= %ld\n", ig_threads);
+  bench_set((int)warmup, (int)trials, (int)cores_per_node, json_file);
+  T0_fprintf(stderr,"PEs per node for GB/s/node           (-c)= %d\n", bench_pes_per_node());
+  T0_fprintf(stderr,"Warmup runs of each model            (-w)= %d\n", bench_options().warmup);
+  T0_fprintf(stderr,"Timed trials of each model           (-K)= %d\n", bench_options().trials);
+  T0_fprintf(stderr,"Benchmark record file                (-J)= %s\n", json_file ? json_file : "none");
   T0_fprintf(stderr,"models_mask                          (-M)= %ld\n", models_mask);
-  T0_fprintf(stderr,"models_mask is or of 1,2,4,8,16 for agi,exstack,exstack2,conveyor,alternate)\n");
+  T0_fprintf(stderr,"models_mask is or of 1,2,4,8,16,32,64,128,256,512,1024 for agp(shmem_g),exstack,exstack2,conveyor,alternate(shmem_get_nbi),conveyor+shmem_ptr,multi-hop,conveyor+progress thread,coroutines,conveyor+threads,shmem_ctx nbi+threads)\n");
+  if (hops < 1) {
+    T0_fprintf(stderr,"ERROR: -H must be at least 1\n");
+    lgp_global_exit(1);
+  }
+
 
-  
-  int64_t bytes_read_per_request_per_node = 8*2*cores_per_node;
-  
   // Allocate and populate the shared table array 
   int64_t tab_siz = ltab_siz*THREADS;
-  int64_t * table  = (int64_t*)lgp_all_alloc(tab_siz, sizeof(int64_t)); assert(table != NULL);
+  int64_t * table  = (int64_t*)mem_lgp_all_alloc(tab_siz, sizeof(int64_t), "table", MEM_PER_ELT); assert(table != NULL);
   int64_t *ltable  = lgp_local_part(int64_t, table);
+  mem_place(ltable, ltab_siz*sizeof(int64_t));
   // fill the table with the negative of its shared index
   // so that checking is easy
   for(i=0; i<ltab_siz; i++)
@@ -185,44 +160,98 @@ int main(int argc, char * argv[]) {
   
   // As in the histo example, index is used by the _agi version.
   // pckindx is used my the buffered versions
-  int64_t *index   =  (int64_t*)calloc(l_num_req, sizeof(int64_t)); assert(index != NULL);
-  int64_t *pckindx =  (int64_t*)calloc(l_num_req, sizeof(int64_t)); assert(pckindx != NULL);
+  int64_t *index   =  (int64_t*)mem_policy_calloc(l_num_req, sizeof(int64_t), "index", MEM_PER_ELT); assert(index != NULL);
+  int64_t *pckindx =  (int64_t*)mem_policy_calloc(l_num_req, sizeof(int64_t), "pckindx", MEM_PER_ELT); assert(pckindx != NULL);
   int64_t indx, lindx, pe;
-  srand(MYTHREAD+ 5 );
+  // a request's index depends only on its global number, the seed and the
+  // pattern, so the same total requests give the same indices at any PE count
+  double gen_time = wall_seconds();
+  gen.generate(index, MYTHREAD*l_num_req, l_num_req, l_num_req*THREADS, tab_siz, (int)gen_threads);
   for(i = 0; i < l_num_req; i++){
-    indx = rand() % tab_siz;
-    index[i] = indx;
+    indx = index[i];
     lindx = indx / THREADS;      // the distributed version of indx
-    pe  = indx % THREADS;      
+    pe  = indx % THREADS;
     pckindx[i] = (lindx << 16) | (pe & 0xffff); // same thing stored as (local index, thread) "shmem style"
   }
+  gen_time = wall_seconds() - gen_time;
+  T0_fprintf(stderr,"Requests generated in %8.3lf seconds\n", lgp_reduce_max_d(gen_time));
 
-  int64_t *tgt  =  (int64_t*)calloc(l_num_req, sizeof(int64_t)); assert(tgt != NULL);
+  int64_t *tgt  =  (int64_t*)mem_policy_calloc(l_num_req, sizeof(int64_t), "tgt", MEM_PER_ELT); assert(tgt != NULL);
+
+  // the multi-hop model chases hops-1 links through a scrambled link table
+  // before it reads table; chain[] is where each request should end up
+  int64_t *link  = (int64_t*)mem_lgp_all_alloc(tab_siz, sizeof(int64_t), "link", MEM_PER_ELT); assert(link != NULL);
+  int64_t *llink = lgp_local_part(int64_t, link);
+  mem_place(llink, ltab_siz*sizeof(int64_t));
+  for(i=0; i<ltab_siz; i++) {
+    int64_t nxt = ig_next_hop(i*THREADS + MYTHREAD, tab_siz);
+    llink[i] = (nxt / THREADS) << 16 | ((nxt % THREADS) & 0xffff);
+  }
+  int64_t *chain = (int64_t*)mem_policy_calloc(l_num_req, sizeof(int64_t), "chain", MEM_PER_ELT); assert(chain != NULL);
+  for(i = 0; i < l_num_req; i++) {
+    chain[i] = index[i];
+    for(int64_t h = 1; h < hops; h++)
+      chain[i] = ig_next_hop(chain[i], tab_siz);
+  }
 
   lgp_barrier();
 
-  int64_t use_model;
-  double laptime = 0.0;
-  double volume_per_node = (2*8*l_num_req*cores_per_node)*(1.0E-9);
-  double injection_bw = 0.0;
+  bench_param("n", l_num_req);
+  bench_param("T", ltab_siz);
+  bench_param("b", buf_cnt);
+  bench_param("H", hops);
+  bench_param("D", gen.name());
+  bench_param("s", seed);
+  bench_param("g", mem_policy_name());
+  bench_param("N", numa);
+  bench_param("W", ig_threads);
+
+  if (matrix_prefix)
+    cprof_enable_matrix();
+  if (trace_prefix)
+    cprof_enable_trace(trace_prefix);
 
-        laptime = ig_conveyor(tgt, pckindx, l_num_req,  ltable);
+  // the conveyor models reuse one set of conveyors and one per-destination plan
+  IndexGather<int64_t> ig;
+  double plan_time = wall_seconds();
+  ig.plan(pckindx, l_num_req);
+  plan_time = wall_seconds() - plan_time;
+  T0_fprintf(stderr,"Plan for the conveyor models built in %8.3lf seconds\n", lgp_reduce_max_d(plan_time));
 
-     injection_bw = volume_per_node / laptime;
-     T0_fprintf(stderr,"  %8.3lf seconds\n", laptime);
-   
-     num_errors += ig_check_and_zero(use_model, tgt, index, l_num_req);
+  // the threaded models split the same requests over the threads of each PE
+  std::unique_ptr<ThreadedGather<int64_t> > tg;
+  if (models_mask == 0 || (models_mask & (THREADED_MODEL | THREADED_NBI_MODEL))) {
+    tg.reset(new ThreadedGather<int64_t>((int)ig_threads));
+    tg->plan(pckindx, l_num_req);
+    if (tg->threads() < ig_threads)
+      T0_fprintf(stderr,"The SHMEM library has no SHMEM_THREAD_MULTIPLE; the threaded models run on one thread\n");
+  }
 
-  total_errors = num_errors;
+  if (energy_file)
+    energy_start(energy_file, energy_interval);
+  // an index read and a value returned per request, as in the Chapel stopTimer
+  total_errors = ig_run_models("ig_cyclic", models_mask, tgt, index, pckindx, l_num_req, ltable, buf_cnt, ig, hops, llink, chain,
+                               sample_every, stats_file, 2*sizeof(int64_t), tg.get());
   if( total_errors ) {
     T0_fprintf(stderr,"YOU FAILED!!!!\n");
   } 
 
+  energy_stop();
+  cprof_finish_trace();
+  cprof_report(stderr, prof_file);
+  if (matrix_prefix)
+    cprof_write_matrix(matrix_prefix);
+  // same requests and table per PE at the target PE count
+  mem_report(stderr, l_num_req*THREADS, mem_pes, mem_pes > 0 ? l_num_req*mem_pes : 0);
+
+  tg.reset();
   lgp_barrier();
-  lgp_all_free(table);
-  free(index);
-  free(pckindx);
-  free(tgt);
+  mem_lgp_all_free(table);
+  mem_lgp_all_free(link);
+  mem_policy_free(chain);
+  mem_policy_free(index);
+  mem_policy_free(pckindx);
+  mem_policy_free(tgt);
   lgp_finalize();
   return(0);
 }
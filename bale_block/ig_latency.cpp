@@ -0,0 +1,177 @@
+/*! \file ig_latency.cpp
+ * \brief Latency of small index gathers, per transport and batch size.
+ *
+ * For every batch size in -B, every PE gathers that many table entries
+ * warmup + trials times on each transport of BatchGather in -M, and once
+ * more with BatchGather picking the transport itself. Every gather starts
+ * at a barrier and each PE times its own part. The p50, p99 and max over
+ * the trials and PEs are printed and, with -J, recorded. The transports
+ * gather the same indices in the same trial.
+ */
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "index_gather.h"
+#include "bench_harness.h"
+#include "index_gen.h"
+#include "mem_policy.h"
+
+#define THREADS shmem_n_pes()
+#define MYTHREAD shmem_my_pe()
+
+/* bits of the -M transport mask */
+#define LAT_NBI     1
+#define LAT_SMALL   2
+#define LAT_BULK    4
+#define LAT_PICKED  8
+
+int main(int argc, char * argv[]) {
+
+  lgp_init(argc, argv);
+
+  char *sizes = NULL;               // batch sizes per PE, comma separated
+  int64_t ltab_siz = 100000;
+  int64_t mask = 0;                 // all transports
+  int64_t small_bytes = 1 << 20;    // buffer memory of each small conveyor
+  int64_t nbi_max = 256;            // largest batch that defaults to shmem_getmem_nbi
+  int64_t small_max = 65536;        // largest batch that defaults to the small conveyors
+  int64_t cores_per_node = 0;       // PEs per node for GB/s/node; 0 counts the PEs that share memory
+  char *pattern = NULL;             // request index pattern, see common/index_gen.h
+  int64_t seed = 208;               // seed of the request indices
+  int64_t warmup = 8;               // untimed gathers of each batch size and transport
+  int64_t trials = 100;             // timed gathers of each
+  char *json_file = NULL;           // one benchmark record per batch size and transport
+  int64_t total_errors = 0L;
+  int64_t printhelp = 0;
+
+  int opt;
+  while( (opt = getopt(argc, argv, "hB:T:M:b:x:X:c:D:s:w:K:J:")) != -1 ) {
+    switch(opt) {
+    case 'h': printhelp = 1; break;
+    case 'B': sizes = optarg; break;
+    case 'T': sscanf(optarg,"%ld" ,&ltab_siz);   break;
+    case 'M': sscanf(optarg,"%ld" ,&mask);  break;
+    case 'b': sscanf(optarg,"%ld" ,&small_bytes);  break;
+    case 'x': sscanf(optarg,"%ld" ,&nbi_max);  break;
+    case 'X': sscanf(optarg,"%ld" ,&small_max);  break;
+    case 'c': sscanf(optarg,"%ld" ,&cores_per_node); break;
+    case 'D': pattern = optarg; break;
+    case 's': sscanf(optarg,"%ld" ,&seed); break;
+    case 'w': sscanf(optarg,"%ld" ,&warmup); break;
+    case 'K': sscanf(optarg,"%ld" ,&trials); break;
+    case 'J': json_file = optarg; break;
+    default:  break;
+    }
+  }
+
+  std::vector<int64_t> batches;
+  std::string list = sizes ? sizes : "1,16,256,4096,65536";
+  for (const char *p = list.c_str(); p != NULL; p = strchr(p, ',') ? strchr(p, ',') + 1 : NULL)
+    batches.push_back(atol(p));
+  int64_t max_batch = 0;
+  for (size_t k = 0; k < batches.size(); k++)
+    max_batch = std::max(max_batch, batches[k]);
+  if (mask == 0)
+    mask = LAT_NBI | LAT_SMALL | LAT_BULK | LAT_PICKED;
+
+  T0_fprintf(stderr,"Running ig_latency on %d threads\n", THREADS);
+  T0_fprintf(stderr,"Batch sizes / thread                 (-B)= %s\n", list.c_str());
+  T0_fprintf(stderr,"Table size / thread                  (-T)= %ld\n", ltab_siz);
+  T0_fprintf(stderr,"Small conveyor buffer bytes          (-b)= %ld\n", small_bytes);
+  T0_fprintf(stderr,"Largest batch for nbi by default     (-x)= %ld\n", nbi_max);
+  T0_fprintf(stderr,"Largest batch for small by default   (-X)= %ld\n", small_max);
+  IndexGen gen;
+  if (!gen.parse(pattern ? pattern : "uniform", (uint64_t)seed)) {
+    T0_fprintf(stderr,"ERROR: -D takes uniform|zipf:s|hotspot:f:p|local:p:w|chapel\n");
+    lgp_global_exit(1);
+  }
+  T0_fprintf(stderr,"Request index pattern                (-D)= %s\n", gen.name());
+  T0_fprintf(stderr,"Seed of the request indices          (-s)= %ld\n", seed);
+  bench_set((int)warmup, (int)trials, (int)cores_per_node, json_file);
+  T0_fprintf(stderr,"PEs per node for GB/s/node           (-c)= %d\n", bench_pes_per_node());
+  T0_fprintf(stderr,"Warmup gathers of each               (-w)= %d\n", bench_options().warmup);
+  T0_fprintf(stderr,"Timed gathers of each                (-K)= %d\n", bench_options().trials);
+  T0_fprintf(stderr,"Benchmark record file                (-J)= %s\n", json_file ? json_file : "none");
+  T0_fprintf(stderr,"transport mask                       (-M)= %ld\n", mask);
+  T0_fprintf(stderr,"transport mask is or of 1,2,4,8 for shmem_getmem_nbi,small-buffer conveyors,conveyors,picked per batch\n");
+  if (printhelp || max_batch < 1 || ltab_siz < 1)
+    lgp_global_exit(printhelp ? 0 : 1);
+
+  // the table holds the negative of its shared index, so that checking is easy
+  int64_t tab_siz = ltab_siz*THREADS;
+  int64_t *table  = (int64_t*)mem_lgp_all_alloc(tab_siz, sizeof(int64_t), "table", MEM_PER_ELT); assert(table != NULL);
+  int64_t *ltable = lgp_local_part(int64_t, table);
+  for (int64_t i = 0; i < ltab_siz; i++)
+    ltable[i] = (-1)*(MYTHREAD*ltab_siz + i + 1);
+
+  int64_t *index   = (int64_t*)mem_policy_calloc(max_batch, sizeof(int64_t), "index", MEM_PER_ELT); assert(index != NULL);
+  int64_t *pckindx = (int64_t*)mem_policy_calloc(max_batch, sizeof(int64_t), "pckindx", MEM_PER_ELT); assert(pckindx != NULL);
+  int64_t *tgt     = (int64_t*)mem_policy_calloc(max_batch, sizeof(int64_t), "tgt", MEM_PER_ELT); assert(tgt != NULL);
+
+  bench_param("T", ltab_siz);
+  bench_param("b", small_bytes);
+  bench_param("x", nbi_max);
+  bench_param("X", small_max);
+  bench_param("D", gen.name());
+  bench_param("s", seed);
+
+  // the picking gather learns from its own gathers only
+  BatchGather<int64_t> fixed((size_t)small_bytes, nbi_max, small_max);
+  BatchGather<int64_t> picker((size_t)small_bytes, nbi_max, small_max);
+  lgp_barrier();
+
+  T0_fprintf(stderr,"%10s %-8s %10s %10s %10s  %s\n", "batch/PE", "transport", "p50 us", "p99 us", "max us", "picked");
+  for (size_t k = 0; k < batches.size(); k++) {
+    int64_t n = batches[k];
+    for (int t = 0; t <= BatchGather<int64_t>::NTRANSPORTS; t++) {
+      if (!(mask & (1 << t)))
+        continue;
+      bool picking = t == BatchGather<int64_t>::NTRANSPORTS;
+      BatchGather<int64_t> &bg = picking ? picker : fixed;
+      if (!picking)
+        bg.force(t);
+      std::string variant = std::string(BatchGather<int64_t>::name(t)) + "/" + std::to_string(n);
+      Bench bench("ig_latency", variant.c_str());
+      int64_t picked[BatchGather<int64_t>::NTRANSPORTS] = {0};
+      int64_t errors = 0;
+
+      for (int it = 0; it < bench.iterations(); it++) {
+        gen.generate(index, ((int64_t)it*THREADS + MYTHREAD)*n, n, n*THREADS*bench.iterations(), tab_siz, 1);
+        for (int64_t i = 0; i < n; i++)
+          pckindx[i] = ((index[i] % ltab_siz) << 16) | ((index[i] / ltab_siz) & 0xffff);
+        lgp_barrier();
+        double tm = wall_seconds();
+        int used = bg.gather(tgt, pckindx, n, ltable);
+        bench.record(it, wall_seconds() - tm);
+        if (!bench.is_warmup(it))
+          picked[used]++;
+        for (int64_t i = 0; i < n; i++)
+          if (tgt[i] != -(index[i] + 1))
+            errors++;
+      }
+      BenchResult r = bench.finish(n*THREADS, 2*sizeof(int64_t)*n);
+      errors = lgp_reduce_add_l(errors);
+      total_errors += errors;
+
+      std::string how;
+      for (int u = 0; picking && u < BatchGather<int64_t>::NTRANSPORTS; u++)
+        if (picked[u] > 0)
+          how += std::string(how.empty() ? "" : " ") + BatchGather<int64_t>::name(u) + " " + std::to_string(picked[u]);
+      T0_fprintf(stderr,"%10ld %-8s %10.1lf %10.1lf %10.1lf  %s%s\n", n, BatchGather<int64_t>::name(t),
+                 r.median*1.0e6, r.p99*1.0e6, r.max*1.0e6, how.c_str(), errors ? " WRONG" : "");
+    }
+  }
+
+  if( total_errors ) {
+    T0_fprintf(stderr,"YOU FAILED!!!!\n");
+  }
+
+  lgp_barrier();
+  mem_lgp_all_free(table);
+  mem_policy_free(index);
+  mem_policy_free(pckindx);
+  mem_policy_free(tgt);
+  lgp_finalize();
+  return(0);
+}
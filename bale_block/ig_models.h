@@ -0,0 +1,878 @@
+/******************************************************************
+//
+//
+//  Copyright(C) 2018, Institute for Defense Analyses
+//  4850 Mark Center Drive, Alexandria, VA; 703-845-2500
+//  This material may be reproduced by or for the US Government
+//  pursuant to the copyright license under the clauses at DFARS
+//  252.227-7013 and 252.227-7014.
+//
+//
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//    * Redistributions of source code must retain the above copyright
+//      notice, this list of conditions and the following disclaimer.
+//    * Redistributions in binary form must reproduce the above copyright
+//      notice, this list of conditions and the following disclaimer in the
+//      documentation and/or other materials provided with the distribution.
+//    * Neither the name of the copyright holder nor the
+//      names of its contributors may be used to endorse or promote products
+//      derived from this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+//  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+//  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+//  COPYRIGHT HOLDER NOR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+//  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+//  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+//  SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+//  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+//  STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+//  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+//  OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+ *****************************************************************/
+
+/*! \file ig_models.h
+ * \brief The programming model variants of indexgather shared by ig_block and ig_cyclic.
+ *
+ * Every variant gathers tgt[i] = table[index[i]] from the same packed
+ * indices, so the models can be timed and checked against each other in
+ * one run. pckindx[i] holds (local index << 16) | pe, which makes the
+ * kernels independent of the block or cyclic layout of the table.
+ */
+#ifndef IG_MODELS_H
+#define IG_MODELS_H
+
+#include <shmem.h>
+extern "C" {
+#include <spmat.h>
+#include <exstack.h>
+#include <convey.h>
+}
+#include "index_gather.h"
+#ifdef __cpp_impl_coroutine
+#include "convey_coro.h"
+#endif
+#include "bench_harness.h"
+#include "energy_sampler.h"
+#include "mem_policy.h"
+
+#define THREADS shmem_n_pes()
+#define MYTHREAD shmem_my_pe()
+
+/* bits of the -M models_mask */
+#define AGP_MODEL        1   /*!< blocking shmem_g per request */
+#define EXSTACK_MODEL    2   /*!< bulk synchronous exstack */
+#define EXSTACK2_MODEL   4   /*!< asynchronous exstack2 */
+#define CONVEY_MODEL     8   /*!< conveyors */
+#define ALTERNATE_MODEL 16   /*!< non-blocking shmem_get_nbi in batches of buf_cnt */
+#define CONVEY_LOCAL_MODEL 32 /*!< conveyors for off-node requests, shmem_ptr loads for the rest */
+#define MULTIHOP_MODEL  64   /*!< chains of hops lookups forwarded from PE to PE on conveyors */
+#define CONVEY_PROGRESS_MODEL 128 /*!< conveyors driven by a progress thread per PE */
+#define CORO_MODEL     256   /*!< one C++20 coroutine per request on conveyors, needs a C++20 build */
+#define THREADED_MODEL 512   /*!< conveyors, one pair per thread of each PE */
+#define THREADED_NBI_MODEL 1024 /*!< shmem_ctx_getmem_nbi on one context per thread of each PE */
+#define ALL_MODELS    2047
+
+typedef struct ig_pkg_t {
+  int64_t idx;
+  int64_t val;
+} ig_pkg_t;
+
+/*!
+ * \brief This routine implements the AGP variant of indexgather with a blocking shmem_g per request.
+ * \param *tgt array of target locations for the gathered values
+ * \param *pckindx array of packed indices for the distributed version of the global array of counts.
+ * \param l_num_req the length of the pcindx array
+ * \param *ltable localized pointer to the count array.
+ * \return this thread's run time
+ *
+ */
+static double ig_agp(int64_t *tgt, int64_t *pckindx, int64_t l_num_req,  int64_t *ltable) {
+  double tm;
+  int64_t i, pe, lindx;
+  lgp_barrier();
+  tm = wall_seconds();
+
+  for (i = 0; i < l_num_req; i++) {
+    lindx = pckindx[i] >> 16;
+    pe = pckindx[i] & 0xffff;
+    tgt[i] = shmem_int64_g(ltable + lindx, pe);
+  }
+
+  tm = wall_seconds() - tm;
+  lgp_barrier();
+
+  return( tm );
+}
+
+/*!
+ * \brief This routine implements the AGP variant of indexgather with non-blocking gets.
+ * The gets are issued with shmem_int64_get_nbi and completed with a shmem_quiet
+ * after every buf_cnt requests.
+ * \param *tgt array of target locations for the gathered values
+ * \param *pckindx array of packed indices for the distributed version of the global array of counts.
+ * \param l_num_req the length of the pcindx array
+ * \param *ltable localized pointer to the count array.
+ * \param buf_cnt number of gets in flight between quiets
+ * \return this thread's run time
+ *
+ */
+static double ig_agp_nbi(int64_t *tgt, int64_t *pckindx, int64_t l_num_req,  int64_t *ltable, int64_t buf_cnt) {
+  double tm;
+  int64_t i, j, end, pe, lindx;
+  lgp_barrier();
+  tm = wall_seconds();
+
+  for (i = 0; i < l_num_req; i = end) {
+    end = (i + buf_cnt < l_num_req) ? i + buf_cnt : l_num_req;
+    for (j = i; j < end; j++) {
+      lindx = pckindx[j] >> 16;
+      pe = pckindx[j] & 0xffff;
+      shmem_int64_get_nbi(&tgt[j], ltable + lindx, 1, pe);
+    }
+    shmem_quiet();
+  }
+
+  tm = wall_seconds() - tm;
+  lgp_barrier();
+
+  return( tm );
+}
+
+/*!
+ * \brief This routine implements the exstack variant of indexgather.
+ * Requests and replies share one exstack: every PE receives at most buf_cnt
+ * requests from a given PE per exchange, so the replies always fit.
+ * \param *tgt array of target locations for the gathered values
+ * \param *pckindx array of packed indices for the distributed version of the global array of counts.
+ * \param l_num_req the length of the pcindx array
+ * \param *ltable localized pointer to the count array.
+ * \param buf_cnt number of packages in the exstack buffers
+ * \return this thread's run time
+ *
+ */
+static double ig_exstack(int64_t *tgt, int64_t *pckindx, int64_t l_num_req,  int64_t *ltable, int64_t buf_cnt) {
+  double tm;
+  int64_t i, pe, fromth;
+  ig_pkg_t pkg;
+
+  exstack_t * ex = exstack_init(buf_cnt, sizeof(ig_pkg_t));
+  assert( ex != NULL );
+
+  lgp_barrier();
+  tm = wall_seconds();
+
+  i = 0;
+  while (exstack_proceed(ex, (i == l_num_req))) {
+    for (; i < l_num_req; i++) {
+      pkg.idx = i;
+      pkg.val = pckindx[i] >> 16;
+      pe = pckindx[i] & 0xffff;
+      if (! exstack_push(ex, &pkg, pe))
+        break;
+    }
+
+    exstack_exchange(ex);
+
+    while (exstack_pop(ex, &pkg, &fromth)) {
+      pkg.val = ltable[pkg.val];
+      exstack_push(ex, &pkg, fromth);
+    }
+
+    lgp_barrier();
+    exstack_exchange(ex);
+
+    while (exstack_pop(ex, &pkg, &fromth))
+      tgt[pkg.idx] = pkg.val;
+  }
+
+  tm = wall_seconds() - tm;
+  lgp_barrier();
+
+  exstack_free(ex);
+  return( tm );
+}
+
+/*!
+ * \brief This routine implements the exstack2 variant of indexgather.
+ * \param *tgt array of target locations for the gathered values
+ * \param *pckindx array of packed indices for the distributed version of the global array of counts.
+ * \param l_num_req the length of the pcindx array
+ * \param *ltable localized pointer to the count array.
+ * \param buf_cnt number of packages in the exstack2 buffers
+ * \return this thread's run time
+ *
+ */
+static double ig_exstack2(int64_t *tgt, int64_t *pckindx, int64_t l_num_req,  int64_t *ltable, int64_t buf_cnt) {
+  double tm;
+  int64_t i, pe, fromth;
+  ig_pkg_t pkg;
+  bool more;
+
+  exstack2_t * requests = exstack2_init(buf_cnt, sizeof(ig_pkg_t));
+  assert( requests != NULL );
+  exstack2_t * replies = exstack2_init(buf_cnt, sizeof(ig_pkg_t));
+  assert( replies != NULL );
+
+  lgp_barrier();
+  tm = wall_seconds();
+
+  i = 0;
+  while (more = exstack2_proceed(requests, (i == l_num_req)),
+         more | exstack2_proceed(replies, !more)) {
+
+    for (; i < l_num_req; i++) {
+      pkg.idx = i;
+      pkg.val = pckindx[i] >> 16;
+      pe = pckindx[i] & 0xffff;
+      if (! exstack2_push(requests, &pkg, pe))
+        break;
+    }
+
+    while (exstack2_pop(requests, &pkg, &fromth)) {
+      pkg.val = ltable[pkg.val];
+      if (! exstack2_push(replies, &pkg, fromth)) {
+        exstack2_unpop(requests);
+        break;
+      }
+    }
+
+    while (exstack2_pop(replies, &pkg, &fromth))
+      tgt[pkg.idx] = pkg.val;
+  }
+
+  tm = wall_seconds() - tm;
+  lgp_barrier();
+
+  exstack2_free(requests);
+  exstack2_free(replies);
+  return( tm );
+}
+
+/*!
+ * \brief This routine implements the conveyor variant of indexgather.
+ * The conveyors and the per-destination plan live in the IndexGather
+ * object, so only the gather itself is timed.
+ * \param &ig the gather object holding the conveyors and the plan for pckindx
+ * \param *tgt array of target locations for the gathered values
+ * \param *ltable localized pointer to the count array.
+ * \return this thread's run time
+ *
+ */
+static double ig_conveyor(IndexGather<int64_t> &ig, int64_t *tgt, int64_t *ltable) {
+  double tm;
+
+  lgp_barrier();
+  tm = wall_seconds();
+
+  {
+    ConveyPhase ph("ig_conveyor");
+    ig.gather(tgt, ltable);
+  }
+
+  tm = wall_seconds() - tm;
+  lgp_barrier();
+
+  return( tm );
+}
+
+/*! \brief One PE's GatherStats boiled down to a fixed size row, collected on thread 0. */
+typedef struct ig_pe_stats_t {
+  double completion;
+  int64_t advance_calls;
+  int64_t pushes;
+  int64_t push_fails;
+  int64_t samples;
+  double lat_p50;
+  double lat_p99;
+  double lat_max;
+  int64_t hist[GatherStats::NBINS];
+} ig_pe_stats_t;
+
+/*!
+ * \brief Collect every thread's GatherStats on thread 0, print the stragglers and
+ * optionally write one JSON object per thread.
+ * Each line has the model, the completion time, advance calls, pushes, push failures,
+ * the sampled round trip quantiles in microseconds and the round trip
+ * histogram, where entry b counts samples in [2^b, 2^(b+1)) ns.
+ * \param *st this thread's stats from the last gather
+ * \param *stats_file file for the JSON lines, or NULL
+ * \param *model the model's name, for the "model" field
+ * \param append add to stats_file rather than start it afresh
+ */
+static void ig_report_stats(GatherStats *st, const char *stats_file, const char *model, bool append) {
+  ig_pe_stats_t row;
+  int64_t i, b;
+
+  row.completion = st->completion;
+  row.advance_calls = st->advance_calls;
+  row.pushes = st->pushes;
+  row.push_fails = st->push_fails;
+  row.samples = (int64_t)st->latency.size();
+  row.lat_p50 = st->quantile(0.50);
+  row.lat_p99 = st->quantile(0.99);
+  row.lat_max = st->quantile(1.0);
+  memcpy(row.hist, st->hist, sizeof(row.hist));
+
+  ig_pe_stats_t *rows = (ig_pe_stats_t*)shmem_malloc(THREADS * sizeof(ig_pe_stats_t)); assert(rows != NULL);
+  shmem_putmem(&rows[MYTHREAD], &row, sizeof(row), 0);
+  lgp_barrier();
+
+  if (MYTHREAD == 0) {
+    std::vector<int64_t> by_time(THREADS);
+    int64_t hist[GatherStats::NBINS] = {0};
+    int64_t samples = 0;
+    for (i = 0; i < THREADS; i++) {
+      by_time[i] = i;
+      samples += rows[i].samples;
+      for (b = 0; b < GatherStats::NBINS; b++)
+        hist[b] += rows[i].hist[b];
+    }
+    std::sort(by_time.begin(), by_time.end(),
+              [&](int64_t x, int64_t y) { return rows[x].completion > rows[y].completion; });
+    double median = rows[by_time[THREADS/2]].completion;
+
+    fprintf(stderr,"    completion: median %8.3lf  max %8.3lf seconds (thread %ld, %5.2lfx the median)\n",
+            median, rows[by_time[0]].completion, by_time[0],
+            median > 0.0 ? rows[by_time[0]].completion / median : 0.0);
+    for (i = 0; i < THREADS && i < 4; i++) {
+      ig_pe_stats_t *r = &rows[by_time[i]];
+      fprintf(stderr,"    straggler %ld: thread %5ld %8.3lf s %9ld advances %9ld push fails, rtt p50 %8.1lf p99 %8.1lf us\n",
+              i, by_time[i], r->completion, r->advance_calls, r->push_fails, 1.0e6*r->lat_p50, 1.0e6*r->lat_p99);
+    }
+    if (samples > 0) {
+      // the bins that hold the median and the 99th percentile of all samples
+      int64_t seen = 0, b50 = -1, b99 = -1;
+      for (b = 0; b < GatherStats::NBINS; b++) {
+        seen += hist[b];
+        if (b50 < 0 && 2*seen >= samples) b50 = b;
+        if (b99 < 0 && 100*seen >= 99*samples) b99 = b;
+      }
+      fprintf(stderr,"    %ld sampled round trips: p50 < %8.1lf us, p99 < %8.1lf us\n",
+              samples, (double)(1L << (b50 + 1)) * 1.0e-3, (double)(1L << (b99 + 1)) * 1.0e-3);
+    }
+
+    FILE *fp = stats_file ? fopen(stats_file, append ? "a" : "w") : NULL;
+    if (stats_file && fp == NULL)
+      fprintf(stderr,"ERROR: can't open %s\n", stats_file);
+    for (i = 0; fp != NULL && i < THREADS; i++) {
+      ig_pe_stats_t *r = &rows[i];
+      fprintf(fp, "{\"model\":\"%s\",\"pe\":%ld,\"completion_s\":%.6lf,\"advance_calls\":%ld,\"pushes\":%ld,\"push_fails\":%ld,"
+              "\"samples\":%ld,\"rtt_p50_us\":%.3lf,\"rtt_p99_us\":%.3lf,\"rtt_max_us\":%.3lf,\"rtt_hist_log2ns\":[",
+              model, i, r->completion, r->advance_calls, r->pushes, r->push_fails,
+              r->samples, 1.0e6*r->lat_p50, 1.0e6*r->lat_p99, 1.0e6*r->lat_max);
+      int64_t last = GatherStats::NBINS - 1;
+      while (last > 0 && r->hist[last] == 0)
+        last--;
+      for (b = 0; b <= last; b++)
+        fprintf(fp, b ? ",%ld" : "%ld", r->hist[b]);
+      fprintf(fp, "]}\n");
+    }
+    if (fp != NULL)
+      fclose(fp);
+  }
+
+  lgp_barrier();
+  shmem_free(rows);
+}
+
+/*!
+ * \brief This routine implements the conveyor variant of indexgather with a node-local shortcut.
+ * Requests to PEs whose table is directly addressable through shmem_ptr
+ * (the PEs on this node) are served by loads from the peer's ltable, only
+ * the other requests go through the conveyors.
+ * \param &ig the gather object holding the conveyors and the plan for pckindx
+ * \param *tgt array of target locations for the gathered values
+ * \param *ltable localized pointer to the count array.
+ * \param *local_frac set to the fraction of all requests that were served node-locally
+ * \return this thread's run time
+ *
+ */
+static double ig_conveyor_local(IndexGather<int64_t> &ig, int64_t *tgt, int64_t *ltable, double *local_frac) {
+  double tm;
+
+  ig.set_node_local(true);
+  lgp_barrier();
+  tm = wall_seconds();
+
+  {
+    ConveyPhase ph("ig_conv_local");
+    ig.gather(tgt, ltable);
+  }
+
+  tm = wall_seconds() - tm;
+  lgp_barrier();
+  ig.set_node_local(false);
+
+  *local_frac = (double)lgp_reduce_add_l(ig.num_local()) / (double)lgp_reduce_add_l(ig.num_requests());
+  return( tm );
+}
+
+/*!
+ * \brief The conveyor variant with a progress thread per PE.
+ * The progress thread advances the conveyors and serves the incoming
+ * requests, while the PE only queues its requests and stores the replies
+ * (IndexGather::set_progress). Without SHMEM_THREAD_SERIALIZED it runs
+ * like the conveyor model.
+ * \param &ig the gather object holding the conveyors and the plan for pckindx
+ * \param *tgt array of target locations for the gathered values
+ * \param *ltable localized pointer to the count array.
+ * \return this thread's run time
+ *
+ */
+static double ig_conveyor_progress(IndexGather<int64_t> &ig, int64_t *tgt, int64_t *ltable) {
+  double tm;
+
+  ig.set_progress(true);
+  lgp_barrier();
+  tm = wall_seconds();
+
+  {
+    ConveyPhase ph("ig_conv_progress");
+    ig.gather(tgt, ltable);
+  }
+
+  tm = wall_seconds() - tm;
+  lgp_barrier();
+  ig.set_progress(false);
+
+  return( tm );
+}
+
+/*!
+ * \brief The conveyor variant split over the threads of each PE (ThreadedGather).
+ * Every thread gathers its slice of the requests on its own conveyors and
+ * serves the requests that arrive on them.
+ * \param &tg the threaded gather, planned for pckindx
+ * \param *tgt array of target locations for the gathered values
+ * \param *ltable localized pointer to the count array.
+ * \return this thread's run time
+ *
+ */
+static double ig_threaded(ThreadedGather<int64_t> &tg, int64_t *tgt, int64_t *ltable) {
+  double tm;
+
+  lgp_barrier();
+  tm = wall_seconds();
+
+  {
+    ConveyPhase ph("ig_threaded");
+    tg.gather(tgt, ltable);
+  }
+
+  tm = wall_seconds() - tm;
+  lgp_barrier();
+
+  return( tm );
+}
+
+/*!
+ * \brief The non-blocking AGP variant split over the threads of each PE.
+ * Every thread issues the gets of its slice on its own shmem_ctx and
+ * quiets only that context after every buf_cnt requests.
+ * \param &tg the threaded gather, planned for pckindx
+ * \param *tgt array of target locations for the gathered values
+ * \param *pckindx array of packed indices for the distributed version of the global array of counts.
+ * \param *ltable localized pointer to the count array.
+ * \param buf_cnt number of gets in flight between quiets on each thread
+ * \return this thread's run time
+ *
+ */
+static double ig_threaded_nbi(ThreadedGather<int64_t> &tg, int64_t *tgt, int64_t *pckindx, int64_t *ltable,
+                              int64_t buf_cnt) {
+  double tm;
+
+  lgp_barrier();
+  tm = wall_seconds();
+
+  tg.gather_nbi(tgt, pckindx, ltable, buf_cnt);
+
+  tm = wall_seconds() - tm;
+  lgp_barrier();
+
+  return( tm );
+}
+
+#ifdef __cpp_impl_coroutine
+/*!
+ * \brief The conveyor variant of indexgather with one coroutine per request (convey_coro.h).
+ * The engine and its conveyors are set up before the timer starts, like the
+ * IndexGather of the conveyor model.
+ * \param *tgt array of target locations for the gathered values
+ * \param *pckindx array of packed indices for the distributed version of the global array of counts.
+ * \param l_num_req the length of the pcindx array
+ * \param *ltable localized pointer to the count array.
+ * \return this thread's run time
+ *
+ */
+static double ig_coro(int64_t *tgt, int64_t *pckindx, int64_t l_num_req, int64_t *ltable) {
+  double tm;
+  ConveyCoro<int64_t> cc(ltable);
+  IndexPlan plan(pckindx, l_num_req);
+  // run() starts the elements in order, so walk the destinations like PlanCursor,
+  // beginning after MYTHREAD so that the PEs do not all start on the same target
+  int64_t pe = (MYTHREAD + 1) % THREADS;
+  int64_t j = plan.begin(pe);
+
+  lgp_barrier();
+  tm = wall_seconds();
+
+  {
+    ConveyPhase ph("ig_coro");
+    cc.run(l_num_req, [&](int64_t) -> ConveyTask {
+      while (j == plan.end(pe)) {
+        pe = pe + 1 == THREADS ? 0 : pe + 1;
+        j = plan.begin(pe);
+      }
+      int64_t i = plan.request(j);
+      int64_t lindx = plan.local_index(j++);
+      tgt[i] = co_await cc.remote_get(pe, lindx);
+    });
+  }
+
+  tm = wall_seconds() - tm;
+  lgp_barrier();
+
+  return( tm );
+}
+#endif
+
+/*!
+ * \brief The global index that the link table stores at global index g.
+ * A fixed scramble so that every driver can lay out the link table in its
+ * own distribution and still predict where a chain ends.
+ */
+static inline int64_t ig_next_hop(int64_t g, int64_t tab_siz) {
+  return (int64_t)(((uint64_t)g * 2654435761ULL + 12345ULL) % (uint64_t)tab_siz);
+}
+
+/*!
+ * \brief This routine implements the multi-hop (pointer chasing) variant of indexgather.
+ * Each request follows hops-1 links through llink before it reads ltable,
+ * all in flight at once on the MultiHopGather conveyors. For comparison it
+ * also times the same chains done as hops separate planned IndexGathers
+ * with a barrier after each.
+ * \param *tgt array of target locations for the gathered values
+ * \param *pckindx array of packed indices for the first hop
+ * \param l_num_req the length of the arrays
+ * \param *llink localized pointer to the link table of packed indices
+ * \param *ltable localized pointer to the count array.
+ * \param hops number of lookups per chain
+ * \param *hop_by_hop_time set to this thread's time for the separate gathers
+ * \return this thread's run time
+ *
+ */
+static double ig_multihop(int64_t *tgt, int64_t *pckindx, int64_t l_num_req,
+                          int64_t *llink, int64_t *ltable, int64_t hops, double *hop_by_hop_time) {
+  double tm;
+  std::vector<const int64_t*> links(hops - 1, llink);
+
+  MultiHopGather<int64_t> mh(hops);
+  mh.plan(pckindx, l_num_req);
+
+  lgp_barrier();
+  tm = wall_seconds();
+
+  {
+    ConveyPhase ph("ig_multihop");
+    mh.gather(tgt, links.data(), ltable);
+  }
+
+  tm = wall_seconds() - tm;
+  lgp_barrier();
+  double multihop_time = tm;
+
+  // the same chains one bulk synchronous gather per hop; hop 0's indices are
+  // known in advance, as for mh, so only the later hops are planned in the timing
+  IndexGather<int64_t> step;
+  std::vector<int64_t> cur(pckindx, pckindx + l_num_req);
+  std::vector<int64_t> out(l_num_req);
+  step.plan(cur.data(), l_num_req);
+
+  lgp_barrier();
+  tm = wall_seconds();
+
+  for (int64_t h = 0; h < hops; h++) {
+    ConveyPhase ph("ig_hop_by_hop");
+    if (h > 0)
+      step.plan(cur.data(), l_num_req);
+    step.gather(out.data(), h < hops - 1 ? llink : ltable);
+    lgp_barrier();
+    cur.swap(out);
+  }
+
+  tm = wall_seconds() - tm;
+  lgp_barrier();
+  *hop_by_hop_time = tm;
+
+  return( multihop_time );
+}
+
+/*!
+ * \brief Check the gathered values, compare them with another model's result and zero tgt.
+ * \param use_model the model that produced tgt
+ * \param *tgt the gathered values
+ * \param *ref the values gathered by an earlier model, or NULL
+ * \param *index the global indices of the requests
+ * \param l_num_req the length of the arrays
+ * \return the number of errors on this thread
+ */
+static int64_t ig_check_and_zero(int64_t use_model, int64_t *tgt, int64_t *ref, int64_t *index, int64_t l_num_req) {
+  int64_t errors=0;
+  int64_t i;
+  lgp_barrier();
+  for(i=0; i<l_num_req; i++){
+    if(tgt[i] != (-1)*(index[i] + 1)){
+      errors++;
+      if(errors < 5)  // print first five errors, report all the errors
+        fprintf(stderr,"ERROR: model %ld: Thread %d: tgt[%ld] = %ld != %ld)\n",
+                use_model,  MYTHREAD, i, tgt[i], (-1)*(index[i] + 1));
+               //use_model,  MYTHREAD, i, tgt[i],(-1)*(i*THREADS+MYTHREAD + 1) );
+    } else if(ref != NULL && tgt[i] != ref[i]){
+      errors++;
+      if(errors < 5)
+        fprintf(stderr,"ERROR: model %ld: Thread %d: tgt[%ld] = %ld differs from the first model's %ld\n",
+                use_model,  MYTHREAD, i, tgt[i], ref[i]);
+    }
+    tgt[i] = 0;
+  }
+  if( errors > 0 )
+    fprintf(stderr,"ERROR: %ld: %ld total errors on thread %d\n", use_model, errors, MYTHREAD);
+  lgp_barrier();
+  return(errors);
+}
+
+/*!
+ * \brief Start a model's energy and memory phase.
+ * \return the memory phase to go back to when the model is done
+ */
+static int64_t ig_phase(const char *name) {
+  energy_mark(name);
+  return MemAccount::get().enter(name);
+}
+
+/*! \brief The variant name of a model in the memory, energy and benchmark records. */
+static const char* ig_model_name(int64_t use_model) {
+  switch (use_model) {
+  case AGP_MODEL:          return "agp";
+  case EXSTACK_MODEL:      return "exstack";
+  case EXSTACK2_MODEL:     return "exstack2";
+  case CONVEY_MODEL:       return "conveyor";
+  case ALTERNATE_MODEL:    return "agp_nbi";
+  case CONVEY_LOCAL_MODEL: return "conveyor_local";
+  case MULTIHOP_MODEL:     return "multihop";
+  case CONVEY_PROGRESS_MODEL: return "conveyor_progress";
+  case CORO_MODEL:         return "coroutine";
+  case THREADED_MODEL:     return "conveyor_threads";
+  case THREADED_NBI_MODEL: return "agp_nbi_threads";
+  }
+  return "unknown";
+}
+
+/*!
+ * \brief Run, time and check every model selected in models_mask on the same requests.
+ * Each model runs the bench_harness.h warmup and trials; the times are the
+ * median over the threads and trials. The first model's result is kept and
+ * every later model is compared against it.
+ * \param *kernel the driver's name in the benchmark records
+ * \param models_mask or of the *_MODEL bits, 0 for all of them
+ * \param *tgt array of target locations for the gathered values
+ * \param *index the global indices of the requests
+ * \param *pckindx the same indices packed as (local index, thread)
+ * \param l_num_req the length of the arrays
+ * \param *ltable localized pointer to the table
+ * \param buf_cnt number of packages in the buffers of the buffered models
+ * \param &ig the gather object used by the conveyor models, planned for pckindx
+ * \param hops number of lookups per chain in the multi-hop model
+ * \param *llink localized pointer to the link table of the multi-hop model
+ * \param *chain global index at the end of each request's chain, what the multi-hop model is checked against
+ * \param sample_every sample the round trip of one conveyor request in this many, 0 for none
+ * \param *stats_file where to write the conveyor models' per-thread stats as JSON lines, or NULL;
+ *        the straggler report is printed when either this or sample_every is set.
+ *        Both cover the last trial only.
+ * \param bytes_per_request bytes one request moves, for GB/s/node
+ * \param *tg the gather of the threaded models, planned for pckindx; NULL skips them
+ * \return the number of errors over all threads
+ */
+static int64_t ig_run_models(const char *kernel, int64_t models_mask, int64_t *tgt, int64_t *index, int64_t *pckindx,
+                             int64_t l_num_req, int64_t *ltable, int64_t buf_cnt,
+                             IndexGather<int64_t> &ig, int64_t hops, int64_t *llink, int64_t *chain,
+                             int64_t sample_every, const char *stats_file, double bytes_per_request,
+                             ThreadedGather<int64_t> *tg) {
+  int64_t use_model;
+  int64_t num_errors = 0;
+  double laptime = 0.0;
+  double conveyor_time = 0.0;
+  double nbi_time = 0.0;
+  double local_frac = 0.0;
+  double hop_by_hop_time = 0.0;
+  GatherStats gather_stats;
+  bool stats_started = false;    // a later model appends to stats_file
+  int64_t *ref = NULL;
+
+  if (models_mask == 0)
+    models_mask = ALL_MODELS;
+  int64_t mem_prev = -1;
+  TlbCounter tlb;
+
+  for (use_model = 1; use_model <= ALL_MODELS; use_model *= 2) {
+    if (!(use_model & models_mask))
+      continue;
+#ifndef __cpp_impl_coroutine
+    if (use_model == CORO_MODEL) {
+      T0_fprintf(stderr,"Coroutines:           skipped, needs a C++20 build\n");
+      continue;
+    }
+#endif
+    if ((use_model == THREADED_MODEL || use_model == THREADED_NBI_MODEL) && tg == NULL)
+      continue;
+
+    Bench bench(kernel, ig_model_name(use_model));
+    Bench hop_bench(kernel, "multihop_hop_by_hop");
+    bool sample = (use_model == CONVEY_MODEL || use_model == CONVEY_PROGRESS_MODEL) &&
+                  (sample_every > 0 || stats_file != NULL);
+    if (use_model == CONVEY_PROGRESS_MODEL && lgp_reduce_min_l(ig.set_progress(true)) == 0)
+      T0_fprintf(stderr,"The SHMEM library has no SHMEM_THREAD_SERIALIZED; the progress model runs inline\n");
+    ig.set_progress(false);
+    mem_prev = ig_phase(ig_model_name(use_model));
+    tlb.start();
+    for (int it = 0; it < bench.iterations(); it++) {
+      switch (use_model) {
+      case AGP_MODEL:
+        laptime = ig_agp(tgt, pckindx, l_num_req, ltable);
+        break;
+      case EXSTACK_MODEL:
+        laptime = ig_exstack(tgt, pckindx, l_num_req, ltable, buf_cnt);
+        break;
+      case EXSTACK2_MODEL:
+        laptime = ig_exstack2(tgt, pckindx, l_num_req, ltable, buf_cnt);
+        break;
+      case CONVEY_MODEL:
+        if (sample && bench.is_last(it)) {
+          gather_stats.sample_every = sample_every;
+          ig.set_stats(&gather_stats);
+        }
+        laptime = ig_conveyor(ig, tgt, ltable);
+        ig.set_stats(NULL);
+        break;
+      case ALTERNATE_MODEL:
+        laptime = ig_agp_nbi(tgt, pckindx, l_num_req, ltable, buf_cnt);
+        break;
+      case CONVEY_LOCAL_MODEL:
+        laptime = ig_conveyor_local(ig, tgt, ltable, &local_frac);
+        break;
+      case MULTIHOP_MODEL:
+        laptime = ig_multihop(tgt, pckindx, l_num_req, llink, ltable, hops, &hop_by_hop_time);
+        hop_bench.record(it, hop_by_hop_time);
+        break;
+      case CONVEY_PROGRESS_MODEL:
+        if (sample && bench.is_last(it)) {
+          gather_stats.sample_every = sample_every;
+          ig.set_stats(&gather_stats);
+        }
+        laptime = ig_conveyor_progress(ig, tgt, ltable);
+        ig.set_stats(NULL);
+        break;
+#ifdef __cpp_impl_coroutine
+      case CORO_MODEL:
+        laptime = ig_coro(tgt, pckindx, l_num_req, ltable);
+        break;
+#endif
+      case THREADED_MODEL:
+        laptime = ig_threaded(*tg, tgt, ltable);
+        break;
+      case THREADED_NBI_MODEL:
+        laptime = ig_threaded_nbi(*tg, tgt, pckindx, ltable, buf_cnt);
+        break;
+      }
+      bench.record(it, laptime);
+    }
+    MemAccount::get().leave(mem_prev);
+    int64_t tlb_misses = tlb.stop();
+
+    // the multi-hop model moves a different volume per request, so it gets no bandwidth
+    BenchResult res = bench.finish(l_num_req * THREADS,
+                                   use_model == MULTIHOP_MODEL ? 0.0 : bytes_per_request * l_num_req);
+    switch (use_model) {
+    case AGP_MODEL:          T0_fprintf(stderr,"AGP shmem_g:        "); break;
+    case EXSTACK_MODEL:      T0_fprintf(stderr,"Exstack:            "); break;
+    case EXSTACK2_MODEL:     T0_fprintf(stderr,"Exstack2:           "); break;
+    case CONVEY_MODEL:       T0_fprintf(stderr,"Conveyor:           "); break;
+    case ALTERNATE_MODEL:    T0_fprintf(stderr,"AGP shmem_get_nbi:  "); break;
+    case CONVEY_LOCAL_MODEL: T0_fprintf(stderr,"Conveyor+shmem_ptr: "); break;
+    case MULTIHOP_MODEL:     T0_fprintf(stderr,"Multi-hop (%ld hops): ", hops); break;
+    case CONVEY_PROGRESS_MODEL: T0_fprintf(stderr,"Conveyor+progress:  "); break;
+    case CORO_MODEL:         T0_fprintf(stderr,"Coroutines:         "); break;
+    case THREADED_MODEL:     T0_fprintf(stderr,"Conveyor, %d threads: ", tg->threads()); break;
+    case THREADED_NBI_MODEL: T0_fprintf(stderr,"shmem_ctx nbi, %d threads: ", tg->threads()); break;
+    }
+    if (res.gb_per_s_per_node > 0.0)
+      T0_fprintf(stderr,"  %8.3lf seconds  %8.3lf GB/s/node\n", res.median, res.gb_per_s_per_node);
+    else
+      T0_fprintf(stderr,"  %8.3lf seconds\n", res.median);
+    T0_fprintf(stderr,"    min %8.3lf  max %8.3lf seconds over the threads and %d trials, %8.3lf M requests/s\n",
+               res.min, res.max, res.trials, res.elements_per_s * 1.0e-6);
+
+    if (lgp_reduce_min_l(tlb_misses) >= 0)
+      T0_fprintf(stderr,"    %8.3lf dTLB misses per request\n",
+                 lgp_reduce_add_l(tlb_misses) / (double)(l_num_req * THREADS * bench.iterations()));
+
+    if (use_model == CONVEY_MODEL) {
+      conveyor_time = res.median;
+      if (sample) {
+        ig_report_stats(&gather_stats, stats_file, ig_model_name(use_model), stats_started);
+        stats_started = true;
+      }
+    }
+
+    if (use_model == ALTERNATE_MODEL)
+      nbi_time = res.median;
+
+    if (use_model == THREADED_NBI_MODEL && nbi_time > 0.0)
+      T0_fprintf(stderr,"    %5.2lfx speedup over the shmem_get_nbi model\n", nbi_time / res.median);
+
+    if ((use_model == CORO_MODEL || use_model == THREADED_MODEL) && conveyor_time > 0.0)
+      T0_fprintf(stderr,"    %5.2lfx speedup over the conveyor model\n", conveyor_time / res.median);
+
+    if (use_model == CONVEY_PROGRESS_MODEL) {
+      if (conveyor_time > 0.0)
+        T0_fprintf(stderr,"    %5.2lfx speedup over the conveyor model\n", conveyor_time / res.median);
+      if (sample) {
+        ig_report_stats(&gather_stats, stats_file, ig_model_name(use_model), stats_started);
+        stats_started = true;
+      }
+    }
+
+    if (use_model == CONVEY_LOCAL_MODEL) {
+      T0_fprintf(stderr,"    %5.1lf%% of the requests served node-locally", 100.0*local_frac);
+      if (conveyor_time > 0.0)
+        T0_fprintf(stderr,", %5.2lfx speedup over the conveyor model", conveyor_time / res.median);
+      T0_fprintf(stderr,"\n");
+    }
+
+    if (use_model == MULTIHOP_MODEL) {
+      BenchResult hop_res = hop_bench.finish(l_num_req * THREADS, 0.0);
+      T0_fprintf(stderr,"    %8.3lf seconds as %ld separate gathers, %5.2lfx speedup\n",
+                 hop_res.median, hops, hop_res.median / res.median);
+      // the chains end somewhere else, so there is no other model to compare with
+      num_errors += ig_check_and_zero(use_model, tgt, NULL, chain, l_num_req);
+    } else if (ref == NULL) {
+      // keep the first model's answer to compare the others against
+      ref = (int64_t*)calloc(l_num_req, sizeof(int64_t)); assert(ref != NULL);
+      memcpy(ref, tgt, l_num_req*sizeof(int64_t));
+      num_errors += ig_check_and_zero(use_model, tgt, NULL, index, l_num_req);
+    } else {
+      num_errors += ig_check_and_zero(use_model, tgt, ref, index, l_num_req);
+    }
+  }
+
+  free(ref);
+  return lgp_reduce_add_l(num_errors);
+}
+
+#endif
@@ -0,0 +1,1004 @@
+/*! \file index_gather.h
+ * \brief Reusable index gather / index scatter on persistent conveyors.
+ *
+ * ig_conveyor used to create and free its request and reply conveyors on
+ * every call and only moved int64_t values. The classes here keep their
+ * conveyors for their whole lifetime, move any trivially copyable value
+ * type and cache an IndexPlan: the requests grouped per destination PE, so
+ * that an application that gathers thousands of times with the same index
+ * set pays for the grouping once.
+ *
+ * All constructors, destructors, gather() and scatter() are collective.
+ * Indices are packed "shmem style" as (local index << 16) | pe, and the
+ * tables passed in are the local parts of symmetric arrays.
+ *
+ * IndexGather::set_progress() moves the conveyors of a gather to a progress
+ * thread of the PE. That thread advances both conveyors and serves the
+ * incoming requests with the table lookup. The PE's own thread only queues
+ * its requests, reads the node-local tables and stores the replies, so the
+ * two overlap. All SHMEM calls of the gather then come from the progress
+ * thread, which needs SHMEM_THREAD_SERIALIZED or better.
+ *
+ * ThreadedGather splits the requests of a PE over several threads. Each
+ * thread has its own conveyors and its own shmem_ctx, and all of them
+ * read the PE's one table. It needs SHMEM_THREAD_MULTIPLE.
+ *
+ * BatchGather is for many small gathers whose latency matters more than
+ * their throughput. It picks per gather between shmem_getmem_nbi,
+ * conveyors with small buffers and the bulk conveyors.
+ */
+#ifndef INDEX_GATHER_H
+#define INDEX_GATHER_H
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include <shmem.h>
+extern "C" {
+#include <spmat.h>
+#include <convey.h>
+}
+#include "convey_prof.h"
+#include "mem_account.h"
+
+/*!
+ * \brief The requests of one PE grouped by destination.
+ * order[start[pe]..start[pe+1]) are the request ids that go to pe, and
+ * lindx[] holds their local indices on pe in the same order.
+ */
+class IndexPlan {
+ public:
+  IndexPlan() {}
+  IndexPlan(const int64_t *pckindx, int64_t num_req) { build(pckindx, num_req); }
+
+  void build(const int64_t *pckindx, int64_t num_req) {
+    int64_t npes = shmem_n_pes();
+    num_req_ = num_req;
+    start_.assign(npes + 1, 0);
+    order_.resize(num_req);
+    lindx_.resize(num_req);
+    for (int64_t i = 0; i < num_req; i++)
+      start_[(pckindx[i] & 0xffff) + 1]++;
+    for (int64_t pe = 0; pe < npes; pe++)
+      start_[pe + 1] += start_[pe];
+    std::vector<int64_t> next(start_.begin(), start_.end() - 1);
+    for (int64_t i = 0; i < num_req; i++) {
+      int64_t j = next[pckindx[i] & 0xffff]++;
+      order_[j] = i;
+      lindx_[j] = pckindx[i] >> 16;
+    }
+  }
+
+  int64_t num_req() const { return num_req_; }
+  int64_t begin(int64_t pe) const { return start_[pe]; }
+  int64_t end(int64_t pe) const { return start_[pe + 1]; }
+  int64_t request(int64_t j) const { return order_[j]; }
+  int64_t local_index(int64_t j) const { return lindx_[j]; }
+
+ private:
+  int64_t num_req_ = 0;
+  std::vector<int64_t> start_;
+  std::vector<int64_t> order_;
+  std::vector<int64_t> lindx_;
+};
+
+/* combine operations for IndexScatter */
+struct AssignOp {
+  template<typename T> void operator()(T &dst, const T &val) const { dst = val; }
+};
+struct AddOp {
+  template<typename T> void operator()(T &dst, const T &val) const { dst += val; }
+};
+struct MinOp {
+  template<typename T> void operator()(T &dst, const T &val) const { if (val < dst) dst = val; }
+};
+struct MaxOp {
+  template<typename T> void operator()(T &dst, const T &val) const { if (dst < val) dst = val; }
+};
+
+/*!
+ * \brief Round-robin over the destinations of a plan, pushing each
+ * destination's batch until the conveyor pushes back.
+ * Destinations are visited starting after MYTHREAD so that all PEs do not
+ * start on the same target.
+ */
+class PlanCursor {
+ public:
+  void reset(const IndexPlan &plan, const std::vector<bool> *skip = NULL) {
+    int64_t npes = shmem_n_pes();
+    int64_t me = shmem_my_pe();
+    active_.clear();
+    next_.assign(npes, 0);
+    for (int64_t k = 1; k <= npes; k++) {
+      int64_t pe = (me + k) % npes;
+      next_[pe] = plan.begin(pe);
+      if (plan.begin(pe) < plan.end(pe) && !(skip && (*skip)[pe]))
+        active_.push_back(pe);
+    }
+  }
+
+  bool done() const { return active_.empty(); }
+
+  /* push(pe, j) returns false when the conveyor is full */
+  template<typename Push>
+  void push_all(const IndexPlan &plan, Push push) {
+    for (size_t k = 0; k < active_.size();) {
+      int64_t pe = active_[k];
+      int64_t &j = next_[pe];
+      int64_t end = plan.end(pe);
+      for (; j < end; j++)
+        if (!push(pe, j))
+          break;
+      if (j == end) {
+        active_[k] = active_.back();
+        active_.pop_back();
+      } else {
+        k++;
+      }
+    }
+  }
+
+ private:
+  std::vector<int64_t> active_;
+  std::vector<int64_t> next_;
+};
+
+/*!
+ * \brief A bounded queue from one producer thread to one consumer thread.
+ * Each side caches the other's position and reads it again only when the
+ * queue looks full or empty.
+ */
+template<typename E>
+class SpscQueue {
+ public:
+  explicit SpscQueue(int log2_cap = 12) : buf_((size_t)1 << log2_cap), mask_(buf_.size() - 1) {}
+
+  SpscQueue(const SpscQueue&) = delete;
+  SpscQueue& operator=(const SpscQueue&) = delete;
+
+  /* producer side; false when the queue is full */
+  bool push(const E &e) {
+    uint64_t t = tail_.load(std::memory_order_relaxed);
+    if (t - head_seen_ > mask_) {
+      head_seen_ = head_.load(std::memory_order_acquire);
+      if (t - head_seen_ > mask_)
+        return false;
+    }
+    buf_[t & mask_] = e;
+    tail_.store(t + 1, std::memory_order_release);
+    return true;
+  }
+
+  /* consumer side; false when the queue is empty */
+  bool pop(E &e) {
+    uint64_t h = head_.load(std::memory_order_relaxed);
+    if (h == tail_seen_) {
+      tail_seen_ = tail_.load(std::memory_order_acquire);
+      if (h == tail_seen_)
+        return false;
+    }
+    e = buf_[h & mask_];
+    head_.store(h + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool empty() const {
+    return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire);
+  }
+
+ private:
+  // padded rather than alignas(64), which new does not honor before C++17
+  std::vector<E> buf_;
+  uint64_t mask_;
+  char pad0_[64];
+  std::atomic<uint64_t> head_{0};
+  uint64_t tail_seen_ = 0;          /*!< the consumer's copy of tail_ */
+  char pad1_[64];
+  std::atomic<uint64_t> tail_{0};
+  uint64_t head_seen_ = 0;          /*!< the producer's copy of head_ */
+  char pad2_[64];
+};
+
+/*!
+ * \brief What one PE saw during one IndexGather::gather(), collected only
+ * when a GatherStats is attached with set_stats().
+ * Every sample_every-th request (by request id) gets its push time noted
+ * at the origin; its reply closes the round trip. Requests served through
+ * shmem_ptr are never sampled.
+ */
+struct GatherStats {
+  static const int NBINS = 40;     /*!< bin b counts round trips in [2^b, 2^(b+1)) ns */
+
+  int64_t sample_every = 0;        /*!< 0 turns latency sampling off */
+  int64_t advance_calls = 0;
+  int64_t pushes = 0;              /*!< successful pushes of requests and replies */
+  int64_t push_fails = 0;          /*!< pushes refused by a full conveyor */
+  double completion = 0.0;         /*!< seconds from entering gather() to leaving it */
+  int64_t hist[NBINS] = {0};
+  std::vector<double> latency;     /*!< sampled round trips in seconds */
+
+  void clear() {
+    advance_calls = pushes = push_fails = 0;
+    completion = 0.0;
+    std::fill(hist, hist + NBINS, 0);
+    latency.clear();
+  }
+
+  void add_latency(double sec) {
+    latency.push_back(sec);
+    int b = 0;
+    for (int64_t ns = (int64_t)(sec * 1.0e9); ns > 1 && b < NBINS - 1; ns >>= 1)
+      b++;
+    hist[b]++;
+  }
+
+  /*! \brief the q-quantile (0..1) of the sampled latencies, 0 if none */
+  double quantile(double q) {
+    if (latency.empty())
+      return 0.0;
+    size_t k = std::min(latency.size() - 1, (size_t)(q * (double)latency.size()));
+    std::nth_element(latency.begin(), latency.begin() + k, latency.end());
+    return latency[k];
+  }
+};
+
+/*!
+ * \brief tgt[i] = table[pckindx[i]] for any trivially copyable T.
+ */
+template<typename T>
+class IndexGather {
+  static_assert(std::is_trivially_copyable<T>::value, "IndexGather needs a trivially copyable type");
+
+  struct request_t { int64_t idx; int64_t lindx; };
+  struct reply_t { int64_t idx; T val; };
+  struct outbound_t { int64_t pe; request_t req; };
+
+ public:
+  /*!
+   * \param node_local serve requests to PEs whose table is reachable
+   * through shmem_ptr with direct loads instead of the conveyors
+   * \param max_bytes the buffer memory of each conveyor; smaller buffers
+   * fill and go out sooner, SIZE_MAX leaves the size to the library
+   */
+  explicit IndexGather(bool node_local = false, size_t max_bytes = SIZE_MAX) : node_local_(node_local) {
+    requests_ = mem_convey_new(max_bytes, 0, NULL, 0, "requests");
+    assert( requests_ != NULL );
+    replies_ = mem_convey_new(max_bytes, 0, NULL, 0, "replies");
+    assert( replies_ != NULL );
+  }
+
+  ~IndexGather() {
+    mem_convey_free(requests_);
+    mem_convey_free(replies_);
+  }
+
+  IndexGather(const IndexGather&) = delete;
+  IndexGather& operator=(const IndexGather&) = delete;
+
+  void set_node_local(bool node_local) { node_local_ = node_local; }
+
+  /*! \brief Collect GatherStats in every later gather, NULL to stop. */
+  void set_stats(GatherStats *stats) { stats_ = stats; }
+
+  /*!
+   * \brief Drive the conveyors from a progress thread in every later gather.
+   * \return false, leaving progress off, when the SHMEM library was not
+   * initialized with at least SHMEM_THREAD_SERIALIZED
+   */
+  bool set_progress(bool progress) {
+    int provided = SHMEM_THREAD_SINGLE;
+    shmem_query_thread(&provided);
+    progress_ = progress && provided >= SHMEM_THREAD_SERIALIZED;
+    if (progress_ && !to_progress_) {
+      to_progress_.reset(new SpscQueue<outbound_t>());
+      from_progress_.reset(new SpscQueue<reply_t>());
+    }
+    return progress_ == progress;
+  }
+  bool progress() const { return progress_; }
+
+  /*! \brief Group the requests by destination and keep the plan for later gathers. */
+  const IndexPlan& plan(const int64_t *pckindx, int64_t num_req) {
+    plan_.build(pckindx, num_req);
+    return plan_;
+  }
+  const IndexPlan& plan() const { return plan_; }
+
+  /*! \brief Gather with the cached plan. */
+  void gather(T *tgt, const T *ltable) { gather(tgt, plan_, ltable); }
+
+  /*! \brief Gather with any plan built for this PE's requests. */
+  void gather(T *tgt, const IndexPlan &plan, const T *ltable) {
+    begin();
+    run(tgt, plan, ltable);
+    end();
+  }
+
+  /*
+   * gather() in three steps, for a caller that drives several gathers at
+   * once from different threads: begin() and end() are collective and must
+   * come from one thread, in the same order on every PE; run() is not.
+   */
+  void begin() {
+    if (stats_) {
+      stats_->clear();
+      t0_ = wall_seconds();
+    }
+    cprof_begin(requests_, sizeof(request_t), alignof(request_t), "requests");
+    cprof_begin(replies_, sizeof(reply_t), alignof(reply_t), "replies");
+  }
+
+  void run(T *tgt, const IndexPlan &plan, const T *ltable) {
+    int64_t npes = shmem_n_pes();
+    int64_t from;
+    bool more;
+
+    // resolve the node-local tables; NULL for PEs reached through the network
+    std::vector<bool> is_local(npes, false);
+    std::vector<const T*> peer_table(npes, (const T*)NULL);
+    if (node_local_)
+      for (int64_t pe = 0; pe < npes; pe++) {
+        peer_table[pe] = (const T*)shmem_ptr(ltable, pe);
+        is_local[pe] = peer_table[pe] != NULL;
+      }
+    num_local_ = 0;
+    num_req_ = plan.num_req();
+
+    GatherStats *st = stats_;
+    int64_t every = st ? st->sample_every : 0;
+    std::vector<double> sent;
+    int64_t &passes = passes_;
+    passes = 0;
+    if (st && every > 0)
+      sent.assign(num_req_ / every + 1, 0.0);
+
+    PlanCursor cursor;
+    cursor.reset(plan, &is_local);
+    int64_t next_local = 0;
+
+    if (progress_)
+      gather_progress(tgt, plan, ltable, cursor, is_local, peer_table, next_local, sent, passes);
+
+    while (!progress_ &&
+           (more = cprof_advance(requests_, cursor.done()),
+            more | cprof_advance(replies_, !more))) {
+      passes++;
+
+      cursor.push_all(plan, [&](int64_t pe, int64_t j) {
+        request_t req = { plan.request(j), plan.local_index(j) };
+        bool ok = cprof_push(requests_, &req, pe);
+        if (st && !ok) {
+          st->push_fails++;
+        } else if (st) {
+          st->pushes++;
+          if (every > 0 && req.idx % every == 0)
+            sent[req.idx / every] = wall_seconds();
+        }
+        return ok;
+      });
+
+      // one node-local batch per pass, between keeping the conveyors busy
+      local_batch(tgt, plan, is_local, peer_table, next_local);
+
+      request_t *req;
+      while ((req = (request_t*)cprof_apull(requests_, &from)) != NULL) {
+        reply_t rep;
+        rep.idx = req->idx;
+        rep.val = ltable[req->lindx];
+        if (! cprof_push(replies_, &rep, from)) {
+          if (st)
+            st->push_fails++;
+          cprof_unpull(requests_);
+          break;
+        }
+        if (st)
+          st->pushes++;
+      }
+
+      reply_t *rep;
+      while ((rep = (reply_t*)cprof_apull(replies_, NULL)) != NULL) {
+        tgt[rep->idx] = rep->val;
+        if (every > 0 && rep->idx % every == 0)
+          st->add_latency(wall_seconds() - sent[rep->idx / every]);
+      }
+    }
+
+    // a PE with no remote requests can leave the loop before its local batches
+    while (local_batch(tgt, plan, is_local, peer_table, next_local))
+      ;
+  }
+
+  void end() {
+    convey_reset(requests_);
+    convey_reset(replies_);
+
+    if (stats_) {
+      stats_->advance_calls = 2 * (passes_ + 1);
+      stats_->completion = wall_seconds() - t0_;
+    }
+  }
+
+  /*! \brief number of requests the last gather served node-locally on this PE */
+  int64_t num_local() const { return num_local_; }
+  /*! \brief number of requests of the last gather on this PE */
+  int64_t num_requests() const { return num_req_; }
+
+ private:
+  /* serve the next node-local destination of the plan; false when none is left */
+  bool local_batch(T *tgt, const IndexPlan &plan, const std::vector<bool> &is_local,
+                   const std::vector<const T*> &peer_table, int64_t &next_local) {
+    int64_t npes = is_local.size();
+    for (; next_local < npes; next_local++) {
+      if (!is_local[next_local])
+        continue;
+      const T *peer = peer_table[next_local];
+      for (int64_t j = plan.begin(next_local); j < plan.end(next_local); j++)
+        tgt[plan.request(j)] = peer[plan.local_index(j)];
+      num_local_ += plan.end(next_local) - plan.begin(next_local);
+      next_local++;
+      return true;
+    }
+    return false;
+  }
+
+  /*
+   * The remote part of a gather with a progress thread. The progress thread
+   * is the only one to touch the conveyors: it pushes what this thread
+   * queued in to_progress_, serves the incoming requests and queues the
+   * replies in from_progress_. This thread queues the requests, serves the
+   * node-local batches and stores the replies until the progress thread
+   * has left its advance loop. Latency samples cover the two queues.
+   */
+  void gather_progress(T *tgt, const IndexPlan &plan, const T *ltable, PlanCursor &cursor,
+                       const std::vector<bool> &is_local, const std::vector<const T*> &peer_table,
+                       int64_t &next_local, std::vector<double> &sent, int64_t &passes) {
+    GatherStats *st = stats_;
+    int64_t every = st ? st->sample_every : 0;
+    SpscQueue<outbound_t> &out = *to_progress_;
+    SpscQueue<reply_t> &in = *from_progress_;
+    std::atomic<bool> queued(false), finished(false);
+    ConveyProfile *prof = &ConveyProfile::get();
+
+    std::thread progress([&]() {
+      ConveyProfile::charge_to(prof);
+      int64_t from;
+      bool more;
+      outbound_t next;
+      bool held = false;   // popped from out but refused by the conveyor
+      while (more = cprof_advance(requests_, !held && queued.load(std::memory_order_acquire) && out.empty()),
+             more | cprof_advance(replies_, !more)) {
+        passes++;
+        bool idle = true;
+
+        while (held || out.pop(next)) {
+          held = !cprof_push(requests_, &next.req, next.pe);
+          if (held) {
+            if (st)
+              st->push_fails++;
+            break;
+          }
+          if (st)
+            st->pushes++;
+          idle = false;
+        }
+
+        request_t *req;
+        while ((req = (request_t*)cprof_apull(requests_, &from)) != NULL) {
+          reply_t rep;
+          rep.idx = req->idx;
+          rep.val = ltable[req->lindx];
+          if (! cprof_push(replies_, &rep, from)) {
+            if (st)
+              st->push_fails++;
+            cprof_unpull(requests_);
+            break;
+          }
+          if (st)
+            st->pushes++;
+          idle = false;
+        }
+
+        reply_t *rep;
+        while ((rep = (reply_t*)cprof_apull(replies_, NULL)) != NULL) {
+          if (!in.push(*rep)) {
+            cprof_unpull(replies_);
+            break;
+          }
+          idle = false;
+        }
+        // leave the core to the PE's own thread while nothing moves
+        if (idle)
+          std::this_thread::yield();
+      }
+      ConveyProfile::charge_to(NULL);
+      finished.store(true, std::memory_order_release);
+    });
+
+    for (;;) {
+      bool idle = true;
+      if (!cursor.done()) {
+        cursor.push_all(plan, [&](int64_t pe, int64_t j) {
+          outbound_t o = { pe, { plan.request(j), plan.local_index(j) } };
+          if (!out.push(o))
+            return false;
+          if (every > 0 && o.req.idx % every == 0)
+            sent[o.req.idx / every] = wall_seconds();
+          idle = false;
+          return true;
+        });
+      }
+      if (cursor.done())
+        queued.store(true, std::memory_order_release);
+
+      if (local_batch(tgt, plan, is_local, peer_table, next_local))
+        idle = false;
+
+      // every reply is queued before finished is set
+      bool last = finished.load(std::memory_order_acquire);
+      reply_t rep;
+      while (in.pop(rep)) {
+        tgt[rep.idx] = rep.val;
+        if (every > 0 && rep.idx % every == 0)
+          st->add_latency(wall_seconds() - sent[rep.idx / every]);
+        idle = false;
+      }
+      if (last)
+        break;
+      if (idle)
+        std::this_thread::yield();
+    }
+    progress.join();
+  }
+
+  convey_t *requests_;
+  convey_t *replies_;
+  bool node_local_;
+  bool progress_ = false;
+  std::unique_ptr<SpscQueue<outbound_t> > to_progress_;
+  std::unique_ptr<SpscQueue<reply_t> > from_progress_;
+  GatherStats *stats_ = NULL;
+  int64_t num_local_ = 0;
+  int64_t num_req_ = 0;
+  int64_t passes_ = 0;
+  double t0_ = 0.0;
+  IndexPlan plan_;
+};
+
+/*!
+ * \brief An index gather split over the threads of each PE.
+ *
+ * Thread t of every PE owns lane t: an IndexGather with its own request and
+ * reply conveyors, and a shmem_ctx. The thread gathers the t-th contiguous
+ * slice of the PE's requests and serves the requests that thread t of the
+ * other PEs sends, so the responder work is spread over the threads too.
+ * All threads read the same table. The lanes are independent conveyors, so
+ * the threads never share a conveyor and need no locks. The contexts carry
+ * gather_nbi(), where a thread's shmem_ctx_quiet waits only for its own gets.
+ *
+ * Only lane 0 runs on the calling thread, so only its conveyors show up in
+ * the convey_prof.h profile and trace.
+ *
+ * Without SHMEM_THREAD_MULTIPLE there is one lane and no extra thread.
+ * The constructor, destructor and both gathers are collective, and every PE
+ * must ask for the same number of threads.
+ */
+template<typename T>
+class ThreadedGather {
+ public:
+  explicit ThreadedGather(int threads) {
+    int provided = SHMEM_THREAD_SINGLE;
+    shmem_query_thread(&provided);
+    int n = provided >= SHMEM_THREAD_MULTIPLE ? std::max(threads, 1) : 1;
+    // the lanes' conveyors are created in the same order on every PE
+    for (int t = 0; t < n; t++) {
+      lanes_.emplace_back(new IndexGather<T>());
+      shmem_ctx_t ctx;
+      if (shmem_ctx_create(SHMEM_CTX_SERIALIZED, &ctx) != 0)
+        ctx = SHMEM_CTX_DEFAULT;
+      ctx_.push_back(ctx);
+    }
+  }
+
+  ~ThreadedGather() {
+    for (size_t t = 0; t < ctx_.size(); t++)
+      if (ctx_[t] != SHMEM_CTX_DEFAULT)
+        shmem_ctx_destroy(ctx_[t]);
+  }
+
+  ThreadedGather(const ThreadedGather&) = delete;
+  ThreadedGather& operator=(const ThreadedGather&) = delete;
+
+  /*! \brief number of threads per PE, 1 when the library cannot have more */
+  int threads() const { return (int)lanes_.size(); }
+
+  /*! \brief Split the requests over the lanes and plan each slice. */
+  void plan(const int64_t *pckindx, int64_t num_req) {
+    num_req_ = num_req;
+    for (int t = 0; t < threads(); t++)
+      lanes_[t]->plan(pckindx + first(t), first(t + 1) - first(t));
+  }
+
+  /*!
+   * \brief Gather the planned requests, each lane on its own conveyors.
+   * Beginning and resetting conveyors is collective, so the calling thread
+   * does it for all lanes.
+   */
+  void gather(T *tgt, const T *ltable) {
+    for (int t = 0; t < threads(); t++)
+      lanes_[t]->begin();
+    run([&](int t) { lanes_[t]->run(tgt + first(t), lanes_[t]->plan(), ltable); });
+    for (int t = 0; t < threads(); t++)
+      lanes_[t]->end();
+  }
+
+  /*!
+   * \brief Gather the planned requests with shmem_getmem_nbi on each
+   * thread's context, quieting that context after every batch of gets.
+   * \param *pckindx the requests that were planned
+   */
+  void gather_nbi(T *tgt, const int64_t *pckindx, const T *ltable, int64_t batch) {
+    batch = std::max<int64_t>(batch, 1);
+    run([&](int t) {
+      shmem_ctx_t ctx = ctx_[t];
+      for (int64_t i = first(t); i < first(t + 1); i += batch) {
+        int64_t end = std::min(i + batch, first(t + 1));
+        for (int64_t j = i; j < end; j++)
+          shmem_ctx_getmem_nbi(ctx, &tgt[j], ltable + (pckindx[j] >> 16), sizeof(T),
+                               (int)(pckindx[j] & 0xffff));
+        shmem_ctx_quiet(ctx);
+      }
+    });
+  }
+
+ private:
+  int64_t first(int t) const { return num_req_ * t / threads(); }
+
+  /* run f(t) for every lane, lane 0 on the calling thread */
+  template<typename F>
+  void run(F f) {
+    std::vector<std::thread> pool;
+    for (int t = 1; t < threads(); t++)
+      pool.emplace_back(f, t);
+    f(0);
+    for (size_t k = 0; k < pool.size(); k++)
+      pool[k].join();
+  }
+
+  std::vector<std::unique_ptr<IndexGather<T> > > lanes_;
+  std::vector<shmem_ctx_t> ctx_;
+  int64_t num_req_ = 0;
+};
+
+/*!
+ * \brief Gathers of small and changing batches, each on the transport that
+ * should finish it first.
+ *
+ * Conveyors are built for bulk: the items of a batch much smaller than
+ * their buffers wait for the end-game flush. BatchGather keeps three
+ * transports and picks one per gather() from the largest batch of any PE:
+ *   NBI    one shmem_getmem_nbi per request and a shmem_quiet
+ *   SMALL  conveyors with small buffers, which fill and go out early
+ *   BULK   conveyors with the library's buffers
+ * A batch of up to nbi_max requests defaults to NBI, up to small_max to
+ * SMALL, otherwise to BULK. Batches are measured in size classes of
+ * powers of two. A class first tries its default and the transports next
+ * to it TRIES times each, then keeps the one with the shortest gathers and
+ * gives the others another try every EXPLORE_EVERY gathers. Batch sizes
+ * and times are reduced over the PEs, so every PE picks the same
+ * transport. That reduction makes even an NBI gather collective.
+ */
+template<typename T>
+class BatchGather {
+ public:
+  enum Transport { NBI = 0, SMALL = 1, BULK = 2, NTRANSPORTS = 3 };
+  static const int TRIES = 2;
+  static const int64_t EXPLORE_EVERY = 64;
+
+  /*!
+   * \param small_bytes buffer memory of each SMALL conveyor
+   * \param nbi_max,small_max the defaults of a batch size class, see above
+   */
+  BatchGather(size_t small_bytes = 1 << 20, int64_t nbi_max = 256, int64_t small_max = 65536)
+    : small_(false, small_bytes), bulk_(false), nbi_max_(nbi_max), small_max_(small_max) {
+    sync_ = (int64_t*)shmem_malloc(4 * sizeof(int64_t));
+    assert( sync_ != NULL );
+  }
+
+  ~BatchGather() { shmem_free(sync_); }
+
+  BatchGather(const BatchGather&) = delete;
+  BatchGather& operator=(const BatchGather&) = delete;
+
+  /*! \brief Use transport t for every later gather, or pick per gather again with t < 0. */
+  void force(int t) { forced_ = t; }
+
+  /*!
+   * \brief tgt[i] = table[pckindx[i]] for 0 <= i < num_req, on the transport
+   * picked for this batch. Collective.
+   * \return the transport it used
+   */
+  Transport gather(T *tgt, const int64_t *pckindx, int64_t num_req, const T *ltable) {
+    // the batch size of this gather and the time of the last one, over all PEs
+    sync_[0] = num_req;
+    sync_[1] = (int64_t)(last_sec_ * 1.0e9);
+    shmem_int64_max_reduce(SHMEM_TEAM_WORLD, sync_ + 2, sync_, 2);
+    int64_t batch = sync_[2];
+    if (last_class_ >= 0)
+      learn(last_class_, last_, sync_[3] * 1.0e-9);
+
+    Transport t = forced_ >= 0 ? (Transport)forced_ : pick(size_class(batch), batch);
+    double t0 = wall_seconds();
+    if (t == NBI) {
+      for (int64_t i = 0; i < num_req; i++)
+        shmem_getmem_nbi(&tgt[i], ltable + (pckindx[i] >> 16), sizeof(T), (int)(pckindx[i] & 0xffff));
+      shmem_quiet();
+    } else {
+      IndexGather<T> &ig = t == SMALL ? small_ : bulk_;
+      ig.plan(pckindx, num_req);
+      ig.gather(tgt, ltable);
+    }
+    last_sec_ = wall_seconds() - t0;
+    last_class_ = size_class(batch);
+    last_ = t;
+    return t;
+  }
+
+  static const char* name(int t) {
+    switch (t) {
+    case NBI:   return "nbi";
+    case SMALL: return "small";
+    case BULK:  return "bulk";
+    }
+    return "picked";
+  }
+
+ private:
+  /* what one batch size class has measured, per transport */
+  struct Measured {
+    double sec[NTRANSPORTS];
+    int tries[NTRANSPORTS];
+    int64_t gathers;
+  };
+
+  static int size_class(int64_t batch) {
+    int c = 0;
+    for (; batch > 0; batch >>= 1)
+      c++;
+    return c;
+  }
+
+  Measured& measured(int c) {
+    if ((int)classes_.size() <= c) {
+      Measured none = { {0.0, 0.0, 0.0}, {0, 0, 0}, 0 };
+      classes_.resize(c + 1, none);
+    }
+    return classes_[c];
+  }
+
+  Transport pick(int c, int64_t batch) {
+    int def = batch <= nbi_max_ ? NBI : batch <= small_max_ ? SMALL : BULK;
+    Measured &m = measured(c);
+    int64_t g = m.gathers++;
+    int candidates[3] = { def, def - 1, def + 1 };
+    for (int k = 0; k < 3; k++) {
+      int t = candidates[k];
+      if (t >= 0 && t < NTRANSPORTS && m.tries[t] < TRIES)
+        return (Transport)t;
+    }
+    int best = def;
+    for (int t = 0; t < NTRANSPORTS; t++)
+      if (m.tries[t] > 0 && m.sec[t] < m.sec[best])
+        best = t;
+    // now and then one of the tried others again, in turn
+    if (g % EXPLORE_EVERY == EXPLORE_EVERY - 1) {
+      int other = (best + 1 + (int)(g / EXPLORE_EVERY) % (NTRANSPORTS - 1)) % NTRANSPORTS;
+      if (m.tries[other] > 0)
+        return (Transport)other;
+    }
+    return (Transport)best;
+  }
+
+  /* the best of the first tries, then a moving average */
+  void learn(int c, int t, double sec) {
+    Measured &m = measured(c);
+    if (m.tries[t] == 0)
+      m.sec[t] = sec;
+    else if (m.tries[t] < TRIES)
+      m.sec[t] = std::min(m.sec[t], sec);
+    else
+      m.sec[t] = 0.75 * m.sec[t] + 0.25 * sec;
+    m.tries[t]++;
+  }
+
+  IndexGather<T> small_;
+  IndexGather<T> bulk_;
+  int64_t nbi_max_, small_max_;
+  int forced_ = -1;
+  int64_t *sync_;                    /*!< symmetric: batch and time in, their maxima out */
+  std::vector<Measured> classes_;
+  double last_sec_ = 0.0;
+  int last_class_ = -1;
+  int last_ = NBI;
+};
+
+/*!
+ * \brief op(table[pckindx[i]], src[i]) for any trivially copyable T.
+ * Updates to the same slot are applied in arrival order, so op should be
+ * commutative unless the caller only cares about some winner (AssignOp).
+ */
+template<typename T, typename Op = AssignOp>
+class IndexScatter {
+  static_assert(std::is_trivially_copyable<T>::value, "IndexScatter needs a trivially copyable type");
+
+  struct update_t { int64_t lindx; T val; };
+
+ public:
+  explicit IndexScatter(Op op = Op()) : op_(op) {
+    updates_ = mem_convey_new(SIZE_MAX, 0, NULL, 0, "updates");
+    assert( updates_ != NULL );
+  }
+
+  ~IndexScatter() { mem_convey_free(updates_); }
+
+  IndexScatter(const IndexScatter&) = delete;
+  IndexScatter& operator=(const IndexScatter&) = delete;
+
+  const IndexPlan& plan(const int64_t *pckindx, int64_t num_upd) {
+    plan_.build(pckindx, num_upd);
+    return plan_;
+  }
+
+  void scatter(const T *src, T *ltable) { scatter(src, plan_, ltable); }
+
+  void scatter(const T *src, const IndexPlan &plan, T *ltable) {
+    cprof_begin(updates_, sizeof(update_t), alignof(update_t), "updates");
+
+    PlanCursor cursor;
+    cursor.reset(plan);
+
+    while (cprof_advance(updates_, cursor.done())) {
+      cursor.push_all(plan, [&](int64_t pe, int64_t j) {
+        update_t upd;
+        upd.lindx = plan.local_index(j);
+        upd.val = src[plan.request(j)];
+        return cprof_push(updates_, &upd, pe);
+      });
+
+      update_t *upd;
+      while ((upd = (update_t*)cprof_apull(updates_, NULL)) != NULL)
+        op_(ltable[upd->lindx], upd->val);
+    }
+
+    convey_reset(updates_);
+  }
+
+ private:
+  convey_t *updates_;
+  Op op_;
+  IndexPlan plan_;
+};
+
+/*!
+ * \brief tgt[i] = table[links[k-2][...links[0][pckindx[i]]...]] for k = hops.
+ * The links are the local parts of symmetric int64_t tables of packed
+ * indices. Each responder forwards the request straight to the PE that
+ * owns the next hop, on the conveyor for that hop, and only the last one
+ * replies to the origin: k+1 messages per chain instead of the 2k of k
+ * separate gathers, and no barrier between the hops.
+ * Hop conveyor h is told it is done once hop conveyor h-1 has finished,
+ * the same way the reply conveyor follows the request conveyor in
+ * IndexGather.
+ */
+template<typename T>
+class MultiHopGather {
+  static_assert(std::is_trivially_copyable<T>::value, "MultiHopGather needs a trivially copyable type");
+
+  struct hop_t { int64_t idx; int64_t origin; int64_t lindx; };
+  struct reply_t { int64_t idx; T val; };
+
+ public:
+  /*! \param hops number of table lookups in each chain, at least 1 */
+  explicit MultiHopGather(int64_t hops) : hops_(hops) {
+    assert( hops >= 1 );
+    for (int64_t h = 0; h < hops; h++) {
+      convey_t *c = mem_convey_new(SIZE_MAX, 0, NULL, 0, "hops");
+      assert( c != NULL );
+      hop_.push_back(c);
+      label_.push_back("hop" + std::to_string(h));
+    }
+    replies_ = mem_convey_new(SIZE_MAX, 0, NULL, 0, "replies");
+    assert( replies_ != NULL );
+  }
+
+  ~MultiHopGather() {
+    for (size_t h = 0; h < hop_.size(); h++)
+      mem_convey_free(hop_[h]);
+    mem_convey_free(replies_);
+  }
+
+  MultiHopGather(const MultiHopGather&) = delete;
+  MultiHopGather& operator=(const MultiHopGather&) = delete;
+
+  int64_t hops() const { return hops_; }
+
+  /*! \brief Group the first hop of every chain by destination and keep the plan. */
+  const IndexPlan& plan(const int64_t *pckindx, int64_t num_req) {
+    plan_.build(pckindx, num_req);
+    return plan_;
+  }
+
+  /*! \brief Gather with the cached plan, links[h] is this PE's part of the h-th link table. */
+  void gather(T *tgt, const int64_t *const *links, const T *ltable) { gather(tgt, plan_, links, ltable); }
+
+  void gather(T *tgt, const IndexPlan &plan, const int64_t *const *links, const T *ltable) {
+    int64_t me = shmem_my_pe();
+    int64_t from;
+    bool more;
+
+    for (int64_t h = 0; h < hops_; h++)
+      cprof_begin(hop_[h], sizeof(hop_t), alignof(hop_t), label_[h].c_str());
+    cprof_begin(replies_, sizeof(reply_t), alignof(reply_t), "replies");
+
+    PlanCursor cursor;
+    cursor.reset(plan);
+
+    for (;;) {
+      more = !cursor.done();
+      for (int64_t h = 0; h < hops_; h++)
+        more = cprof_advance(hop_[h], !more);
+      if (!cprof_advance(replies_, !more))
+        break;
+
+      cursor.push_all(plan, [&](int64_t pe, int64_t j) {
+        hop_t msg = { plan.request(j), me, plan.local_index(j) };
+        return cprof_push(hop_[0], &msg, pe);
+      });
+
+      // drain the later hops first so the chains already in flight finish
+      for (int64_t h = hops_ - 1; h >= 0; h--) {
+        hop_t *msg;
+        while ((msg = (hop_t*)cprof_apull(hop_[h], &from)) != NULL) {
+          bool ok;
+          if (h == hops_ - 1) {
+            reply_t rep;
+            rep.idx = msg->idx;
+            rep.val = ltable[msg->lindx];
+            ok = cprof_push(replies_, &rep, msg->origin);
+          } else {
+            int64_t next = links[h][msg->lindx];
+            hop_t fwd = { msg->idx, msg->origin, next >> 16 };
+            ok = cprof_push(hop_[h+1], &fwd, next & 0xffff);
+          }
+          if (!ok) {
+            cprof_unpull(hop_[h]);
+            break;
+          }
+        }
+      }
+
+      reply_t *rep;
+      while ((rep = (reply_t*)cprof_apull(replies_, NULL)) != NULL)
+        tgt[rep->idx] = rep->val;
+    }
+
+    for (int64_t h = 0; h < hops_; h++)
+      convey_reset(hop_[h]);
+    convey_reset(replies_);
+  }
+
+ private:
+  int64_t hops_;
+  std::vector<convey_t*> hop_;
+  std::vector<std::string> label_;
+  convey_t *replies_;
+  IndexPlan plan_;
+};
+
+#endif
@@ -0,0 +1,197 @@
+/*! \file bench_harness.h
+ * \brief Warmup, repeated trials and one JSON record per timed kernel.
+ *
+ * A kernel runs warmup + trials times. Each PE times every iteration
+ * itself and hands the time to a Bench. The collective finish() drops
+ * the warmups, gathers the remaining trials x PEs times on every PE
+ * and reduces them to min, median, 99th percentile and max. The rates
+ * follow the stopTimer of the Chapel benchmarks:
+ *   GB/s/node   bytes_per_pe * pes_per_node / 1e9 / median seconds
+ *   elements/s  elements / median seconds
+ * where bytes_per_pe is what one PE moves in one trial. PEs per node
+ * default to the size of SHMEM_TEAM_SHARED.
+ *
+ * With a json file set, PE 0 appends one line per finish():
+ *
+ *     {"kernel":"ig_block","variant":"conveyor","npes":128,"pes_per_node":64,
+ *      "warmup":1,"trials":5,"elements":...,"bytes_per_pe":...,
+ *      "min_s":...,"median_s":...,"p99_s":...,"max_s":...,"gb_per_s_per_node":...,
+ *      "elements_per_s":...,"shmem":"...","time":...,"params":{...}}
+ *
+ * "params" holds whatever the driver passed to bench_param(), e.g. the
+ * problem size and the options. "shmem" is the library name and version,
+ * so records from different library builds can be told apart.
+ *
+ * The options and params are per PE, and every PE must call finish() for
+ * the same kernels in the same order.
+ */
+#ifndef BENCH_HARNESS_H
+#define BENCH_HARNESS_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <shmem.h>
+
+struct bench_options_t {
+  int warmup = 0;                /*!< untimed iterations before the trials */
+  int trials = 1;                /*!< timed iterations */
+  int pes_per_node = 0;          /*!< 0 for the size of SHMEM_TEAM_SHARED */
+  const char *json_file = NULL;  /*!< where PE 0 appends the records, NULL for none */
+  std::vector<std::pair<std::string, std::string> > params;
+};
+
+/* the calling PE's options */
+static inline bench_options_t& bench_options() {
+  static thread_local bench_options_t opt;
+  return opt;
+}
+
+/*! \brief Set the harness options; values below their minimum keep the current setting. */
+static inline void bench_set(int warmup, int trials, int pes_per_node, const char *json_file) {
+  bench_options_t &opt = bench_options();
+  if (warmup >= 0) opt.warmup = warmup;
+  if (trials >= 1) opt.trials = trials;
+  if (pes_per_node >= 1) opt.pes_per_node = pes_per_node;
+  if (json_file != NULL) opt.json_file = json_file;
+}
+
+static inline int bench_pes_per_node() {
+  bench_options_t &opt = bench_options();
+  return opt.pes_per_node > 0 ? opt.pes_per_node : shmem_team_n_pes(SHMEM_TEAM_SHARED);
+}
+
+/*! \brief Record a run parameter in every JSON record of this run. */
+static inline void bench_param(const char *key, const std::string &value) {
+  bench_options().params.push_back(std::make_pair(std::string(key), value));
+}
+static inline void bench_param(const char *key, int64_t value) { bench_param(key, std::to_string(value)); }
+static inline void bench_param(const char *key, const char *value) {
+  bench_param(key, std::string(value ? value : "none"));
+}
+
+/* s with the characters JSON does not allow in a string escaped */
+static inline std::string bench_json_string(const std::string &s) {
+  std::string out = "\"";
+  for (size_t k = 0; k < s.size(); k++) {
+    char c = s[k];
+    if (c == '"' || c == '\\') { out += '\\'; out += c; }
+    else if ((unsigned char)c < 0x20) out += ' ';
+    else out += c;
+  }
+  return out + "\"";
+}
+
+/*! \brief Times over the PEs and trials of one kernel, and the rates derived from them. */
+struct BenchResult {
+  double min = 0.0, median = 0.0, p99 = 0.0, max = 0.0;
+  double gb_per_s_per_node = 0.0;  /*!< 0 when the kernel gave no bytes */
+  double elements_per_s = 0.0;
+  int trials = 0;
+};
+
+/*!
+ * \brief The trials of one kernel.
+ *
+ *     Bench bench("ig_block", "conveyor");
+ *     for (int it = 0; it < bench.iterations(); it++)
+ *       bench.record(it, this_pes_seconds_for_one_run());
+ *     BenchResult r = bench.finish(total_requests, 16 * l_num_req);
+ */
+class Bench {
+ public:
+  Bench(const char *kernel, const char *variant) : kernel_(kernel), variant_(variant) {}
+
+  /*! \brief warmup + trials, the number of times to run the kernel */
+  int iterations() const { return bench_options().warmup + bench_options().trials; }
+  bool is_warmup(int it) const { return it < bench_options().warmup; }
+  bool is_last(int it) const { return it == iterations() - 1; }
+
+  /*! \brief This PE's time for iteration it. Warmup iterations are dropped. */
+  void record(int it, double seconds) {
+    if (!is_warmup(it))
+      times_.push_back(seconds);
+  }
+
+  /*!
+   * \brief Reduce the recorded trials over the PEs and write the JSON record.
+   * Collective; every PE gets the same result.
+   * \param elements the elements processed by all PEs in one trial
+   * \param bytes_per_pe the bytes one PE moves in one trial, 0 to skip GB/s/node
+   */
+  BenchResult finish(int64_t elements, double bytes_per_pe) {
+    bench_options_t &opt = bench_options();
+    int npes = shmem_n_pes();
+    int trials = opt.trials;
+    times_.resize(trials, times_.empty() ? 0.0 : times_.back());
+
+    double *mine = (double*)shmem_malloc((size_t)trials * (npes + 1) * sizeof(double));
+    double *all = mine + trials;
+    std::copy(times_.begin(), times_.end(), mine);
+    shmem_barrier_all();
+    shmem_fcollectmem(SHMEM_TEAM_WORLD, all, mine, trials * sizeof(double));
+    std::vector<double> t(all, all + (size_t)trials * npes);
+    shmem_barrier_all();
+    shmem_free(mine);
+    times_.clear();
+
+    std::sort(t.begin(), t.end());
+    BenchResult r;
+    size_t m = t.size();
+    r.trials = trials;
+    r.min = t.front();
+    r.max = t.back();
+    r.median = (m % 2) ? t[m/2] : 0.5 * (t[m/2 - 1] + t[m/2]);
+    r.p99 = t[std::min(m - 1, (size_t)(0.99 * m))];
+    int ppn = bench_pes_per_node();
+    if (r.median > 0.0) {
+      r.elements_per_s = elements / r.median;
+      if (bytes_per_pe > 0.0)
+        r.gb_per_s_per_node = bytes_per_pe * ppn * 1.0e-9 / r.median;
+    }
+
+    if (shmem_my_pe() == 0 && opt.json_file != NULL)
+      write_json(opt, r, npes, ppn, elements, bytes_per_pe);
+    return r;
+  }
+
+ private:
+  void write_json(const bench_options_t &opt, const BenchResult &r, int npes, int ppn,
+                  int64_t elements, double bytes_per_pe) const {
+    FILE *fp = fopen(opt.json_file, "a");
+    if (fp == NULL) {
+      fprintf(stderr, "bench_harness: can't open %s\n", opt.json_file);
+      return;
+    }
+    char name[SHMEM_MAX_NAME_LEN + 1] = "";
+    int major = 0, minor = 0;
+    shmem_info_get_name(name);
+    shmem_info_get_version(&major, &minor);
+    std::string lib = std::string(name) + " " + std::to_string(major) + "." + std::to_string(minor);
+
+    fprintf(fp, "{\"kernel\":%s,\"variant\":%s,\"npes\":%d,\"pes_per_node\":%d,"
+                "\"warmup\":%d,\"trials\":%d,\"elements\":%ld,\"bytes_per_pe\":%.0lf,"
+                "\"min_s\":%.9lf,\"median_s\":%.9lf,\"p99_s\":%.9lf,\"max_s\":%.9lf,"
+                "\"gb_per_s_per_node\":%.6lf,\"elements_per_s\":%.6e,"
+                "\"shmem\":%s,\"time\":%ld,\"params\":{",
+            bench_json_string(kernel_).c_str(), bench_json_string(variant_).c_str(),
+            npes, ppn, opt.warmup, r.trials, (long)elements, bytes_per_pe,
+            r.min, r.median, r.p99, r.max, r.gb_per_s_per_node, r.elements_per_s,
+            bench_json_string(lib).c_str(), (long)time(NULL));
+    for (size_t k = 0; k < opt.params.size(); k++)
+      fprintf(fp, "%s%s:%s", k ? "," : "", bench_json_string(opt.params[k].first).c_str(),
+              bench_json_string(opt.params[k].second).c_str());
+    fprintf(fp, "}}\n");
+    fclose(fp);
+  }
+
+  std::string kernel_, variant_;
+  std::vector<double> times_;
+};
+
+#endif
@@ -0,0 +1,119 @@
+/*! \file binary_io.h
+ * \brief Block-parallel reads and writes of flat binary record files.
+ *
+ * A file holds fixed-size records back to back, with no header. A block
+ * distributed array splits it by record number. Each PE reads and writes
+ * only its own range, at byte offset first*record_bytes, and all PEs do
+ * so at the same time.
+ *
+ * bin_read() maps the PE's range read-only with mmap and tells the kernel
+ * that it is read once, front to back (MADV_SEQUENTIAL, MADV_WILLNEED).
+ * It then copies the range into the destination. The destination is
+ * typically the local part of a symmetric array, and mmap cannot place a
+ * file there. bin_write() hands the source straight to pwrite, with no
+ * staging copy, and syncs the data before it returns, so a timed write
+ * covers the trip to the file system. bin_create() sizes the output once,
+ * before any PE writes.
+ *
+ * All calls return false (or -1) and print the reason on error.
+ */
+#ifndef BINARY_IO_H
+#define BINARY_IO_H
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*! \return the number of records in the file, -1 if it can't be read or isn't whole records */
+static inline int64_t bin_records(const char *path, size_t record_bytes) {
+  struct stat st;
+  if (stat(path, &st) != 0) {
+    fprintf(stderr, "binary_io: %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  if (st.st_size % (off_t)record_bytes != 0) {
+    fprintf(stderr, "binary_io: %s: %lld bytes is not a whole number of %zu byte records\n",
+            path, (long long)st.st_size, record_bytes);
+    return -1;
+  }
+  return (int64_t)(st.st_size / (off_t)record_bytes);
+}
+
+/*! \brief Read records first .. first+count-1 of the file into dst. */
+static inline bool bin_read(const char *path, void *dst, size_t record_bytes, int64_t first, int64_t count) {
+  if (count <= 0)
+    return true;
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "binary_io: %s: %s\n", path, strerror(errno));
+    return false;
+  }
+  // mmap offsets are whole pages
+  off_t offset = (off_t)first * (off_t)record_bytes;
+  off_t page = (off_t)sysconf(_SC_PAGESIZE);
+  off_t skip = offset % page;
+  size_t bytes = (size_t)count * record_bytes;
+  void *map = mmap(NULL, bytes + skip, PROT_READ, MAP_PRIVATE, fd, offset - skip);
+  close(fd);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "binary_io: mmap %s: %s\n", path, strerror(errno));
+    return false;
+  }
+  madvise(map, bytes + skip, MADV_SEQUENTIAL);
+  madvise(map, bytes + skip, MADV_WILLNEED);
+  memcpy(dst, (const char*)map + skip, bytes);
+  munmap(map, bytes + skip);
+  return true;
+}
+
+/*! \brief Create or truncate the file and size it for 'records' records; call on one PE. */
+static inline bool bin_create(const char *path, size_t record_bytes, int64_t records) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || ftruncate(fd, (off_t)records * (off_t)record_bytes) != 0) {
+    fprintf(stderr, "binary_io: %s: %s\n", path, strerror(errno));
+    if (fd >= 0)
+      close(fd);
+    return false;
+  }
+  close(fd);
+  return true;
+}
+
+/*! \brief Write src as records first .. first+count-1 of a file made by bin_create(). */
+static inline bool bin_write(const char *path, const void *src, size_t record_bytes, int64_t first, int64_t count) {
+  if (count <= 0)
+    return true;
+  int fd = open(path, O_WRONLY);
+  if (fd < 0) {
+    fprintf(stderr, "binary_io: %s: %s\n", path, strerror(errno));
+    return false;
+  }
+  off_t offset = (off_t)first * (off_t)record_bytes;
+  const char *p = (const char*)src;
+  size_t left = (size_t)count * record_bytes;
+  while (left > 0) {
+    ssize_t w = pwrite(fd, p, left, offset);
+    if (w < 0 && errno == EINTR)
+      continue;
+    if (w <= 0) {
+      fprintf(stderr, "binary_io: write %s: %s\n", path, strerror(errno));
+      close(fd);
+      return false;
+    }
+    p += w;
+    offset += w;
+    left -= (size_t)w;
+  }
+  bool ok = fdatasync(fd) == 0;
+  if (!ok)
+    fprintf(stderr, "binary_io: sync %s: %s\n", path, strerror(errno));
+  close(fd);
+  return ok;
+}
+
+#endif
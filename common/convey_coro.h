@@ -0,0 +1,262 @@
+/*! \file convey_coro.h
+ * \brief C++20 coroutines over a request and a reply conveyor.
+ *
+ * A conveyor kernel is normally a hand-written state machine: push until
+ * the conveyor refuses, serve, pull, unpull when a reply does not fit.
+ * ConveyCoro writes that loop once. Each element of a kernel becomes a
+ * coroutine returning ConveyTask, and
+ *
+ *     T v = co_await cc.remote_get(pe, lindx);
+ *
+ * queues a request for ltable[lindx] on pe and suspends the element until
+ * the reply comes back. Per element control flow is then ordinary code:
+ *
+ *     ConveyCoro<int64_t> cc(ltable);
+ *     cc.run(l_num_req, [&](int64_t i) -> ConveyTask {
+ *       int64_t v = co_await cc.remote_get(pckindx[i] & 0xffff, pckindx[i] >> 16);
+ *       if (v == EMPTY)                  // a second lookup only where needed
+ *         v = co_await cc.remote_get(alt[i] & 0xffff, alt[i] >> 16);
+ *       tgt[i] = v;
+ *     });
+ *
+ * run() starts the elements in order and keeps at most window of them
+ * waiting at once. A request the conveyor refuses waits in a backlog of
+ * its destination, and new elements keep starting meanwhile, so one full
+ * destination does not hold up the others. Frames come from a per-thread
+ * pool, so the steady state allocates nothing. A waiting element holds one
+ * of window slots, and a request is a single int64_t: the slot packed with
+ * lindx. The reply brings the slot back, and a table maps it to the awaiter
+ * in the suspended frame. An element may await any number of lookups, one
+ * at a time. The constructor, the destructor and run() are collective.
+ */
+#ifndef CONVEY_CORO_H
+#define CONVEY_CORO_H
+
+#if !defined(__cpp_impl_coroutine)
+#error "convey_coro.h needs C++20 coroutines"
+#endif
+
+#include <cassert>
+#include <coroutine>
+#include <cstdint>
+#include <exception>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+#include <shmem.h>
+extern "C" {
+#include <convey.h>
+}
+#include "convey_prof.h"
+#include "mem_account.h"
+
+/*!
+ * \brief Per-thread free lists of coroutine frames up to 1 KiB, by size in
+ * 64 byte steps. A free frame holds the link to the next one. Frames stay
+ * in the pool until the process ends; larger ones go to the heap.
+ */
+class CoroFramePool {
+ public:
+  static const size_t NLISTS = 16;
+
+  static void* alloc(size_t size) {
+    size_t k = (size + 63) / 64;
+    if (k >= NLISTS)
+      return ::operator new(size);
+    void *&head = lists()[k];
+    if (head == NULL)
+      return ::operator new(k * 64);
+    void *p = head;
+    head = *(void**)p;
+    return p;
+  }
+
+  static void release(void *p, size_t size) {
+    size_t k = (size + 63) / 64;
+    if (k >= NLISTS) {
+      ::operator delete(p);
+      return;
+    }
+    void *&head = lists()[k];
+    *(void**)p = head;
+    head = p;
+  }
+
+ private:
+  /* the calling PE's free lists */
+  static void** lists() {
+    static thread_local void *heads[NLISTS];
+    return heads;
+  }
+};
+
+/*!
+ * \brief The return type of an element coroutine. It starts running at
+ * once and frees its frame when it ends; nobody holds on to it.
+ */
+struct ConveyTask {
+  struct promise_type {
+    ConveyTask get_return_object() { return ConveyTask(); }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+    static void* operator new(size_t size) { return CoroFramePool::alloc(size); }
+    static void operator delete(void *p, size_t size) { CoroFramePool::release(p, size); }
+  };
+};
+
+/*!
+ * \brief Element coroutines reading a distributed table through a request
+ * and a reply conveyor.
+ */
+template<typename T>
+class ConveyCoro {
+  static_assert(std::is_trivially_copyable<T>::value, "ConveyCoro needs a trivially copyable type");
+
+  /* a request is lindx << SLOT_BITS | slot; the reply carries the slot back */
+  static const int SLOT_BITS = 10;
+  typedef int64_t request_t;
+  struct reply_t { int64_t slot; T val; };
+
+ public:
+  /*! \brief What co_await cc.remote_get(pe, lindx) waits on; it lives in the element's frame. */
+  class Get {
+   public:
+    Get(ConveyCoro *cc, int64_t pe, int64_t lindx) : cc_(cc), pe_(pe), lindx_(lindx) {}
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> h) {
+      h_ = h;
+      cc_->send(this, pe_, lindx_);
+    }
+    T await_resume() { return val_; }
+   private:
+    friend class ConveyCoro;
+    ConveyCoro *cc_;
+    int64_t pe_, lindx_;
+    std::coroutine_handle<> h_;
+    T val_;
+  };
+
+  /*!
+   * \param ltable the local part of the table that remote_get() reads on this PE
+   * \param window the most elements alive at once on this PE, at most 1024
+   */
+  explicit ConveyCoro(const T *ltable, int64_t window = 1024)
+    : ltable_(ltable), window_(window), waiting_(0), waiter_(window),
+      backlog_(shmem_n_pes()), backlog_head_(shmem_n_pes(), 0) {
+    assert( window > 0 && window <= (1 << SLOT_BITS) );
+    for (int64_t k = window - 1; k >= 0; k--)
+      free_slots_.push_back(k);
+    requests_ = mem_convey_new(SIZE_MAX, 0, NULL, 0, "requests");
+    assert( requests_ != NULL );
+    replies_ = mem_convey_new(SIZE_MAX, 0, NULL, 0, "replies");
+    assert( replies_ != NULL );
+  }
+
+  ~ConveyCoro() {
+    mem_convey_free(requests_);
+    mem_convey_free(replies_);
+  }
+
+  ConveyCoro(const ConveyCoro&) = delete;
+  ConveyCoro& operator=(const ConveyCoro&) = delete;
+
+  /*! \brief ltable[lindx] on pe, for co_await inside an element of run() */
+  Get remote_get(int64_t pe, int64_t lindx) { return Get(this, pe, lindx); }
+
+  /*!
+   * \brief Run spawn(i) for 0 <= i < count, each a coroutine returning
+   * ConveyTask, and return when all of them have ended on every PE.
+   */
+  template<typename Spawn>
+  void run(int64_t count, Spawn spawn) {
+    int64_t from;
+    bool more;
+    int64_t next = 0;
+
+    cprof_begin(requests_, sizeof(request_t), alignof(request_t), "requests");
+    cprof_begin(replies_, sizeof(reply_t), alignof(reply_t), "replies");
+
+    // an element that has not ended waits on exactly one request
+    while (more = cprof_advance(requests_, next == count && waiting_ == 0),
+           more | cprof_advance(replies_, !more)) {
+
+      // retry the requests the conveyor refused, per destination until it refuses again
+      for (size_t k = 0; k < backed_up_.size();) {
+        int64_t pe = backed_up_[k];
+        std::vector<request_t> &q = backlog_[pe];
+        size_t &h = backlog_head_[pe];
+        for (; h < q.size(); h++)
+          if (! cprof_push(requests_, &q[h], pe))
+            break;
+        if (h == q.size()) {
+          q.clear();
+          h = 0;
+          backed_up_[k] = backed_up_.back();
+          backed_up_.pop_back();
+        } else {
+          k++;
+        }
+      }
+
+      // new elements run up to their first lookup, even when some destination
+      // is full, so that one full destination does not hold up the others
+      while (next < count && waiting_ < window_)
+        spawn(next++);
+
+      request_t *req;
+      while ((req = (request_t*)cprof_apull(requests_, &from)) != NULL) {
+        reply_t rep;
+        rep.slot = *req & ((1 << SLOT_BITS) - 1);
+        rep.val = ltable_[*req >> SLOT_BITS];
+        if (! cprof_push(replies_, &rep, from)) {
+          cprof_unpull(requests_);
+          break;
+        }
+      }
+
+      // a resumed element may send its next request before it suspends again
+      reply_t *rep;
+      while ((rep = (reply_t*)cprof_apull(replies_, NULL)) != NULL) {
+        Get *w = waiter_[rep->slot];
+        free_slots_.push_back(rep->slot);
+        w->val_ = rep->val;
+        waiting_--;
+        w->h_.resume();
+      }
+    }
+
+    convey_reset(requests_);
+    convey_reset(replies_);
+  }
+
+ private:
+  void send(Get *waiter, int64_t pe, int64_t lindx) {
+    waiting_++;
+    int64_t slot = free_slots_.back();
+    free_slots_.pop_back();
+    waiter_[slot] = waiter;
+    request_t req = lindx << SLOT_BITS | slot;
+    std::vector<request_t> &q = backlog_[pe];
+    if (q.empty() && cprof_push(requests_, &req, pe))
+      return;
+    if (q.empty())
+      backed_up_.push_back(pe);
+    q.push_back(req);
+  }
+
+  convey_t *requests_;
+  convey_t *replies_;
+  const T *ltable_;
+  int64_t window_;
+  int64_t waiting_;
+  std::vector<Get*> waiter_;                       /*!< the awaiter waiting in each slot */
+  std::vector<int64_t> free_slots_;
+  std::vector<std::vector<request_t> > backlog_;   /*!< refused requests per destination */
+  std::vector<size_t> backlog_head_;
+  std::vector<int64_t> backed_up_;                 /*!< destinations with a backlog */
+};
+
+#endif
@@ -0,0 +1,625 @@
+/*! \file convey_prof.h
+ * \brief A thin counting layer over the conveyor calls of the advance loop.
+ *
+ * Every kernel in this repository runs the same loop
+ *
+ *     while (convey_advance(c, done)) { push until fail; pull until empty }
+ *
+ * The cprof_* functions wrap convey_begin, convey_push, convey_pull,
+ * convey_apull, convey_unpull, convey_advance and convey_free. They
+ * count per PE and per phase: pushes, pushes refused by back-pressure,
+ * pulls, empty pulls, unpulls, advance calls, the time spent inside
+ * convey_advance, and the messages and bytes sent to each destination.
+ * A counter increment per call and one clock read per advance are cheap
+ * enough to leave on.
+ *
+ * Phases are named with a ConveyPhase scope:
+ *
+ *     { ConveyPhase ph("shuffle");  ... the advance loop ... }
+ *
+ * Every PE must open the same phases in the same order, so that
+ * cprof_report(), which is collective, can line them up.
+ *
+ * After cprof_enable_matrix() the messages and bytes each PE pushes to
+ * each destination are also kept per phase and per conveyor ("channel",
+ * named by the label given to cprof_begin), and cprof_write_matrix()
+ * writes them as PE x PE and node x node matrices.
+ *
+ * After cprof_enable_trace(prefix) every PE also records each push, each
+ * advance and each phase boundary, with a timestamp, in prefix.<pe>.trace
+ * until cprof_finish_trace(). tools/convey_replay reads the traces. A file
+ * is a 64 byte header, 16 byte records, then the phase names and the
+ * conveyors (label, item size) that the records index:
+ *
+ *     header  "CPTRACE1" u32 pe, npes, pes_per_node, 0  u64 records, footer offset
+ *     record  u64 ns since cprof_enable_trace  u32 destination (or the done
+ *             flag of an advance)  u16 phase  u8 conveyor  u8 kind
+ *     footer  u32 phases, {u16 length, name}...  u32 conveyors,
+ *             {u32 item size, u16 length, label}...
+ *
+ * Define CONVEY_PROF_OFF to turn the wrappers into the bare conveyor calls,
+ * which also leaves nothing to trace.
+ */
+#ifndef CONVEY_PROF_H
+#define CONVEY_PROF_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <string>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+#include <shmem.h>
+extern "C" {
+#include <convey.h>
+}
+
+static inline double cprof_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + 1.0e-9 * (double)ts.tv_nsec;
+}
+
+/* kinds of trace records */
+enum { CPROF_EV_PUSH = 0, CPROF_EV_ADVANCE = 1, CPROF_EV_BEGIN = 2, CPROF_EV_END = 3 };
+
+/*! \brief One trace record. */
+struct cprof_trace_rec_t {
+  uint64_t t_ns;     /*!< since cprof_enable_trace(), the same instant on every PE */
+  uint32_t dst;      /*!< the destination of a push, the done flag of an advance */
+  uint16_t phase;
+  uint8_t conv;      /*!< conveyor of a push or advance */
+  uint8_t kind;      /*!< CPROF_EV_* */
+};
+
+/*! \brief What one PE did in one phase. */
+struct cprof_counters_t {
+  int64_t pushes;
+  int64_t push_fails;
+  int64_t pulls;
+  int64_t empty_pulls;
+  int64_t unpulls;
+  int64_t advances;
+  double advance_sec;   /*!< time inside convey_advance */
+  double phase_sec;     /*!< time inside the phase's scopes */
+  int64_t bytes;        /*!< bytes pushed to all destinations */
+};
+
+/*! \brief The per PE profile: one set of counters per phase. */
+class ConveyProfile {
+ public:
+  /*! \brief traffic of one conveyor in one phase, kept only with the matrix on */
+  struct Channel {
+    const convey_t *conv;
+    std::string label;
+    std::vector<int64_t> msgs_to;    /*!< messages pushed to each PE */
+    std::vector<int64_t> bytes_to;   /*!< bytes pushed to each PE */
+  };
+
+  struct Phase {
+    std::string name;
+    cprof_counters_t c;
+    std::vector<Channel> channels;
+  };
+
+  /*
+   * One profile per PE. Some runtimes (tshmem) run PEs as threads of one
+   * process, so per-PE state in these headers is static thread_local
+   * rather than static; see common/README.md.
+   */
+  static ConveyProfile& get() {
+    static thread_local ConveyProfile prof;
+    ConveyProfile *p = charged();
+    return p != NULL ? *p : prof;
+  }
+
+  /*!
+   * \brief Charge the calling thread's conveyor calls to another thread's
+   * profile, e.g. a PE's progress thread to the PE; NULL to stop. The two
+   * threads must not make conveyor calls at the same time.
+   */
+  static void charge_to(ConveyProfile *p) { charged() = p; }
+
+  /*! \brief Switch to the named phase, creating it on first use; returns the previous one. */
+  int64_t enter(const char *name) {
+    int64_t prev = cur_;
+    last_ = NULL;
+    for (cur_ = 0; cur_ < (int64_t)phases_.size(); cur_++)
+      if (phases_[cur_].name == name)
+        return prev;
+    Phase ph;
+    ph.name = name;
+    memset(&ph.c, 0, sizeof(ph.c));
+    phases_.push_back(ph);
+    return prev;
+  }
+
+  void leave(int64_t prev) { cur_ = prev; last_ = NULL; }
+
+  Phase& cur() { return phases_[cur_]; }
+  std::vector<Phase>& phases() { return phases_; }
+
+  /*
+   * Conveyors remember their item size from convey_begin for the byte
+   * counts. Conveyors and channels are keyed by label, not by address: a
+   * kernel that builds its conveyors anew for every trial gets back the
+   * same id and the same channel on every PE, wherever malloc puts them.
+   */
+  void begin(const convey_t *c, size_t size, const char *label) {
+    last_ = NULL;
+    std::string name = label ? label : "c" + std::to_string(sizes_.size());
+    size_t k;
+    for (k = 0; k < sizes_.size(); k++)
+      if (sizes_[k].first == c)
+        break;
+    // a freed conveyor's id goes to the next one with its label
+    for (size_t j = 0; k == sizes_.size() && j < sizes_.size(); j++)
+      if (sizes_[j].first == NULL && labels_[j] == name)
+        k = j;
+    if (k == sizes_.size()) {
+      sizes_.push_back(std::make_pair(c, size));
+      labels_.push_back(name);
+    }
+    sizes_[k].first = c;
+    sizes_[k].second = size;
+    if (!matrix_)
+      return;
+    // every PE begins the same conveyors in the same phases, so the channels line up
+    std::vector<Channel> &chs = cur().channels;
+    if (!label)
+      name = "c" + std::to_string(chs.size());
+    for (k = 0; k < chs.size(); k++)
+      if (chs[k].conv == c || (chs[k].conv == NULL && chs[k].label == name)) {
+        chs[k].conv = c;
+        return;
+      }
+    Channel ch;
+    ch.conv = c;
+    ch.label = name;
+    ch.msgs_to.assign(shmem_n_pes(), 0);
+    ch.bytes_to.assign(shmem_n_pes(), 0);
+    chs.push_back(ch);
+  }
+
+  /* c is being freed; a new conveyor at its address is not c */
+  void end(const convey_t *c) {
+    last_ = NULL;
+    for (size_t k = 0; k < sizes_.size(); k++)
+      if (sizes_[k].first == c)
+        sizes_[k].first = NULL;
+    for (size_t p = 0; p < phases_.size(); p++)
+      for (size_t k = 0; k < phases_[p].channels.size(); k++)
+        if (phases_[p].channels[k].conv == c)
+          phases_[p].channels[k].conv = NULL;
+  }
+
+  size_t item_size(const convey_t *c) const {
+    for (size_t k = 0; k < sizes_.size(); k++)
+      if (sizes_[k].first == c)
+        return sizes_[k].second;
+    return 0;
+  }
+
+  /*! \brief Open this PE's trace file; t0 is the common start of the trace. */
+  bool trace_open(const std::string &path, double t0) {
+    trace_fd_ = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    trace_t0_ = t0;
+    trace_count_ = 0;
+    trace_buf_.clear();
+    trace_buf_.reserve(TRACE_CHUNK);
+    trace_ok_ = trace_fd_ >= 0 && lseek(trace_fd_, TRACE_HEADER, SEEK_SET) == TRACE_HEADER;
+    return trace_ok_;
+  }
+
+  bool tracing() const { return trace_fd_ >= 0; }
+
+  void trace(int kind, const convey_t *c, uint32_t dst) {
+    cprof_trace_rec_t r;
+    r.t_ns = (uint64_t)((cprof_now() - trace_t0_) * 1.0e9);
+    r.dst = dst;
+    r.phase = (uint16_t)cur_;
+    r.conv = 0;
+    for (size_t k = 0; c != NULL && k < sizes_.size(); k++)
+      if (sizes_[k].first == c)
+        r.conv = (uint8_t)k;
+    r.kind = (uint8_t)kind;
+    trace_buf_.push_back(r);
+    if (trace_buf_.size() == TRACE_CHUNK)
+      trace_flush();
+  }
+
+  /*! \brief Write the rest of the records, the footer and the header, and close. \return false on a short write */
+  bool trace_close() {
+    if (trace_fd_ < 0)
+      return false;
+    trace_flush();
+    uint64_t footer = TRACE_HEADER + trace_count_ * sizeof(cprof_trace_rec_t);
+    std::string f;
+    uint32_t n = phases_.size();
+    f.append((const char*)&n, 4);
+    for (size_t p = 0; p < phases_.size(); p++)
+      trace_string(f, phases_[p].name);
+    n = sizes_.size();
+    f.append((const char*)&n, 4);
+    for (size_t k = 0; k < sizes_.size(); k++) {
+      uint32_t size = sizes_[k].second;
+      f.append((const char*)&size, 4);
+      trace_string(f, labels_[k]);
+    }
+    trace_ok_ = trace_ok_ && write(trace_fd_, f.data(), f.size()) == (ssize_t)f.size();
+
+    char h[TRACE_HEADER];
+    memset(h, 0, sizeof(h));
+    uint32_t ids[4] = { (uint32_t)shmem_my_pe(), (uint32_t)shmem_n_pes(),
+                        (uint32_t)shmem_team_n_pes(SHMEM_TEAM_SHARED), 0 };
+    memcpy(h, "CPTRACE1", 8);
+    memcpy(h + 8, ids, sizeof(ids));
+    memcpy(h + 24, &trace_count_, 8);
+    memcpy(h + 32, &footer, 8);
+    trace_ok_ = trace_ok_ && pwrite(trace_fd_, h, sizeof(h), 0) == (ssize_t)sizeof(h);
+    close(trace_fd_);
+    trace_fd_ = -1;
+    std::vector<cprof_trace_rec_t>().swap(trace_buf_);
+    return trace_ok_;
+  }
+
+  bool matrix() const { return matrix_; }
+  void set_matrix(bool on) { matrix_ = on; }
+
+  /*! \brief the current phase's channel for c, NULL if it was begun outside this phase */
+  Channel* channel(const convey_t *c) {
+    if (last_ != NULL && last_->conv == c && last_phase_ == cur_)
+      return last_;
+    std::vector<Channel> &chs = cur().channels;
+    last_ = NULL;
+    for (size_t k = 0; k < chs.size(); k++)
+      if (chs[k].conv == c) {
+        last_ = &chs[k];
+        last_phase_ = cur_;
+      }
+    return last_;
+  }
+
+  void clear() { phases_.clear(); last_ = NULL; enter("other"); }
+
+ private:
+  static const size_t TRACE_CHUNK = 1 << 16;   /*!< records buffered between writes */
+  static const off_t TRACE_HEADER = 64;
+
+  ConveyProfile() : cur_(0), matrix_(false), last_(NULL), last_phase_(-1) { enter("other"); }
+
+  void trace_flush() {
+    size_t bytes = trace_buf_.size() * sizeof(cprof_trace_rec_t);
+    if (bytes > 0 && write(trace_fd_, trace_buf_.data(), bytes) != (ssize_t)bytes)
+      trace_ok_ = false;
+    trace_count_ += trace_buf_.size();
+    trace_buf_.clear();
+  }
+
+  static void trace_string(std::string &f, const std::string &s) {
+    uint16_t len = s.size();
+    f.append((const char*)&len, 2);
+    f.append(s);
+  }
+
+  static ConveyProfile*& charged() {
+    static thread_local ConveyProfile *p = NULL;
+    return p;
+  }
+
+  std::vector<Phase> phases_;
+  int64_t cur_;
+  std::vector<std::pair<const convey_t*, size_t> > sizes_;
+  bool matrix_;
+  Channel *last_;
+  int64_t last_phase_;
+  std::vector<std::string> labels_;
+  int trace_fd_ = -1;
+  bool trace_ok_ = false;
+  double trace_t0_ = 0.0;
+  uint64_t trace_count_ = 0;
+  std::vector<cprof_trace_rec_t> trace_buf_;
+};
+
+/*! \brief Scope that charges the conveyor calls inside it to a named phase. */
+class ConveyPhase {
+ public:
+  explicit ConveyPhase(const char *name) {
+    ConveyProfile &prof = ConveyProfile::get();
+    prev_ = prof.enter(name);
+    t0_ = cprof_now();
+    if (prof.tracing())
+      prof.trace(CPROF_EV_BEGIN, NULL, 0);
+  }
+  ~ConveyPhase() {
+    ConveyProfile &prof = ConveyProfile::get();
+    if (prof.tracing())
+      prof.trace(CPROF_EV_END, NULL, 0);
+    prof.cur().c.phase_sec += cprof_now() - t0_;
+    prof.leave(prev_);
+  }
+ private:
+  int64_t prev_;
+  double t0_;
+};
+
+#ifndef CONVEY_PROF_OFF
+
+/*! \brief convey_begin; label names the conveyor in the communication matrix */
+static inline int cprof_begin(convey_t *c, size_t item_size, size_t align, const char *label = NULL) {
+  ConveyProfile::get().begin(c, item_size, label);
+  return convey_begin(c, item_size, align);
+}
+
+static inline bool cprof_push(convey_t *c, const void *item, int64_t pe) {
+  ConveyProfile &prof = ConveyProfile::get();
+  ConveyProfile::Phase &ph = prof.cur();
+  if (!convey_push(c, item, pe)) {
+    ph.c.push_fails++;
+    return false;
+  }
+  size_t bytes = prof.item_size(c);
+  ph.c.pushes++;
+  ph.c.bytes += bytes;
+  if (prof.tracing())
+    prof.trace(CPROF_EV_PUSH, c, (uint32_t)pe);
+  if (prof.matrix()) {
+    ConveyProfile::Channel *ch = prof.channel(c);
+    if (ch != NULL) {
+      ch->msgs_to[pe]++;
+      ch->bytes_to[pe] += bytes;
+    }
+  }
+  return true;
+}
+
+static inline int cprof_pull(convey_t *c, void *item, int64_t *from) {
+  int ret = convey_pull(c, item, from);
+  cprof_counters_t &cnt = ConveyProfile::get().cur().c;
+  if (ret == convey_OK)
+    cnt.pulls++;
+  else
+    cnt.empty_pulls++;
+  return ret;
+}
+
+static inline void* cprof_apull(convey_t *c, int64_t *from) {
+  void *item = convey_apull(c, from);
+  cprof_counters_t &cnt = ConveyProfile::get().cur().c;
+  if (item != NULL)
+    cnt.pulls++;
+  else
+    cnt.empty_pulls++;
+  return item;
+}
+
+static inline int cprof_unpull(convey_t *c) {
+  ConveyProfile::get().cur().c.unpulls++;
+  return convey_unpull(c);
+}
+
+static inline bool cprof_advance(convey_t *c, bool done) {
+  double t = cprof_now();
+  bool more = convey_advance(c, done);
+  ConveyProfile &prof = ConveyProfile::get();
+  cprof_counters_t &cnt = prof.cur().c;
+  cnt.advances++;
+  cnt.advance_sec += cprof_now() - t;
+  if (prof.tracing())
+    prof.trace(CPROF_EV_ADVANCE, c, done);
+  return more;
+}
+
+/*! \brief convey_free; forgets c, so that a conveyor later made at the same address starts afresh */
+static inline int cprof_free(convey_t *c) {
+  ConveyProfile::get().end(c);
+  return convey_free(c);
+}
+
+#else
+
+static inline int cprof_begin(convey_t *c, size_t item_size, size_t align, const char * = NULL) { return convey_begin(c, item_size, align); }
+static inline bool cprof_push(convey_t *c, const void *item, int64_t pe) { return convey_push(c, item, pe); }
+static inline int cprof_pull(convey_t *c, void *item, int64_t *from) { return convey_pull(c, item, from); }
+static inline void* cprof_apull(convey_t *c, int64_t *from) { return convey_apull(c, from); }
+static inline int cprof_unpull(convey_t *c) { return convey_unpull(c); }
+static inline bool cprof_advance(convey_t *c, bool done) { return convey_advance(c, done); }
+static inline int cprof_free(convey_t *c) { return convey_free(c); }
+
+#endif
+
+/*!
+ * \brief Collective: print a per phase summary of all PEs on PE 0 and
+ * optionally write every PE's counters as CSV (one line per PE and phase).
+ * The verdict column is a hint, from the first rule that matches:
+ *   "network"       more than half of the phase was spent inside convey_advance
+ *   "back-pressure" more than 1% of the pushes were refused: the receivers
+ *                   or the network do not drain fast enough
+ *   "send-starved"  most pulls came back empty: receivers wait for senders
+ *   "compute"       none of the above
+ * \param out where PE 0 prints the summary, NULL for none
+ * \param csv_file file for the per PE counters, or NULL
+ */
+static inline void cprof_report(FILE *out, const char *csv_file) {
+  std::vector<ConveyProfile::Phase> &phases = ConveyProfile::get().phases();
+  int64_t npes = shmem_n_pes();
+  int64_t me = shmem_my_pe();
+  int64_t nph = (int64_t)phases.size();
+  int64_t p, q;
+
+  cprof_counters_t *all = (cprof_counters_t*)shmem_malloc(nph * npes * sizeof(cprof_counters_t));
+  for (p = 0; p < nph; p++)
+    shmem_putmem(&all[p*npes + me], &phases[p].c, sizeof(cprof_counters_t), 0);
+  shmem_barrier_all();
+
+  if (me == 0 && out != NULL) {
+    int width = 14;   // the phase column fits the longest name
+    for (p = 0; p < nph; p++)
+      if ((int)phases[p].name.size() > width)
+        width = (int)phases[p].name.size();
+    fprintf(out, "%-*s %10s %9s %9s %9s %7s %7s %7s %12s  %s\n", width, "phase", "advances", "adv s avg",
+            "adv s max", "phase max", "fail%", "empty%", "unpull", "MB sent max", "verdict");
+    for (p = 0; p < nph; p++) {
+      cprof_counters_t sum;
+      double adv_max = 0.0, phase_max = 0.0, mb_max = 0.0;
+      memset(&sum, 0, sizeof(sum));
+      for (q = 0; q < npes; q++) {
+        cprof_counters_t *c = &all[p*npes + q];
+        sum.pushes += c->pushes;
+        sum.push_fails += c->push_fails;
+        sum.pulls += c->pulls;
+        sum.empty_pulls += c->empty_pulls;
+        sum.unpulls += c->unpulls;
+        sum.advances += c->advances;
+        sum.advance_sec += c->advance_sec;
+        sum.phase_sec += c->phase_sec;
+        if (c->advance_sec > adv_max) adv_max = c->advance_sec;
+        if (c->phase_sec > phase_max) phase_max = c->phase_sec;
+        if (c->bytes * 1.0e-6 > mb_max) mb_max = c->bytes * 1.0e-6;
+      }
+      if (sum.advances == 0)
+        continue;
+      double fail = 100.0 * sum.push_fails / (double)(sum.pushes + sum.push_fails > 0 ? sum.pushes + sum.push_fails : 1);
+      double empty = 100.0 * sum.empty_pulls / (double)(sum.pulls + sum.empty_pulls > 0 ? sum.pulls + sum.empty_pulls : 1);
+      const char *verdict = "compute";
+      if (sum.phase_sec > 0.0 && 2.0 * sum.advance_sec > sum.phase_sec)
+        verdict = "network";
+      else if (fail > 1.0)
+        verdict = "back-pressure";
+      else if (empty > 50.0)
+        verdict = "send-starved";
+      fprintf(out, "%-*s %10ld %9.4lf %9.4lf %9.4lf %7.2lf %7.2lf %7ld %12.3lf  %s\n",
+              width, phases[p].name.c_str(), sum.advances / npes, sum.advance_sec / npes, adv_max,
+              phase_max, fail, empty, sum.unpulls, mb_max, verdict);
+    }
+  }
+
+  if (me == 0 && csv_file != NULL) {
+    FILE *fp = fopen(csv_file, "w");
+    if (fp == NULL) {
+      fprintf(stderr, "ERROR: can't open %s\n", csv_file);
+    } else {
+      fprintf(fp, "phase,pe,pushes,push_fails,pulls,empty_pulls,unpulls,advances,advance_s,phase_s,bytes\n");
+      for (p = 0; p < nph; p++)
+        for (q = 0; q < npes; q++) {
+          cprof_counters_t *c = &all[p*npes + q];
+          fprintf(fp, "%s,%ld,%ld,%ld,%ld,%ld,%ld,%ld,%.6lf,%.6lf,%ld\n", phases[p].name.c_str(), q,
+                  c->pushes, c->push_fails, c->pulls, c->empty_pulls, c->unpulls, c->advances,
+                  c->advance_sec, c->phase_sec, c->bytes);
+        }
+      fclose(fp);
+    }
+  }
+
+  shmem_barrier_all();
+  shmem_free(all);
+}
+
+/*!
+ * \brief Collective: start recording every push, advance and phase boundary
+ * of this PE in prefix.<pe>.trace (see the file comment). The trace starts
+ * at a barrier, which is time 0 for every PE.
+ */
+static inline void cprof_enable_trace(const char *prefix) {
+  std::string path = std::string(prefix) + "." + std::to_string(shmem_my_pe()) + ".trace";
+  shmem_barrier_all();
+  if (!ConveyProfile::get().trace_open(path, cprof_now()))
+    fprintf(stderr, "ERROR: can't write the conveyor trace %s\n", path.c_str());
+}
+
+/*! \brief Finish this PE's trace file. */
+static inline void cprof_finish_trace() {
+  ConveyProfile &prof = ConveyProfile::get();
+  if (prof.tracing() && !prof.trace_close())
+    fprintf(stderr, "ERROR: short write to the conveyor trace of PE %d\n", shmem_my_pe());
+}
+
+/*! \brief Start keeping per destination traffic for the conveyors begun from now on. */
+static inline void cprof_enable_matrix() { ConveyProfile::get().set_matrix(true); }
+
+/*!
+ * \brief Collective: write the communication matrices of every phase and channel.
+ * Nodes are taken to hold consecutive blocks of shmem_team_n_pes(SHMEM_TEAM_SHARED)
+ * PEs, the usual block placement.
+ *   prefix.node.csv  phase,channel,src_node,dst_node,msgs,bytes for every nonzero pair
+ *   prefix.pe.bin    for each section (phase, channel) in the order of prefix.pe.idx,
+ *                    an npes x npes int64_t message matrix then the byte matrix, row
+ *                    src, column dst; every PE writes its own rows
+ *   prefix.pe.idx    "npes <n> pes_per_node <m>", then "<section> <phase> <channel> <offset>"
+ * \param prefix path prefix of the three files
+ */
+static inline void cprof_write_matrix(const char *prefix) {
+  std::vector<ConveyProfile::Phase> &phases = ConveyProfile::get().phases();
+  int64_t npes = shmem_n_pes();
+  int64_t me = shmem_my_pe();
+  int64_t ppn = shmem_team_n_pes(SHMEM_TEAM_SHARED);
+  if (ppn < 1)
+    ppn = 1;
+  int64_t nnodes = (npes + ppn - 1) / ppn;
+  int64_t mynode = me / ppn;
+  std::string base(prefix);
+  int64_t nn2 = nnodes * nnodes;
+
+  int64_t *node_src = (int64_t*)shmem_malloc(2 * nn2 * sizeof(int64_t));
+  int64_t *node_dst = (int64_t*)shmem_malloc(2 * nn2 * sizeof(int64_t));
+
+  FILE *csv = NULL, *idx = NULL;
+  if (me == 0) {
+    csv = fopen((base + ".node.csv").c_str(), "w");
+    idx = fopen((base + ".pe.idx").c_str(), "w");
+    int fd = open((base + ".pe.bin").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (csv == NULL || idx == NULL || fd < 0)
+      fprintf(stderr, "ERROR: can't write the communication matrix to %s.*\n", prefix);
+    if (fd >= 0)
+      close(fd);
+    if (csv) fprintf(csv, "phase,channel,src_node,dst_node,msgs,bytes\n");
+    if (idx) fprintf(idx, "npes %ld pes_per_node %ld\n", npes, ppn);
+  }
+  shmem_barrier_all();
+  int fd = open((base + ".pe.bin").c_str(), O_WRONLY);
+
+  int64_t section = 0;
+  for (size_t p = 0; p < phases.size(); p++) {
+    std::vector<ConveyProfile::Channel> &chs = phases[p].channels;
+    for (size_t k = 0; k < chs.size(); k++, section++) {
+      off_t off = (off_t)section * 2 * npes * npes * sizeof(int64_t);
+      size_t row = npes * sizeof(int64_t);
+      if (fd >= 0) {
+        if (pwrite(fd, chs[k].msgs_to.data(), row, off + me * row) != (ssize_t)row ||
+            pwrite(fd, chs[k].bytes_to.data(), row, off + (npes + me) * row) != (ssize_t)row)
+          fprintf(stderr, "ERROR: short write to %s.pe.bin on PE %ld\n", prefix, me);
+      }
+
+      memset(node_src, 0, 2 * nn2 * sizeof(int64_t));
+      for (int64_t d = 0; d < npes; d++) {
+        node_src[mynode * nnodes + d / ppn] += chs[k].msgs_to[d];
+        node_src[nn2 + mynode * nnodes + d / ppn] += chs[k].bytes_to[d];
+      }
+      shmem_barrier_all();
+      shmem_int64_sum_reduce(SHMEM_TEAM_WORLD, node_dst, node_src, 2 * nn2);
+
+      if (me == 0) {
+        if (idx)
+          fprintf(idx, "%ld %s %s %ld\n", section, phases[p].name.c_str(), chs[k].label.c_str(), (int64_t)off);
+        for (int64_t i = 0; csv && i < nn2; i++)
+          if (node_dst[i] != 0)
+            fprintf(csv, "%s,%s,%ld,%ld,%ld,%ld\n", phases[p].name.c_str(), chs[k].label.c_str(),
+                    i / nnodes, i % nnodes, node_dst[i], node_dst[nn2 + i]);
+      }
+    }
+  }
+
+  if (fd >= 0)
+    close(fd);
+  if (csv) fclose(csv);
+  if (idx) fclose(idx);
+  shmem_barrier_all();
+  shmem_free(node_src);
+  shmem_free(node_dst);
+}
+
+#endif
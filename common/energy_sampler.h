@@ -0,0 +1,502 @@
+/*! \file energy_sampler.h
+ * \brief Energy and network traffic time series taken inside the benchmark.
+ *
+ * One PE per node (PE 0 of SHMEM_TEAM_SHARED) runs a background thread.
+ * Every interval, the thread records the time, the node's energy counter
+ * and the NIC byte counters. Every PE calls energy_mark("phase") at the
+ * same points of the program. On the node leaders, each mark takes an
+ * extra sample, so the energy of a phase is the difference between two
+ * marks rather than something estimated between samples.
+ * energy_stop() writes one CSV file for the whole job and prints the
+ * energy of each phase summed over the nodes. This replaces running
+ * omnistat/network-extract.py over exported data after the job.
+ *
+ * Sources (ENERGY_SOURCE, default "auto" tries them in this order):
+ *   papi           cray_pm:::PM_ENERGY:NODE through PAPI (needs -DUSE_PAPI)
+ *   pm_counters    /sys/cray/pm_counters/energy
+ *   rapl           sum of the package zones /sys/class/powercap/intel-rapl:N/energy_uj
+ *   replay:<file>  "seconds joules tx_bytes rx_bytes" lines, interpolated in
+ *                  time, a stand-in for testing on ordinary Linux
+ *   none           timestamps and NIC counters only
+ * NIC counters are the sums of the files matching ENERGY_NET_TX and
+ * ENERGY_NET_RX (globs, defaulting to the Slingshot cxi telemetry).
+ * A reading is -1 when it is not available.
+ */
+#ifndef ENERGY_SAMPLER_H
+#define ENERGY_SAMPLER_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <glob.h>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include <shmem.h>
+#ifdef USE_PAPI
+#include <papi.h>
+#endif
+
+#define ENERGY_MAX_MARKS 64
+
+/*! \brief One reading of the node's counters. */
+struct energy_reading_t {
+  double joules;
+  int64_t tx_bytes;
+  int64_t rx_bytes;
+};
+
+/*! \brief Where the energy readings come from. */
+class EnergySource {
+ public:
+  virtual ~EnergySource() {}
+  virtual const char* name() const = 0;
+  /* joules since some fixed origin, -1 if unavailable; t is the seconds since the sampler started */
+  virtual double joules(double t) = 0;
+  /* the replay source also replays the NIC counters */
+  virtual bool has_net() const { return false; }
+  virtual void net(double t, int64_t *tx, int64_t *rx) { (void)t; *tx = *rx = -1; }
+};
+
+/* sum of the integers in the files matching a glob, -1 if none match */
+static inline int64_t energy_sum_files(const char *pattern) {
+  glob_t g;
+  int64_t sum = -1;
+  if (pattern == NULL || glob(pattern, 0, NULL, &g) != 0)
+    return -1;
+  for (size_t k = 0; k < g.gl_pathc; k++) {
+    FILE *fp = fopen(g.gl_pathv[k], "r");
+    long long v;
+    if (fp == NULL)
+      continue;
+    if (fscanf(fp, "%lld", &v) == 1)
+      sum = (sum < 0 ? 0 : sum) + v;
+    fclose(fp);
+  }
+  globfree(&g);
+  return sum;
+}
+
+class NoEnergy : public EnergySource {
+ public:
+  const char* name() const { return "none"; }
+  double joules(double) { return -1.0; }
+};
+
+/* the integer in a file, -1 if it can't be read */
+static inline int64_t energy_read_file(const char *path) {
+  FILE *fp = fopen(path, "r");
+  long long v;
+  if (fp == NULL)
+    return -1;
+  if (fscanf(fp, "%lld", &v) != 1)
+    v = -1;
+  fclose(fp);
+  return v;
+}
+
+/*!
+ * \brief Files holding counters in joules (scale 1) or microjoules (scale 1e-6).
+ * patterns is a NULL terminated list of globs; the reading is the sum of the
+ * matching files. A file whose directory has max_energy_range_uj wraps at that
+ * value, so each file is unwrapped on its own before the sum.
+ */
+class SysfsEnergy : public EnergySource {
+ public:
+  SysfsEnergy(const char *name, const char *const *patterns, double scale)
+    : name_(name), scale_(scale) {
+    for (; *patterns; patterns++) {
+      glob_t g;
+      if (glob(*patterns, 0, NULL, &g) != 0)
+        continue;
+      for (size_t k = 0; k < g.gl_pathc; k++) {
+        Zone z;
+        z.path = g.gl_pathv[k];
+        std::string dir = z.path.substr(0, z.path.rfind('/') + 1);
+        z.range = energy_read_file((dir + "max_energy_range_uj").c_str());
+        z.last = -1;
+        z.offset = 0.0;
+        zones_.push_back(z);
+      }
+      globfree(&g);
+    }
+  }
+  const char* name() const { return name_; }
+  bool ok() {
+    for (Zone &z : zones_)
+      if (energy_read_file(z.path.c_str()) >= 0)
+        return true;
+    return false;
+  }
+  double joules(double) {
+    double sum = -1.0;
+    for (Zone &z : zones_) {
+      int64_t v = energy_read_file(z.path.c_str());
+      if (v < 0)
+        continue;
+      // RAPL counters wrap; a drop means one wrap of this zone's range
+      if (z.last >= 0 && v < z.last && z.range > 0)
+        z.offset += (double)z.range * scale_;
+      z.last = v;
+      sum = (sum < 0.0 ? 0.0 : sum) + z.offset + (double)v * scale_;
+    }
+    return sum;
+  }
+ private:
+  struct Zone {
+    std::string path;
+    int64_t range;    // max_energy_range_uj, -1 if the counter doesn't wrap
+    int64_t last;
+    double offset;
+  };
+  const char *name_;
+  double scale_;
+  std::vector<Zone> zones_;
+};
+
+#ifdef USE_PAPI
+class PapiEnergy : public EnergySource {
+ public:
+  PapiEnergy() : eventset_(PAPI_NULL), ok_(false) {
+    if (PAPI_is_initialized() == PAPI_NOT_INITED &&
+        PAPI_library_init(PAPI_VER_CURRENT) != PAPI_VER_CURRENT)
+      return;
+    if (PAPI_create_eventset(&eventset_) != PAPI_OK)
+      return;
+    if (PAPI_add_named_event(eventset_, "cray_pm:::PM_ENERGY:NODE") != PAPI_OK)
+      return;
+    ok_ = PAPI_start(eventset_) == PAPI_OK;
+  }
+  ~PapiEnergy() {
+    long long v;
+    if (ok_)
+      PAPI_stop(eventset_, &v);
+  }
+  const char* name() const { return "papi"; }
+  bool ok() const { return ok_; }
+  double joules(double) {
+    long long v = 0;
+    if (!ok_ || PAPI_read(eventset_, &v) != PAPI_OK)
+      return -1.0;
+    return (double)v;
+  }
+ private:
+  int eventset_;
+  bool ok_;
+};
+#endif
+
+/*! \brief Replays a recorded trace, linearly interpolated at the sample times. */
+class ReplayEnergy : public EnergySource {
+ public:
+  explicit ReplayEnergy(const char *path) {
+    FILE *fp = fopen(path, "r");
+    double t, j;
+    long long tx, rx;
+    char line[256];
+    while (fp != NULL && fgets(line, sizeof(line), fp) != NULL)
+      if (line[0] != '#' && sscanf(line, "%lf %lf %lld %lld", &t, &j, &tx, &rx) == 4) {
+        energy_reading_t r = { j, (int64_t)tx, (int64_t)rx };
+        t_.push_back(t);
+        r_.push_back(r);
+      }
+    if (fp != NULL)
+      fclose(fp);
+  }
+  const char* name() const { return "replay"; }
+  bool ok() const { return !t_.empty(); }
+  bool has_net() const { return true; }
+  double joules(double t) { return at(t).joules; }
+  void net(double t, int64_t *tx, int64_t *rx) {
+    energy_reading_t r = at(t);
+    *tx = r.tx_bytes;
+    *rx = r.rx_bytes;
+  }
+ private:
+  energy_reading_t at(double t) {
+    size_t k = 0;
+    while (k + 1 < t_.size() && t_[k + 1] <= t)
+      k++;
+    if (k + 1 >= t_.size() || t <= t_[k])
+      return r_[k];
+    double f = (t - t_[k]) / (t_[k + 1] - t_[k]);
+    energy_reading_t r;
+    r.joules = r_[k].joules + f * (r_[k + 1].joules - r_[k].joules);
+    r.tx_bytes = r_[k].tx_bytes + (int64_t)(f * (double)(r_[k + 1].tx_bytes - r_[k].tx_bytes));
+    r.rx_bytes = r_[k].rx_bytes + (int64_t)(f * (double)(r_[k + 1].rx_bytes - r_[k].rx_bytes));
+    return r;
+  }
+  std::vector<double> t_;
+  std::vector<energy_reading_t> r_;
+};
+
+/*!
+ * \brief The per node sampler; every PE holds one, only node leaders sample.
+ * Use it through energy_start, energy_mark and energy_stop.
+ */
+class EnergySampler {
+ public:
+  struct Sample {
+    double t;
+    energy_reading_t r;
+    int64_t mark;     /*!< index of the phase the sample belongs to */
+    bool at_mark;     /*!< taken by energy_mark rather than the timer */
+  };
+
+  /* the calling PE's sampler */
+  static EnergySampler& get() {
+    static thread_local EnergySampler s;
+    return s;
+  }
+
+  void start(const char *path, double interval) {
+    path_ = path ? path : "";
+    leader_ = shmem_team_my_pe(SHMEM_TEAM_SHARED) == 0;
+    marks_.clear();
+    samples_.clear();
+    marks_.push_back("start");
+    if (!leader_)
+      return;
+    tx_glob_ = getenv("ENERGY_NET_TX") ? getenv("ENERGY_NET_TX") : "/sys/class/cxi/cxi*/device/telemetry/hni_tx_ok_octets";
+    rx_glob_ = getenv("ENERGY_NET_RX") ? getenv("ENERGY_NET_RX") : "/sys/class/cxi/cxi*/device/telemetry/hni_rx_ok_octets";
+    t0_ = std::chrono::steady_clock::now();
+    stop_ = false;
+    std::unique_lock<std::mutex> lock(mu_);
+    want_mark_ = true;
+    // the sampler thread makes, reads and deletes the source, because a
+    // PAPI event set belongs to the thread that started it; the others hand
+    // their mark samples to it
+    thread_ = std::thread([this, interval]() {
+      std::chrono::duration<double> dt(interval > 0.0 ? interval : 0.01);
+      EnergySource *source = make_source();
+      std::unique_lock<std::mutex> lock(mu_);
+      source_ = source;
+      source_name_ = source->name();
+      while (!stop_ || want_mark_) {
+        if (want_mark_ || cv_.wait_for(lock, dt, [this]() { return want_mark_ || stop_; })) {
+          if (want_mark_) {
+            take_locked(true);
+            want_mark_ = false;
+            cv_.notify_all();
+          }
+        } else {
+          take_locked(false);
+        }
+      }
+      delete source_;
+      source_ = NULL;
+    });
+    cv_.wait(lock, [this]() { return !want_mark_; });
+  }
+
+  void mark(const char *name) {
+    if (marks_.size() >= ENERGY_MAX_MARKS - 1)   // the last one is kept for "end"
+      return;
+    std::unique_lock<std::mutex> lock(mu_);
+    marks_.push_back(name);
+    if (leader_) {
+      want_mark_ = true;
+      cv_.notify_all();
+      cv_.wait(lock, [this]() { return !want_mark_; });
+    }
+  }
+
+  void stop();
+
+  bool running() const { return !marks_.empty(); }
+
+ private:
+  EnergySampler() : leader_(false), stop_(true) {}
+
+  EnergySource* make_source() {
+    std::string want = getenv("ENERGY_SOURCE") ? getenv("ENERGY_SOURCE") : "auto";
+    bool any = want == "auto";
+#ifdef USE_PAPI
+    if (any || want == "papi") {
+      PapiEnergy *p = new PapiEnergy();
+      if (p->ok()) return p;
+      delete p;
+    }
+#endif
+    if (any || want == "pm_counters") {
+      static const char *const pm[] = {"/sys/cray/pm_counters/energy", NULL};
+      SysfsEnergy *s = new SysfsEnergy("pm_counters", pm, 1.0);
+      if (s->ok()) return s;
+      delete s;
+    }
+    if (any || want == "rapl") {
+      // package zones only; their subzones (intel-rapl:0:0, ...) are listed
+      // alongside them and are already counted in the package
+      static const char *const rapl[] = {"/sys/class/powercap/intel-rapl:[0-9]/energy_uj",
+                                         "/sys/class/powercap/intel-rapl:[0-9][0-9]/energy_uj", NULL};
+      SysfsEnergy *s = new SysfsEnergy("rapl", rapl, 1.0e-6);
+      if (s->ok()) return s;
+      delete s;
+    }
+    if (want.compare(0, 7, "replay:") == 0) {
+      ReplayEnergy *r = new ReplayEnergy(want.c_str() + 7);
+      if (r->ok()) return r;
+      fprintf(stderr, "ERROR: can't replay %s\n", want.c_str() + 7);
+      delete r;
+    }
+    return new NoEnergy();
+  }
+
+  void take_locked(bool at_mark) {
+    Sample s;
+    s.t = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0_).count();
+    s.r.joules = source_->joules(s.t);
+    if (source_->has_net()) {
+      source_->net(s.t, &s.r.tx_bytes, &s.r.rx_bytes);
+    } else {
+      s.r.tx_bytes = energy_sum_files(tx_glob_.c_str());
+      s.r.rx_bytes = energy_sum_files(rx_glob_.c_str());
+    }
+    s.mark = (int64_t)marks_.size() - 1;
+    s.at_mark = at_mark;
+    samples_.push_back(s);
+  }
+
+  std::string path_;
+  bool leader_;
+  EnergySource *source_ = NULL;    // the sampler thread's
+  std::string source_name_ = "none";
+  std::string tx_glob_, rx_glob_;
+  std::chrono::steady_clock::time_point t0_;
+  std::vector<std::string> marks_;
+  std::vector<Sample> samples_;
+  std::mutex mu_;
+  std::condition_variable cv_;
+  bool want_mark_ = false;          // a mark waits for the sampler thread's sample
+  bool stop_;
+  std::thread thread_;
+};
+
+/*!
+ * \brief Collective: stop the threads, write the job's CSV and print the energy per phase.
+ * The CSV has node,t_s,phase,at_mark,energy_j,tx_bytes,rx_bytes; every node
+ * leader writes its own block of lines into the one file.
+ */
+inline void EnergySampler::stop() {
+  int64_t me = shmem_my_pe();
+  int64_t npes = shmem_n_pes();
+  int64_t node = me / (shmem_team_n_pes(SHMEM_TEAM_SHARED) > 0 ? shmem_team_n_pes(SHMEM_TEAM_SHARED) : 1);
+
+  if (leader_) {
+    // the sampler thread takes the "end" sample, then returns
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      marks_.push_back("end");
+      want_mark_ = true;
+      stop_ = true;
+      cv_.notify_all();
+    }
+    thread_.join();
+  } else {
+    marks_.push_back("end");
+  }
+  int64_t nmarks = (int64_t)marks_.size();
+
+  // the lines of this node, and the energy and traffic of each phase
+  std::string text;
+  double *phase = (double*)shmem_calloc(3 * ENERGY_MAX_MARKS + 2, sizeof(double));
+  double *total = (double*)shmem_calloc(3 * ENERGY_MAX_MARKS + 2, sizeof(double));
+  int64_t *len = (int64_t*)shmem_calloc(npes, sizeof(int64_t));
+  int64_t *mylen = (int64_t*)shmem_calloc(1, sizeof(int64_t));
+  if (leader_) {
+    char line[256];
+    const Sample *prev = NULL;
+    for (size_t k = 0; k < samples_.size(); k++) {
+      const Sample &s = samples_[k];
+      snprintf(line, sizeof(line), "%ld,%.6lf,%s,%d,%.3lf,%lld,%lld\n", node, s.t, marks_[s.mark].c_str(),
+               s.at_mark ? 1 : 0, s.r.joules, (long long)s.r.tx_bytes, (long long)s.r.rx_bytes);
+      text += line;
+      // a mark sample closes the previous phase
+      if (s.at_mark && prev != NULL && s.mark >= 1) {
+        int64_t p = s.mark - 1;
+        phase[3*p]   += s.r.joules - prev->r.joules;
+        phase[3*p+1] += (double)(s.r.tx_bytes - prev->r.tx_bytes);
+        phase[3*p+2] += s.t - prev->t;
+      }
+      if (s.at_mark)
+        prev = &s;
+    }
+    phase[3 * ENERGY_MAX_MARKS] = 1.0;   // node count
+    phase[3 * ENERGY_MAX_MARKS + 1] = samples_.empty() || samples_[0].r.joules < 0.0 ? 0.0 : 1.0;
+  }
+  *mylen = (int64_t)text.size();
+  shmem_barrier_all();
+  shmem_double_sum_reduce(SHMEM_TEAM_WORLD, total, phase, 3 * ENERGY_MAX_MARKS + 2);
+  shmem_fcollectmem(SHMEM_TEAM_WORLD, len, mylen, sizeof(int64_t));
+
+  if (!path_.empty()) {
+    const char *header = "node,t_s,phase,at_mark,energy_j,tx_bytes,rx_bytes\n";
+    int64_t off = (int64_t)strlen(header);
+    for (int64_t q = 0; q < me; q++)
+      off += len[q];
+    if (me == 0) {
+      int fd = open(path_.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (fd < 0 || write(fd, header, strlen(header)) != (ssize_t)strlen(header))
+        fprintf(stderr, "ERROR: can't write %s\n", path_.c_str());
+      if (fd >= 0)
+        close(fd);
+    }
+    shmem_barrier_all();
+    if (!text.empty()) {
+      int fd = open(path_.c_str(), O_WRONLY);
+      if (fd < 0 || pwrite(fd, text.data(), text.size(), off) != (ssize_t)text.size())
+        fprintf(stderr, "ERROR: short write to %s on PE %ld\n", path_.c_str(), me);
+      if (fd >= 0)
+        close(fd);
+    }
+  }
+
+  if (me == 0) {
+    bool have_energy = total[3 * ENERGY_MAX_MARKS + 1] > 0.0;
+    fprintf(stderr, "Energy by phase over %.0lf nodes (source %s):\n", total[3 * ENERGY_MAX_MARKS],
+            source_name_.c_str());
+    for (int64_t p = 0; p + 1 < nmarks; p++) {
+      double sec = total[3*p+2] / total[3 * ENERGY_MAX_MARKS];
+      fprintf(stderr, "  %-16s %9.3lf s", marks_[p].c_str(), sec);
+      if (have_energy)
+        fprintf(stderr, " %12.1lf J %10.1lf W/node", total[3*p],
+                sec > 0.0 ? total[3*p] / sec / total[3 * ENERGY_MAX_MARKS] : 0.0);
+      if (total[3*p+1] > 0.0)
+        fprintf(stderr, " %12.3lf GB sent", 1.0e-9 * total[3*p+1]);
+      fprintf(stderr, "\n");
+    }
+  }
+
+  shmem_barrier_all();
+  shmem_free(phase);
+  shmem_free(total);
+  shmem_free(len);
+  shmem_free(mylen);
+  source_name_ = "none";
+  marks_.clear();
+  samples_.clear();
+}
+
+/*! \brief Collective: start sampling every interval seconds; path is the CSV to write, or NULL. */
+static inline void energy_start(const char *path, double interval) { EnergySampler::get().start(path, interval); }
+
+/*! \brief Every PE, same order: the code from here on is the named phase. */
+static inline void energy_mark(const char *name) {
+  if (EnergySampler::get().running())
+    EnergySampler::get().mark(name);
+}
+
+/*! \brief Collective: stop sampling, write the CSV and print the energy per phase. */
+static inline void energy_stop() {
+  if (EnergySampler::get().running())
+    EnergySampler::get().stop();
+}
+
+#endif
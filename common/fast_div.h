@@ -0,0 +1,91 @@
+/*! \file fast_div.h
+ * \brief Division by a divisor that is fixed at runtime, without a divide.
+ *
+ * Block-distributed arrays map a global index g to (g / n, g % n) where n,
+ * the number of elements per rank, only changes when the array is created.
+ * A hardware 64-bit divide costs 30-40 cycles. FastDivider precomputes n
+ * once and then divides with a shift when n is a power of two, or with a
+ * multiply-high and a shift otherwise (Granlund and Montgomery, "Division by
+ * invariant integers using multiplication", PLDI 1994; the same scheme as
+ * libdivide).
+ *
+ * Dividends must be in [0, 2^63), which covers every non-negative int64_t
+ * index. For N = 63 dividend bits and l = ceil(log2 n), the magic number
+ * m = ceil(2^(63+l) / n) fits in 64 bits and floor(g / n) equals
+ * mulhi(m, g) >> (l - 1).
+ *
+ * divide_block() maps a whole block of dividends. Its loop forms the
+ * multiply-high from 32-bit halves, which compilers turn into packed
+ * vpmuludq at -O3 with AVX2 or AVX-512. The scalar divide() uses the
+ * 128-bit product instead.
+ */
+#ifndef FAST_DIV_H
+#define FAST_DIV_H
+
+#include <cassert>
+#include <cstdint>
+
+struct FastDivider {
+  uint64_t d_ = 1;
+  uint64_t magic_ = 0;  // 0 when d_ is a power of two
+  int shift_ = 0;
+
+  FastDivider() = default;
+
+  explicit FastDivider(uint64_t d) : d_(d) {
+    assert(d > 0 && d <= (((uint64_t)1) << 63));
+    int l = 0;
+    while (l < 64 && (((uint64_t)1) << l) < d) l++;
+    if ((((uint64_t)1) << l) == d) {
+      shift_ = l;
+      return;
+    }
+    // m = ceil(2^(63+l) / d); l >= 2 here since d is not a power of two
+    unsigned __int128 num = ((unsigned __int128)1) << (63 + l);
+    magic_ = (uint64_t)((num + d - 1) / d);
+    shift_ = l - 1;
+  }
+
+  inline uint64_t divisor() const { return d_; }
+  inline bool is_pow2() const { return magic_ == 0; }
+
+  inline uint64_t divide(uint64_t g) const {
+    if (magic_ == 0)
+      return g >> shift_;
+    return (uint64_t)(((unsigned __int128)magic_ * g) >> 64) >> shift_;
+  }
+
+  // the high 64 bits of a*b, from 32-bit halves so the loop vectorizes
+  static inline uint64_t mulhi_halves(uint64_t a, uint64_t b) {
+    uint64_t a_lo = (uint32_t)a, a_hi = a >> 32;
+    uint64_t b_lo = (uint32_t)b, b_hi = b >> 32;
+    uint64_t lo_lo = a_lo * b_lo;
+    uint64_t hi_lo = a_hi * b_lo;
+    uint64_t lo_hi = a_lo * b_hi;
+    uint64_t hi_hi = a_hi * b_hi;
+    uint64_t cross = (lo_lo >> 32) + (uint32_t)hi_lo + lo_hi;
+    return hi_hi + (hi_lo >> 32) + (cross >> 32);
+  }
+
+  // quot[k] = g[k] / d and rem[k] = g[k] % d for k in [0, n)
+  void divide_block(const int64_t* g, int64_t n, int64_t* quot, int64_t* rem) const {
+    const uint64_t d = d_;
+    const int s = shift_;
+    if (magic_ == 0) {
+      const uint64_t mask = d - 1;
+      for (int64_t k = 0; k < n; k++) {
+        quot[k] = (int64_t)((uint64_t)g[k] >> s);
+        rem[k] = (int64_t)((uint64_t)g[k] & mask);
+      }
+    } else {
+      const uint64_t m = magic_;
+      for (int64_t k = 0; k < n; k++) {
+        uint64_t q = mulhi_halves(m, (uint64_t)g[k]) >> s;
+        quot[k] = (int64_t)q;
+        rem[k] = (int64_t)((uint64_t)g[k] - q * d);
+      }
+    }
+  }
+};
+
+#endif
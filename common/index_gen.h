@@ -0,0 +1,243 @@
+/*! \file index_gen.h
+ * \brief Counter-based request indices: the same global index set for any PE count.
+ *
+ * Request g (numbered globally, 0 <= g < total) gets an index that depends
+ * only on g, the seed and the pattern. It never depends on which PE or
+ * thread generates it. Runs with the same total requests and table size
+ * therefore gather the same indices at every PE count, and each PE can
+ * generate its own block of requests with any number of threads.
+ *
+ * Patterns, given to IndexGen::parse() as a string:
+ *   uniform         every table entry equally likely (the default)
+ *   zipf:s          Zipf(s) ranks, scattered over the table by a
+ *                   multiplicative hash
+ *   hotspot:f:p     with probability p an entry in the first fraction f of
+ *                   the table, otherwise uniform
+ *   local:p:w       with probability p an entry within w of request g's
+ *                   home position g*table/total, otherwise uniform
+ *   chapel          Chapel's fillRandom(Rindex, seed) followed by
+ *                   mod(Rindex, tableSize)
+ *
+ * Every pattern except chapel draws from Philox4x32-10 (Salmon et al., SC11)
+ * with counter (g, draw) and the seed as the key. The chapel pattern follows
+ * the layout of Chapel's PCG random stream for 64-bit ints: two
+ * pcg32 (setseq, xsh-rr) generators with increments 3 and 5 (pcg_getvalid_inc
+ * of 1 and 2). Their outputs are concatenated, the high word first, and
+ * position g is reached by jump-ahead. Check it against a dump from the
+ * Chapel version in use before relying on it.
+ */
+#ifndef INDEX_GEN_H
+#define INDEX_GEN_H
+
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*! \brief Philox4x32-10: four 32-bit outputs for a 128-bit counter and a 64-bit key. */
+static inline void philox4x32(uint32_t ctr[4], uint32_t k0, uint32_t k1) {
+  for (int r = 0; r < 10; r++) {
+    uint64_t p0 = (uint64_t)0xD2511F53u * ctr[0];
+    uint64_t p1 = (uint64_t)0xCD9E8D57u * ctr[2];
+    uint32_t c0 = (uint32_t)(p1 >> 32) ^ ctr[1] ^ k0;
+    uint32_t c2 = (uint32_t)(p0 >> 32) ^ ctr[3] ^ k1;
+    ctr[1] = (uint32_t)p1;
+    ctr[3] = (uint32_t)p0;
+    ctr[0] = c0;
+    ctr[2] = c2;
+    k0 += 0x9E3779B9u;
+    k1 += 0xBB67AE85u;
+  }
+}
+
+/*! \brief A 64-bit random number for draw j of request g. */
+static inline uint64_t ctr_u64(uint64_t seed, uint64_t g, uint32_t j) {
+  uint32_t c[4] = { (uint32_t)g, (uint32_t)(g >> 32), j, 0x1d9a0f6bu };
+  philox4x32(c, (uint32_t)seed, (uint32_t)(seed >> 32));
+  return ((uint64_t)c[0] << 32) | c[1];
+}
+
+/*! \brief uniform in [0, 1) from draw j of request g */
+static inline double ctr_uniform(uint64_t seed, uint64_t g, uint32_t j) {
+  return (ctr_u64(seed, g, j) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/*! \brief uniform in [0, n) without a divide */
+static inline int64_t ctr_below(uint64_t r, int64_t n) {
+  return (int64_t)(((unsigned __int128)r * (uint64_t)n) >> 64);
+}
+
+/*!
+ * \brief Zipf(s) ranks in [1, n] by rejection-inversion (Hormann and Derflinger),
+ * constant time per sample without a table of n probabilities.
+ */
+class ZipfSampler {
+ public:
+  ZipfSampler(int64_t n, double s) : n_(n), s_(s) {
+    h_x1_ = H(1.5) - 1.0;
+    h_n_ = H((double)n + 0.5);
+    sv_ = 2.0 - Hinv(H(2.5) - h(2.0));
+  }
+
+  /* uniform() returns a fresh uniform in [0,1) on every call */
+  template <typename Uniform>
+  int64_t sample(Uniform uniform) const {
+    for (;;) {
+      double u = h_n_ + uniform() * (h_x1_ - h_n_);
+      double x = Hinv(u);
+      int64_t k = (int64_t)(x + 0.5);
+      if (k < 1) k = 1;
+      else if (k > n_) k = n_;
+      if ((double)k - x <= sv_ || u >= H((double)k + 0.5) - h((double)k))
+        return k;
+    }
+  }
+
+ private:
+  double h(double x) const { return exp(-s_ * log(x)); }
+  double H(double x) const { double lx = log(x); return helper2((1.0 - s_) * lx) * lx; }
+  double Hinv(double x) const {
+    double t = x * (1.0 - s_);
+    if (t < -1.0) t = -1.0;
+    return exp(helper1(t) * x);
+  }
+  static double helper1(double x) { return fabs(x) > 1e-8 ? log1p(x) / x : 1.0 - x * (0.5 - x * (1.0/3.0 - 0.25 * x)); }
+  static double helper2(double x) { return fabs(x) > 1e-8 ? expm1(x) / x : 1.0 + x * 0.5 * (1.0 + x / 3.0 * (1.0 + 0.25 * x)); }
+
+  int64_t n_;
+  double s_;
+  double h_x1_, h_n_, sv_;
+};
+
+/*! \brief One pcg32 (setseq, xsh-rr) generator, with jump-ahead. */
+struct Pcg32 {
+  static const uint64_t MULT = 6364136223846793005ULL;
+  uint64_t state, inc;
+
+  Pcg32(uint64_t seed, uint64_t initseq) : state(0), inc((initseq << 1) | 1) {
+    next();
+    state += seed;
+    next();
+  }
+
+  uint32_t next() {
+    uint64_t old = state;
+    state = old * MULT + inc;
+    uint32_t xorshifted = (uint32_t)(((old >> 18) ^ old) >> 27);
+    uint32_t rot = (uint32_t)(old >> 59);
+    return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+  }
+
+  /* skip delta outputs in O(log delta) (Brown, "Random number generation with arbitrary strides") */
+  void advance(uint64_t delta) {
+    uint64_t cur_mult = MULT, cur_plus = inc, acc_mult = 1, acc_plus = 0;
+    while (delta > 0) {
+      if (delta & 1) {
+        acc_mult *= cur_mult;
+        acc_plus = acc_plus * cur_mult + cur_plus;
+      }
+      cur_plus = (cur_mult + 1) * cur_plus;
+      cur_mult *= cur_mult;
+      delta >>= 1;
+    }
+    state = acc_mult * state + acc_plus;
+  }
+};
+
+/*! \brief The request index pattern. */
+class IndexGen {
+ public:
+  enum Kind { UNIFORM, ZIPF, HOTSPOT, LOCAL, CHAPEL };
+
+  IndexGen() : kind_(UNIFORM), seed_(208), a_(0.0), b_(0.0) {}
+
+  /*! \brief Parse a pattern string, see the file comment. \return false if it is not one */
+  bool parse(const std::string &spec, uint64_t seed) {
+    seed_ = seed;
+    std::vector<double> arg;
+    std::string name = spec.substr(0, spec.find(':'));
+    for (size_t p = spec.find(':'); p != std::string::npos; p = spec.find(':', p + 1))
+      arg.push_back(atof(spec.c_str() + p + 1));
+    if (name == "uniform" && arg.size() == 0) kind_ = UNIFORM;
+    else if (name == "zipf" && arg.size() == 1 && arg[0] > 0.0) kind_ = ZIPF;
+    else if (name == "hotspot" && arg.size() == 2) kind_ = HOTSPOT;
+    else if (name == "local" && arg.size() == 2) kind_ = LOCAL;
+    else if (name == "chapel" && arg.size() == 0) kind_ = CHAPEL;
+    else return false;
+    a_ = arg.size() > 0 ? arg[0] : 0.0;
+    b_ = arg.size() > 1 ? arg[1] : 0.0;
+    spec_ = spec;
+    return true;
+  }
+
+  const char* name() const { return spec_.empty() ? "uniform" : spec_.c_str(); }
+
+  /*!
+   * \brief Fill out[k] with the table index of global request first+k.
+   * \param first,count the block of global request numbers to generate
+   * \param total the number of requests over all PEs
+   * \param tab_siz the global table size
+   * \param threads how many threads to split the block over
+   */
+  void generate(int64_t *out, int64_t first, int64_t count, int64_t total,
+                int64_t tab_siz, int threads) const {
+    if (threads < 1) threads = 1;
+    std::vector<std::thread> pool;
+    int64_t slice = (count + threads - 1) / threads;
+    for (int t = 1; t < threads; t++) {
+      int64_t lo = t * slice, hi = lo + slice < count ? lo + slice : count;
+      if (lo >= hi) break;
+      pool.push_back(std::thread([this, out, first, lo, hi, total, tab_siz]() {
+        fill(out + lo, first + lo, hi - lo, total, tab_siz);
+      }));
+    }
+    fill(out, first, slice < count ? slice : count, total, tab_siz);
+    for (size_t t = 0; t < pool.size(); t++)
+      pool[t].join();
+  }
+
+ private:
+  void fill(int64_t *out, int64_t first, int64_t count, int64_t total, int64_t tab_siz) const {
+    if (kind_ == CHAPEL) {
+      Pcg32 hi(seed_, 1), lo(seed_, 2);
+      hi.advance(first);
+      lo.advance(first);
+      for (int64_t k = 0; k < count; k++) {
+        uint64_t u = ((uint64_t)hi.next() << 32) | lo.next();
+        int64_t r = (int64_t)u % tab_siz;   // Chapel's mod takes the divisor's sign
+        out[k] = r < 0 ? r + tab_siz : r;
+      }
+      return;
+    }
+    ZipfSampler zipf(tab_siz, kind_ == ZIPF ? a_ : 1.0);
+    for (int64_t k = 0; k < count; k++) {
+      uint64_t g = first + k;
+      uint64_t r = ctr_u64(seed_, g, 0);
+      int64_t indx = ctr_below(r, tab_siz);
+      if (kind_ == ZIPF) {
+        uint32_t j = 1;
+        uint64_t seed = seed_;
+        int64_t rank = zipf.sample([&]() { return ctr_uniform(seed, g, j++); });
+        indx = (int64_t)(((uint64_t)(rank - 1) * 2654435761ULL) % (uint64_t)tab_siz);
+      } else if (kind_ == HOTSPOT && ctr_uniform(seed_, g, 1) < b_) {
+        int64_t hot = (int64_t)(a_ * tab_siz);
+        indx = ctr_below(r, hot > 0 ? hot : 1);
+      } else if (kind_ == LOCAL && ctr_uniform(seed_, g, 1) < a_) {
+        int64_t w = (int64_t)b_;
+        int64_t home = (int64_t)((double)g / total * tab_siz);
+        indx = home - w + ctr_below(r, 2 * w + 1);
+        indx = ((indx % tab_siz) + tab_siz) % tab_siz;
+      }
+      out[k] = indx;
+    }
+  }
+
+  Kind kind_;
+  uint64_t seed_;
+  double a_, b_;
+  std::string spec_;
+};
+
+#endif
@@ -0,0 +1,304 @@
+/*! \file mem_account.h
+ * \brief Accounting of symmetric heap and private memory, per PE and per phase.
+ *
+ * The mem_* calls wrap shmem_malloc, shmem_calloc, lgp_all_alloc,
+ * convey_new and calloc, and their frees. Each allocation carries a tag, for example
+ * "A" or "ltable", and a scaling class. The class says how its size per PE
+ * changes with the problem:
+ *   MEM_FIXED    the same on every PE whatever P and n (count arrays)
+ *   MEM_PER_ELT  proportional to n / P (the distributed data)
+ *   MEM_PER_PE   proportional to P (one slot per PE)
+ * Private buffers that live in containers are reported with
+ * mem_private(tag, bytes), which sets that tag's current size.
+ *
+ * A MemPhase scope names a phase. Each phase keeps the peak symmetric and
+ * private bytes reached while it was open:
+ *
+ *     { MemPhase ph("sort");  ... }
+ *
+ * The collective mem_report() prints, on PE 0:
+ * - the largest peak over the PEs, per tag and per phase
+ * - the symmetric heap this run needed
+ * - an estimate of the symmetric heap for another P and n
+ *
+ * Conveyors allocate their buffers inside the library. Their footprint is
+ * a model estimate; see mem_convey_estimate().
+ *
+ * As with convey_prof.h, every PE must create the same tags and phases in
+ * the same order.
+ */
+#ifndef MEM_ACCOUNT_H
+#define MEM_ACCOUNT_H
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <shmem.h>
+extern "C" {
+#include <convey.h>
+#include <libgetput.h>
+}
+#include "convey_prof.h"
+
+enum MemScale { MEM_FIXED = 0, MEM_PER_ELT = 1, MEM_PER_PE = 2, MEM_CONVEYOR = 3 };
+
+/*! \brief Estimated symmetric bytes per PE for one conveyor on npes PEs.
+ * Assumes a two-hop (tensor) conveyor across nodes: one send and one
+ * receive buffer per PE on the node and per node. On a single node this
+ * is one pair per PE. The buffer size comes from MEM_CONVEY_BUFFER
+ * (default 64 KiB). Set it to match the conveyor library's build.
+ */
+static inline int64_t mem_convey_estimate(int64_t npes, int64_t ppn) {
+  static const char *env = getenv("MEM_CONVEY_BUFFER");
+  int64_t buf = env ? atoll(env) : 65536;
+  if (ppn <= 0 || ppn > npes) ppn = npes;
+  int64_t nodes = (npes + ppn - 1) / ppn;
+  int64_t links = nodes > 1 ? ppn + nodes : npes;
+  return 2 * links * buf;
+}
+
+/*! \brief The per PE ledger. */
+class MemAccount {
+ public:
+  struct Tag {
+    std::string name;
+    int scale;
+    bool symmetric;
+    int64_t cur, peak;
+  };
+  struct Phase {
+    std::string name;
+    int64_t sym_peak, priv_peak;
+  };
+
+  /* the calling PE's ledger */
+  static MemAccount& get() {
+    static thread_local MemAccount acct;
+    return acct;
+  }
+
+  int64_t tag(const char *name, int scale, bool symmetric) {
+    for (size_t k = 0; k < tags_.size(); k++)
+      if (tags_[k].name == name && tags_[k].symmetric == symmetric)
+        return (int64_t)k;
+    Tag t = { name, scale, symmetric, 0, 0 };
+    tags_.push_back(t);
+    return (int64_t)tags_.size() - 1;
+  }
+
+  void add(int64_t k, int64_t bytes) {
+    Tag &t = tags_[k];
+    t.cur += bytes;
+    if (t.cur > t.peak) t.peak = t.cur;
+    int64_t &total = t.symmetric ? sym_ : priv_;
+    total += bytes;
+    if (t.symmetric && sym_ > sym_peak_) sym_peak_ = sym_;
+    if (!t.symmetric && priv_ > priv_peak_) priv_peak_ = priv_;
+    if (cur_ >= 0) {
+      Phase &ph = phases_[cur_];
+      if (sym_ > ph.sym_peak) ph.sym_peak = sym_;
+      if (priv_ > ph.priv_peak) ph.priv_peak = priv_;
+    }
+  }
+
+  /* remember which tag and size each pointer was allocated with */
+  void track(const void *ptr, int64_t k, int64_t bytes) {
+    if (ptr == NULL) return;
+    live_.push_back(Live{ ptr, k, bytes });
+    add(k, bytes);
+  }
+  void untrack(const void *ptr) {
+    for (size_t i = live_.size(); i-- > 0; )
+      if (live_[i].ptr == ptr) {
+        add(live_[i].tag, -live_[i].bytes);
+        live_[i] = live_.back();
+        live_.pop_back();
+        return;
+      }
+  }
+
+  int64_t enter(const char *name) {
+    int64_t prev = cur_;
+    for (cur_ = 0; cur_ < (int64_t)phases_.size(); cur_++)
+      if (phases_[cur_].name == name)
+        break;
+    if (cur_ == (int64_t)phases_.size()) {
+      Phase ph = { name, 0, 0 };
+      phases_.push_back(ph);
+    }
+    // what is already live counts towards the phase
+    if (sym_ > phases_[cur_].sym_peak) phases_[cur_].sym_peak = sym_;
+    if (priv_ > phases_[cur_].priv_peak) phases_[cur_].priv_peak = priv_;
+    return prev;
+  }
+  void leave(int64_t prev) { cur_ = prev; }
+
+  std::vector<Tag>& tags() { return tags_; }
+  std::vector<Phase>& phases() { return phases_; }
+  int64_t sym_peak() const { return sym_peak_; }
+  int64_t priv_peak() const { return priv_peak_; }
+
+ private:
+  struct Live {
+    const void *ptr;
+    int64_t tag;
+    int64_t bytes;
+  };
+  std::vector<Tag> tags_;
+  std::vector<Phase> phases_;
+  std::vector<Live> live_;
+  int64_t sym_ = 0, priv_ = 0;
+  int64_t sym_peak_ = 0, priv_peak_ = 0;
+  int64_t cur_ = -1;
+};
+
+/*! \brief Scope that assigns the memory peaks inside it to a named phase. */
+class MemPhase {
+ public:
+  explicit MemPhase(const char *name) : prev_(MemAccount::get().enter(name)) {}
+  ~MemPhase() { MemAccount::get().leave(prev_); }
+ private:
+  int64_t prev_;
+};
+
+static inline void* mem_shmem_malloc(size_t bytes, const char *tag, int scale) {
+  MemAccount &m = MemAccount::get();
+  void *p = shmem_malloc(bytes);
+  m.track(p, m.tag(tag, scale, true), bytes);
+  return p;
+}
+
+static inline void* mem_shmem_calloc(size_t count, size_t size, const char *tag, int scale) {
+  MemAccount &m = MemAccount::get();
+  void *p = shmem_calloc(count, size);
+  m.track(p, m.tag(tag, scale, true), count * size);
+  return p;
+}
+
+static inline void mem_shmem_free(void *ptr) {
+  MemAccount::get().untrack(ptr);
+  shmem_free(ptr);
+}
+
+static inline void* mem_calloc(size_t count, size_t size, const char *tag, int scale) {
+  MemAccount &m = MemAccount::get();
+  void *p = calloc(count, size);
+  m.track(p, m.tag(tag, scale, false), count * size);
+  return p;
+}
+
+static inline void mem_free(void *ptr) {
+  MemAccount::get().untrack(ptr);
+  free(ptr);
+}
+
+/*! \brief lgp_all_alloc(num, size) spreads num elements over the PEs; each holds its share. */
+static inline void* mem_lgp_all_alloc(int64_t num, size_t size, const char *tag, int scale) {
+  MemAccount &m = MemAccount::get();
+  void *p = lgp_all_alloc(num, size);
+  int64_t npes = shmem_n_pes();
+  m.track(p, m.tag(tag, scale, true), (num + npes - 1) / npes * (int64_t)size);
+  return p;
+}
+
+static inline void mem_lgp_all_free(void *ptr) {
+  MemAccount::get().untrack(ptr);
+  lgp_all_free(ptr);
+}
+
+static inline convey_t* mem_convey_new(size_t max_bytes, size_t n_local, const convey_alc8r_t *alloc,
+                                       uint64_t options, const char *tag) {
+  MemAccount &m = MemAccount::get();
+  convey_t *c = convey_new(max_bytes, n_local, alloc, options);
+  // a conveyor given max_bytes keeps its buffers within it
+  int64_t bytes = mem_convey_estimate(shmem_n_pes(), shmem_team_n_pes(SHMEM_TEAM_SHARED));
+  m.track(c, m.tag(tag, MEM_CONVEYOR, true), max_bytes < (size_t)bytes ? (int64_t)max_bytes : bytes);
+  return c;
+}
+
+static inline int mem_convey_free(convey_t *c) {
+  MemAccount::get().untrack(c);
+  return cprof_free(c);
+}
+
+/*! \brief Set the current private bytes held under tag, e.g. a staging vector's capacity. */
+static inline void mem_private(const char *tag, int64_t bytes, int scale = MEM_PER_ELT) {
+  MemAccount &m = MemAccount::get();
+  int64_t k = m.tag(tag, scale, false);
+  m.add(k, bytes - m.tags()[k].cur);
+}
+
+/*!
+ * \brief Collective: print the largest per PE peaks, by tag and by phase, on PE 0.
+ * Also print the symmetric heap this run needed and an estimate for
+ * target_npes PEs sorting or gathering target_n elements in total.
+ * \param out where PE 0 prints, NULL for none
+ * \param n the total problem size of this run
+ * \param target_npes,target_n the configuration to estimate for, or 0 for this one
+ */
+static inline void mem_report(FILE *out, int64_t n, int64_t target_npes, int64_t target_n) {
+  MemAccount &m = MemAccount::get();
+  std::vector<MemAccount::Tag> &tags = m.tags();
+  std::vector<MemAccount::Phase> &phases = m.phases();
+  int64_t npes = shmem_n_pes();
+  int64_t ppn = shmem_team_n_pes(SHMEM_TEAM_SHARED);
+  int64_t nt = (int64_t)tags.size(), nph = (int64_t)phases.size();
+  int64_t len = nt + 2 * nph + 2;
+
+  int64_t *peaks = (int64_t*)shmem_malloc(2 * len * sizeof(int64_t));
+  int64_t *maxes = peaks + len;
+  for (int64_t k = 0; k < nt; k++)
+    peaks[k] = tags[k].peak;
+  for (int64_t p = 0; p < nph; p++) {
+    peaks[nt + 2*p] = phases[p].sym_peak;
+    peaks[nt + 2*p + 1] = phases[p].priv_peak;
+  }
+  peaks[len - 2] = m.sym_peak();
+  peaks[len - 1] = m.priv_peak();
+  shmem_barrier_all();
+  shmem_int64_max_reduce(SHMEM_TEAM_WORLD, maxes, peaks, len);
+
+  if (shmem_my_pe() == 0 && out != NULL) {
+    static const char *scales[] = { "fixed", "n/P", "P", "conveyor" };
+    if (target_npes <= 0) target_npes = npes;
+    if (target_n <= 0) target_n = n;
+    double elt_ratio = (n > 0) ? ((double)target_n / target_npes) / ((double)n / npes) : 1.0;
+    double pe_ratio = (double)target_npes / npes;
+    double est = 0.0;
+
+    fprintf(out, "%-16s %4s %9s %14s\n", "memory tag", "heap", "scales", "peak MB max");
+    for (int64_t k = 0; k < nt; k++) {
+      fprintf(out, "%-16s %4s %9s %14.3lf\n", tags[k].name.c_str(), tags[k].symmetric ? "sym" : "priv",
+              scales[tags[k].scale], maxes[k] * 1.0e-6);
+      if (!tags[k].symmetric)
+        continue;
+      switch (tags[k].scale) {
+        case MEM_PER_ELT:  est += maxes[k] * elt_ratio; break;
+        case MEM_PER_PE:   est += maxes[k] * pe_ratio; break;
+        case MEM_CONVEYOR: est += maxes[k] * (double)mem_convey_estimate(target_npes, ppn)
+                                    / (double)mem_convey_estimate(npes, ppn); break;
+        default:           est += maxes[k]; break;
+      }
+    }
+    if (nph > 0)
+      fprintf(out, "%-16s %14s %14s\n", "memory phase", "sym MB max", "priv MB max");
+    for (int64_t p = 0; p < nph; p++)
+      fprintf(out, "%-16s %14.3lf %14.3lf\n", phases[p].name.c_str(),
+              maxes[nt + 2*p] * 1.0e-6, maxes[nt + 2*p + 1] * 1.0e-6);
+    fprintf(out, "symmetric heap peak per PE: %.3lf MB, private %.3lf MB (conveyors estimated)\n",
+            maxes[len - 2] * 1.0e-6, maxes[len - 1] * 1.0e-6);
+    // the tags need not all peak at once, so summing their peaks errs on the safe side
+    fprintf(out, "estimated SHMEM_SYMMETRIC_SIZE for P=%ld n=%ld: %ldM (10%% headroom)\n",
+            target_npes, target_n, (int64_t)ceil(est * 1.1 / (1 << 20)));
+  }
+
+  shmem_barrier_all();
+  shmem_free(peaks);
+}
+
+#endif
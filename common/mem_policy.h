@@ -0,0 +1,342 @@
+/*! \file mem_policy.h
+ * \brief Page size, NUMA placement and first touch for the big arrays.
+ *
+ * The random scatters of the sort and the random table reads of index
+ * gather touch a new page on almost every access. With 4 KiB pages most
+ * of those accesses miss the TLB. The policy is set once per PE from the
+ * command line:
+ *   pages  default     whatever the allocator gives
+ *          thp         madvise(MADV_HUGEPAGE): 2 MiB transparent huge pages
+ *          2m, 1g      private arrays come from hugetlbfs (MAP_HUGETLB).
+ *                      Symmetric arrays fall back to thp; the SHMEM
+ *                      library's own huge page setting decides their pages.
+ *   numa   none        no binding
+ *          local       bind to the NUMA node of the CPU the PE runs on
+ *          interleave  interleave over all online nodes
+ *          <n>         bind to node n
+ *   touch  threads that zero the array right after allocation, so the
+ *          pages are faulted in parallel, under the policy, by CPUs of
+ *          this PE
+ *
+ * mem_place() applies the policy to memory that already exists, e.g. the
+ * local part of a shmem_malloc'd array, before it is first written.
+ * mem_policy_calloc() allocates a private array under the policy and
+ * charges it to the mem_account.h ledger.
+ *
+ * TlbCounter counts data TLB misses (PAPI_TLB_DM) with -DUSE_PAPI, and
+ * EventCounter a list of PAPI events by name. Without PAPI the counts
+ * are -1.
+ */
+#ifndef MEM_POLICY_H
+#define MEM_POLICY_H
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifdef USE_PAPI
+#include <papi.h>
+#endif
+
+#include "mem_account.h"
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+
+/* from linux/mempolicy.h, to avoid a libnuma dependency */
+#define MEM_MPOL_BIND 2
+#define MEM_MPOL_INTERLEAVE 3
+#define MEM_MPOL_MF_MOVE (1 << 1)
+
+enum MemPages { MEM_PAGES_DEFAULT = 0, MEM_PAGES_THP, MEM_PAGES_2M, MEM_PAGES_1G };
+enum MemNuma { MEM_NUMA_NONE = -1, MEM_NUMA_LOCAL = -2, MEM_NUMA_INTERLEAVE = -3 };
+
+struct mem_policy_t {
+  int pages = MEM_PAGES_DEFAULT;
+  int numa = MEM_NUMA_NONE;        /*!< a MemNuma value or a node number */
+  int touch_threads = 1;
+};
+
+/* the calling PE's policy */
+static inline mem_policy_t& mem_policy() {
+  static thread_local mem_policy_t pol;
+  return pol;
+}
+
+/*! \brief Set the policy from option strings; NULL keeps a setting. \return 0, or -1 on a bad value */
+static inline int mem_policy_set(const char *pages, const char *numa, int touch_threads) {
+  mem_policy_t &pol = mem_policy();
+  if (pages != NULL) {
+    std::string p = pages;
+    if (p == "default") pol.pages = MEM_PAGES_DEFAULT;
+    else if (p == "thp") pol.pages = MEM_PAGES_THP;
+    else if (p == "2m") pol.pages = MEM_PAGES_2M;
+    else if (p == "1g") pol.pages = MEM_PAGES_1G;
+    else return -1;
+  }
+  if (numa != NULL) {
+    std::string n = numa;
+    if (n == "none") pol.numa = MEM_NUMA_NONE;
+    else if (n == "local") pol.numa = MEM_NUMA_LOCAL;
+    else if (n == "interleave") pol.numa = MEM_NUMA_INTERLEAVE;
+    else if (!n.empty() && n.find_first_not_of("0123456789") == std::string::npos) pol.numa = atoi(numa);
+    else return -1;
+  }
+  if (touch_threads > 0)
+    pol.touch_threads = touch_threads;
+  return 0;
+}
+
+static inline const char* mem_policy_name() {
+  static const char *names[] = { "default", "thp", "2m", "1g" };
+  return names[mem_policy().pages];
+}
+
+/* the nodemask for the current numa setting; false when there is nothing to bind */
+static inline bool mem_numa_mask(int numa, unsigned long *mask, int *mode) {
+  *mask = 0;
+  *mode = MEM_MPOL_BIND;
+  if (numa == MEM_NUMA_NONE)
+    return false;
+  if (numa == MEM_NUMA_LOCAL) {
+    unsigned cpu = 0, node = 0;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0)
+      return false;
+    numa = (int)node;
+  }
+  if (numa == MEM_NUMA_INTERLEAVE) {
+    *mode = MEM_MPOL_INTERLEAVE;
+    for (int k = 0; k < (int)(8 * sizeof(*mask)); k++) {
+      std::string dir = "/sys/devices/system/node/node" + std::to_string(k);
+      if (access(dir.c_str(), F_OK) == 0)
+        *mask |= 1UL << k;
+    }
+    return *mask != 0;
+  }
+  if (numa < 0 || numa >= (int)(8 * sizeof(*mask)))
+    return false;
+  *mask = 1UL << numa;
+  return true;
+}
+
+/* zero [ptr, ptr+bytes) with the policy's threads, one contiguous slice each */
+static inline void mem_first_touch(void *ptr, size_t bytes, int threads) {
+  char *base = (char*)ptr;
+  if (threads <= 1 || bytes < ((size_t)1 << 22)) {
+    memset(base, 0, bytes);
+    return;
+  }
+  std::vector<std::thread> pool;
+  size_t slice = (bytes + threads - 1) / threads;
+  for (int t = 0; t < threads; t++) {
+    size_t lo = t * slice, hi = lo + slice < bytes ? lo + slice : bytes;
+    if (lo >= hi) break;
+    pool.push_back(std::thread([=]() { memset(base + lo, 0, hi - lo); }));
+  }
+  for (size_t t = 0; t < pool.size(); t++)
+    pool[t].join();
+}
+
+/*!
+ * \brief Apply the page and NUMA policy to existing memory, then fault it in.
+ * Only whole pages inside the range are advised and bound. The range is
+ * zeroed when touch_threads is above 1, so call this before filling it.
+ */
+static inline void mem_place(void *ptr, size_t bytes) {
+  mem_policy_t &pol = mem_policy();
+  if (ptr == NULL || bytes == 0)
+    return;
+  const uintptr_t page = sysconf(_SC_PAGESIZE);
+  uintptr_t lo = ((uintptr_t)ptr + page - 1) & ~(page - 1);
+  uintptr_t hi = ((uintptr_t)ptr + bytes) & ~(page - 1);
+  if (hi > lo) {
+    if (pol.pages != MEM_PAGES_DEFAULT)
+      madvise((void*)lo, hi - lo, MADV_HUGEPAGE);
+    unsigned long mask;
+    int mode;
+    if (mem_numa_mask(pol.numa, &mask, &mode))
+      syscall(SYS_mbind, (void*)lo, hi - lo, mode, &mask, 8 * sizeof(mask), MEM_MPOL_MF_MOVE);
+  }
+  if (pol.touch_threads > 1)
+    mem_first_touch(ptr, bytes, pol.touch_threads);
+}
+
+/* sizes of the hugetlbfs mappings, for munmap */
+static inline std::vector<std::pair<void*, size_t> >& mem_huge_maps() {
+  static thread_local std::vector<std::pair<void*, size_t> > maps;
+  return maps;
+}
+
+/*!
+ * \brief calloc under the policy, charged to tag in the memory ledger.
+ * With 2m or 1g pages the array is mapped from hugetlbfs. If no huge
+ * pages are reserved, it falls back to ordinary pages with
+ * madvise(MADV_HUGEPAGE).
+ */
+static inline void* mem_policy_calloc(size_t count, size_t size, const char *tag, int scale) {
+  mem_policy_t &pol = mem_policy();
+  size_t bytes = count * size;
+  if (pol.pages == MEM_PAGES_2M || pol.pages == MEM_PAGES_1G) {
+    size_t huge = (size_t)1 << (pol.pages == MEM_PAGES_2M ? 21 : 30);
+    size_t len = (bytes + huge - 1) & ~(huge - 1);
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB |
+                (pol.pages == MEM_PAGES_2M ? MAP_HUGE_2MB : MAP_HUGE_1GB);
+    void *p = len ? mmap(NULL, len, PROT_READ | PROT_WRITE, flags, -1, 0) : MAP_FAILED;
+    if (p != MAP_FAILED) {
+      mem_huge_maps().push_back(std::make_pair(p, len));
+      MemAccount &m = MemAccount::get();
+      m.track(p, m.tag(tag, scale, false), len);
+      // hugetlbfs pages come zeroed; place and touch them like any other
+      mem_place(p, len);
+      return p;
+    }
+  }
+  void *p = mem_calloc(count, size, tag, scale);
+  mem_place(p, bytes);
+  return p;
+}
+
+static inline void mem_policy_free(void *ptr) {
+  std::vector<std::pair<void*, size_t> > &maps = mem_huge_maps();
+  for (size_t k = 0; k < maps.size(); k++)
+    if (maps[k].first == ptr) {
+      MemAccount::get().untrack(ptr);
+      munmap(ptr, maps[k].second);
+      maps[k] = maps.back();
+      maps.pop_back();
+      return;
+    }
+  mem_free(ptr);
+}
+
+/*! \brief Data TLB misses of the calling thread between start() and stop(). */
+class TlbCounter {
+ public:
+  TlbCounter() : eventset_(-1), ok_(false) {
+#ifdef USE_PAPI
+    eventset_ = PAPI_NULL;
+    if (PAPI_is_initialized() == PAPI_NOT_INITED &&
+        PAPI_library_init(PAPI_VER_CURRENT) != PAPI_VER_CURRENT)
+      return;
+    if (PAPI_create_eventset(&eventset_) != PAPI_OK)
+      return;
+    ok_ = PAPI_add_event(eventset_, PAPI_TLB_DM) == PAPI_OK;
+#endif
+  }
+  ~TlbCounter() {
+#ifdef USE_PAPI
+    if (eventset_ != PAPI_NULL) {
+      PAPI_cleanup_eventset(eventset_);
+      PAPI_destroy_eventset(&eventset_);
+    }
+#endif
+  }
+  bool ok() const { return ok_; }
+  void start() {
+#ifdef USE_PAPI
+    if (ok_ && PAPI_start(eventset_) != PAPI_OK)
+      ok_ = false;
+#endif
+  }
+  /*! \return the misses since start(), or -1 if they can't be counted */
+  int64_t stop() {
+#ifdef USE_PAPI
+    long long v = 0;
+    if (ok_ && PAPI_stop(eventset_, &v) == PAPI_OK)
+      return (int64_t)v;
+#endif
+    return -1;
+  }
+ private:
+  int eventset_;
+  bool ok_;
+};
+
+/*!
+ * \brief Like TlbCounter, for a comma separated list of PAPI events by
+ * name, e.g. "PAPI_TLB_DM,PAPI_L3_TCM". They are counted together, since
+ * a thread can run only one event set on the CPU at a time. Events the
+ * CPU does not have are left out and count -1.
+ */
+class EventCounter {
+ public:
+  explicit EventCounter(const char *events) : eventset_(-1) {
+    std::string list = events ? events : "";
+    for (size_t p = 0; p <= list.size(); ) {
+      size_t q = list.find(',', p);
+      if (q == std::string::npos)
+        q = list.size();
+      if (q > p)
+        names_.push_back(list.substr(p, q - p));
+      p = q + 1;
+    }
+    slot_.assign(names_.size(), -1);
+#ifdef USE_PAPI
+    eventset_ = PAPI_NULL;
+    if (PAPI_is_initialized() == PAPI_NOT_INITED &&
+        PAPI_library_init(PAPI_VER_CURRENT) != PAPI_VER_CURRENT)
+      return;
+    if (PAPI_create_eventset(&eventset_) != PAPI_OK)
+      return;
+    int n = 0;
+    for (size_t k = 0; k < names_.size(); k++)
+      if (PAPI_add_named_event(eventset_, names_[k].c_str()) == PAPI_OK)
+        slot_[k] = n++;
+#endif
+  }
+  ~EventCounter() {
+#ifdef USE_PAPI
+    if (eventset_ != PAPI_NULL) {
+      PAPI_cleanup_eventset(eventset_);
+      PAPI_destroy_eventset(&eventset_);
+    }
+#endif
+  }
+  size_t size() const { return names_.size(); }
+  const char* name(size_t k) const { return names_[k].c_str(); }
+  void start() {
+    running_ = false;
+#ifdef USE_PAPI
+    running_ = eventset_ != PAPI_NULL && PAPI_start(eventset_) == PAPI_OK;
+#endif
+  }
+  /*! \brief counts[k] is event k since start(), or -1 if it can't be counted */
+  void stop(int64_t *counts) {
+    if (names_.empty())
+      return;
+    std::vector<long long> v(names_.size(), 0);
+    bool ok = false;
+#ifdef USE_PAPI
+    ok = running_ && PAPI_stop(eventset_, v.data()) == PAPI_OK;
+#endif
+    running_ = false;
+    for (size_t k = 0; k < names_.size(); k++) {
+      int64_t c = -1;
+      if (ok && slot_[k] >= 0)
+        c = (int64_t)v[slot_[k]];
+      counts[k] = c;
+    }
+  }
+ private:
+  int eventset_;
+  bool running_ = false;
+  std::vector<std::string> names_;
+  std::vector<int> slot_;   // position in the event set, -1 if not added
+};
+
+#endif
@@ -0,0 +1,166 @@
+/*! \file stream_store.h
+ * \brief Stores that skip the read for ownership when a run fills a cache line.
+ *
+ * A receive loop such as GB[idx] = value writes each element once and
+ * does not read it again in the pass. An ordinary store still reads the
+ * target line into the cache first, so the loop moves each line over the
+ * memory bus twice. StreamWriter collects elements in a direct-mapped
+ * table of line-sized buffers, one line per buffer. Many runs of
+ * consecutive indices can be open at once, such as the bucket runs of
+ * a radix sort pass. When a run has filled a whole line, its buffer
+ * goes out with non-temporal stores, which write the line without
+ * reading it. An element for another line that maps to the same buffer
+ * first writes the partial buffer out with ordinary stores. Scattered
+ * indices therefore cost one extra copy and no more.
+ *
+ * finish() writes out the last line and fences the non-temporal stores.
+ * Call it before any other PE or thread reads the array, e.g. before the
+ * barrier that ends the pass. Without SSE2, or when the array is not
+ * aligned to the element size, every store is an ordinary one.
+ *
+ * stream_stats() counts, per PE, the elements that went out either way.
+ */
+#ifndef STREAM_STORE_H
+#define STREAM_STORE_H
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#define STREAM_STORE_OK 1
+#else
+#define STREAM_STORE_OK 0
+#endif
+
+/*! \brief Elements stored by every StreamWriter of the calling PE. */
+struct StreamStats {
+  int64_t streamed = 0;   /*!< in full lines, with non-temporal stores */
+  int64_t plain = 0;      /*!< with ordinary stores */
+};
+
+/* the calling PE's counts */
+static inline StreamStats& stream_stats() {
+  static thread_local StreamStats st;
+  return st;
+}
+
+template<typename T>
+class StreamWriter {
+  static_assert(sizeof(T) % 16 == 0 && 64 % sizeof(T) == 0,
+                "StreamWriter needs 16, 32 or 64 byte elements");
+  static const int PER_LINE = 64 / sizeof(T);
+  static const unsigned FULL = (1u << PER_LINE) - 1;
+
+ public:
+  /*!
+   * \param lines the number of line buffers, rounded up to a power of two;
+   * a line maps to one of them by a hash of its address
+   * \param stream false makes every store an ordinary one
+   */
+  StreamWriter(T *base, int64_t lines, bool stream = true)
+    : base_(base), lines_(1), shift_(64), data_(NULL), streamed_(0), plain_(0) {
+    stream_ = stream && STREAM_STORE_OK && (uintptr_t)base % sizeof(T) == 0;
+    while (lines_ < lines) {
+      lines_ *= 2;
+      shift_--;
+    }
+    if (stream_) {
+      data_ = (unsigned char*)aligned_alloc(64, lines_ * 64);
+      stream_ = data_ != NULL;
+      tag_.assign(lines_, 0);
+      mask_.assign(lines_, 0);
+    }
+  }
+
+  ~StreamWriter() {
+    finish();
+    free(data_);
+  }
+
+  StreamWriter(const StreamWriter&) = delete;
+  StreamWriter& operator=(const StreamWriter&) = delete;
+
+  /*! \brief base[idx] = v, now or when its line is written out */
+  void put(int64_t idx, const T &v) {
+    if (!stream_) {
+      base_[idx] = v;
+      plain_++;
+      return;
+    }
+    uintptr_t a = (uintptr_t)(base_ + idx);
+    uintptr_t line = a & ~(uintptr_t)63;
+    // runs that advance in step are often a power of two of lines apart,
+    // so the buffer comes from a multiplicative hash, not the low bits
+    int64_t k = shift_ == 64 ? 0 : (int64_t)(((uint64_t)(line >> 6) * 0x9e3779b97f4a7c15ull) >> shift_);
+    if (tag_[k] != line) {
+      spill(k);
+      tag_[k] = line;
+    }
+    int slot = (int)((a & 63) / sizeof(T));
+    memcpy(data_ + k * 64 + slot * sizeof(T), &v, sizeof(T));
+    mask_[k] |= 1u << slot;
+    if (mask_[k] == FULL) {
+      stream_line(k);
+      mask_[k] = 0;
+      tag_[k] = 0;
+      streamed_ += PER_LINE;
+    }
+  }
+
+  /*! \brief Write out the buffered elements and fence; put() may follow. */
+  void finish() {
+    for (int64_t k = 0; stream_ && k < lines_; k++)
+      spill(k);
+#if STREAM_STORE_OK
+    if (streamed_ > 0)
+      _mm_sfence();
+#endif
+    StreamStats &st = stream_stats();
+    st.streamed += streamed_;
+    st.plain += plain_;
+    streamed_ = plain_ = 0;
+  }
+
+ private:
+  /* the filled slots of a line buffer, with ordinary stores */
+  void spill(int64_t k) {
+    for (int s = 0; mask_[k] != 0 && s < PER_LINE; s++)
+      if (mask_[k] & (1u << s)) {
+        memcpy((char*)tag_[k] + s * sizeof(T), data_ + k * 64 + s * sizeof(T), sizeof(T));
+        plain_++;
+      }
+    mask_[k] = 0;
+  }
+
+  void stream_line(int64_t k) {
+    const unsigned char *buf = data_ + k * 64;
+    void *line = (void*)tag_[k];
+#if defined(__AVX512F__)
+    _mm512_stream_si512((__m512i*)line, _mm512_load_si512((const void*)buf));
+#elif defined(__AVX__)
+    _mm256_stream_si256((__m256i*)line, _mm256_load_si256((const __m256i*)buf));
+    _mm256_stream_si256((__m256i*)line + 1, _mm256_load_si256((const __m256i*)buf + 1));
+#elif STREAM_STORE_OK
+    for (int q = 0; q < 4; q++)
+      _mm_stream_si128((__m128i*)line + q, _mm_load_si128((const __m128i*)buf + q));
+#else
+    (void)buf;
+    (void)line;
+#endif
+  }
+
+  T *base_;
+  bool stream_;
+  int64_t lines_;
+  int shift_;                     // 64 - log2(lines_)
+  unsigned char *data_;           // lines_ buffers of 64 bytes
+  std::vector<uintptr_t> tag_;    // the line each buffer holds, 0 for none
+  std::vector<unsigned> mask_;    // its filled slots
+  int64_t streamed_;
+  int64_t plain_;
+};
+
+#endif
@@ -11,6 +11,7 @@ NODES=2
 SS=$((1000000*64))
 
 SIZE=$((SS*NODES))
+# size from the "estimated SHMEM_SYMMETRIC_SIZE" line that ig_block -m prints
 export SHMEM_SYMMETRIC_SIZE=4G
 
 cd $SLURM_SUBMIT_DIR
@@ -0,0 +1,132 @@
+// Microbenchmark for the global index -> (rank, locIdx) mapping that
+// DistributedArray does for every element of a shuffle. It times the
+// hardware divide the sort used to do, FastDivider::divide, and the
+// batched FastDivider::divide_block, and checks that all three agree.
+//
+//   g++ -O3 -march=native -std=c++17 -I../common index_map_bench.cpp -o index_map_bench
+//   ./index_map_bench --n 65536 --per-rank 16777216 --per-rank 16777215
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "fast_div.h"
+
+static double now() {
+  auto t = std::chrono::steady_clock::now().time_since_epoch();
+  return std::chrono::duration<double>(t).count();
+}
+
+// keep the compiler from folding the divisor into a constant
+static volatile int64_t opaque;
+
+static bool check(const FastDivider& div, int64_t d) {
+  std::mt19937_64 rng(d);
+  std::vector<int64_t> g;
+  for (int64_t k = 0; k < 4; k++) {
+    g.push_back(k);
+    g.push_back(k*d - 1 < 0 ? 0 : k*d - 1);
+    g.push_back(k*d);
+    g.push_back(k*d + 1);
+  }
+  g.push_back(INT64_MAX);
+  g.push_back(INT64_MAX - d);
+  for (int k = 0; k < 1 << 16; k++)
+    g.push_back(rng() >> 1);
+
+  std::vector<int64_t> q(g.size()), r(g.size());
+  div.divide_block(g.data(), g.size(), q.data(), r.data());
+  for (size_t k = 0; k < g.size(); k++) {
+    int64_t want = g[k] / d;
+    if ((int64_t)div.divide(g[k]) != want || q[k] != want || r[k] != g[k] % d) {
+      std::cerr << "mismatch: " << g[k] << " / " << d << "\n";
+      return false;
+    }
+  }
+  return true;
+}
+
+static void run(int64_t perRank, int64_t n, int64_t numRanks) {
+  opaque = perRank;
+  int64_t d = opaque;
+  FastDivider div(d);
+  if (!check(div, d)) exit(1);
+
+  // the shuffle's access pattern: destinations anywhere in the array
+  std::mt19937_64 rng(perRank);
+  std::vector<int64_t> g(n), rank(n), locIdx(n);
+  for (int64_t i = 0; i < n; i++)
+    g[i] = rng() % (perRank*numRanks);
+
+  // best of several repetitions of each variant
+  const int reps = 5;
+  int64_t sum = 0;
+  double tDiv = 1e30, tFast = 1e30, tBlock = 1e30;
+  for (int rep = 0; rep < reps; rep++) {
+    double t = now();
+    for (int64_t i = 0; i < n; i++) {
+      int64_t r = g[i] / d;
+      rank[i] = r;
+      locIdx[i] = g[i] - r*d;
+    }
+    tDiv = std::min(tDiv, now() - t);
+    sum += rank[n/2] + locIdx[n/3];
+
+    t = now();
+    for (int64_t i = 0; i < n; i++) {
+      int64_t r = div.divide(g[i]);
+      rank[i] = r;
+      locIdx[i] = g[i] - r*d;
+    }
+    tFast = std::min(tFast, now() - t);
+    sum += rank[n/2] + locIdx[n/3];
+
+    t = now();
+    div.divide_block(g.data(), n, rank.data(), locIdx.data());
+    tBlock = std::min(tBlock, now() - t);
+    sum += rank[n/2] + locIdx[n/3];
+  }
+
+  std::cout << std::setw(14) << perRank
+            << (div.is_pow2() ? "  pow2 " : "  magic")
+            << std::fixed << std::setprecision(3)
+            << std::setw(12) << 1e9*tDiv/n
+            << std::setw(12) << 1e9*tFast/n
+            << std::setw(12) << 1e9*tBlock/n
+            << std::setw(10) << std::setprecision(1) << tDiv/tBlock << "x"
+            << "  (" << (sum & 1) << ")\n";
+}
+
+int main(int argc, char *argv[]) {
+  int64_t n = 1 << 16; // small enough to stay in cache
+  int64_t numRanks = 256;
+  std::vector<int64_t> perRank;
+  for (int i = 1; i < argc; i++) {
+    if (std::string(argv[i]) == "--n") {
+      n = std::stoll(argv[++i]);
+    } else if (std::string(argv[i]) == "--ranks") {
+      numRanks = std::stoll(argv[++i]);
+    } else if (std::string(argv[i]) == "--per-rank") {
+      perRank.push_back(std::stoll(argv[++i]));
+    }
+  }
+  if (perRank.empty()) {
+    // 2^30 elements per node at 64 ranks per node, then an uneven split
+    perRank = {16777216, 16777215, 1000003};
+  }
+
+  std::cout << "ns per element over " << n << " random indices, "
+            << numRanks << " ranks\n";
+  std::cout << std::setw(14) << "per rank" << "  kind "
+            << std::setw(12) << "divide" << std::setw(12) << "fast"
+            << std::setw(12) << "block" << std::setw(11) << "speedup" << "\n";
+  for (int64_t p : perRank)
+    run(p, n, numRanks);
+  return 0;
+}
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <array>
 #include <chrono>
 #include <iomanip>
@@ -19,7 +20,15 @@ extern "C" {
 #include <spmat.h>
 }
 
+#ifdef USE_PAPI
 #include <papi.h>
+#endif
+
+#include "bench_harness.h"
+#include "binary_io.h"
+#include "fast_div.h"
+#include "mem_account.h"
+#include "mem_policy.h"
 
 #define RADIX 16
 #define N_DIGITS (64/RADIX)
@@ -81,15 +90,17 @@ struct DistributedArray {
   int64_t numElementsTotal_ = 0;    // number of elements on all ranks
   int64_t numElementsPerRank_ = 0 ; // number per rank
   int64_t numElementsHere_ = 0;     // number this rank
+  FastDivider perRankDiv_;          // divides by numElementsPerRank_
   int myRank_ = 0;
   int numRanks_ = 0;
 
+  // 'scale' says how the per-rank size grows, for the memory accounting
   static DistributedArray<EltType>
-  create(std::string name, int64_t totalNumElements);
+  create(std::string name, int64_t totalNumElements, int scale = MEM_PER_ELT);
 
   ~DistributedArray() {
     if (localPart_ != nullptr) {
-      shmem_free(localPart_);
+      mem_shmem_free(localPart_);
     }
   }
 
@@ -100,12 +111,18 @@ struct DistributedArray {
   // convert a global index into a local index
   inline RankAndLocalIndex globalIdxToLocalIdx(int64_t glbIdx) const {
     RankAndLocalIndex ret;
-    int64_t rank = glbIdx / numElementsPerRank_;
+    int64_t rank = perRankDiv_.divide(glbIdx);
     int64_t locIdx = glbIdx - rank*numElementsPerRank_;
     ret.rank = rank;
     ret.locIdx = locIdx;
     return ret;
   }
+  // convert n global indices at once into separate rank and local
+  // index arrays; the loop vectorizes
+  inline void globalIdxToLocalIdx(const int64_t* glbIdx, int64_t n,
+                                  int64_t* rank, int64_t* locIdx) const {
+    perRankDiv_.divide_block(glbIdx, n, rank, locIdx);
+  }
 
   // accessors
   inline const std::string& name() const { return name_; }
@@ -126,7 +143,8 @@ struct DistributedArray {
 
 template<typename EltType>
 DistributedArray<EltType>
-DistributedArray<EltType>::create(std::string name, int64_t totalNumElements) {
+DistributedArray<EltType>::create(std::string name, int64_t totalNumElements,
+                                  int scale) {
   int myRank = 0;
   int numRanks = 0;
   myRank = shmem_my_pe();
@@ -141,10 +159,13 @@ DistributedArray<EltType>::create(std::string name, int64_t totalNumElements) {
 
   DistributedArray<EltType> ret;
   ret.name_ = std::move(name);
-  ret.localPart_ = (EltType*) shmem_malloc(eltsPerRank * sizeof(EltType));
+  ret.localPart_ = (EltType*) mem_shmem_malloc(eltsPerRank * sizeof(EltType),
+                                               ret.name_.c_str(), scale);
+  mem_place(ret.localPart_, eltsPerRank * sizeof(EltType));
   ret.numElementsTotal_ = totalNumElements;
   ret.numElementsPerRank_ = eltsPerRank;
   ret.numElementsHere_ = eltsHere;
+  ret.perRankDiv_ = FastDivider(eltsPerRank > 0 ? eltsPerRank : 1);
   ret.myRank_ = myRank;
   ret.numRanks_ = numRanks;
 
@@ -240,12 +261,25 @@ inline int getBucket(SortElement x, int d) {
   return (x.key >> (RADIX*d)) & MASK;
 }
 
+// compute bucket i's position in the transposed counts/starts array,
+// [r0d0, r1d0, ...], for every bucket i at once
+static void transposedPositions(const DistributedArray<int64_t>& Global,
+                                std::vector<int64_t>& rank,
+                                std::vector<int64_t>& locIdx) {
+  int64_t myRank = shmem_my_pe();
+  int64_t numRanks = shmem_n_pes();
+  std::vector<int64_t> glbIdx(COUNTS_SIZE);
+  for (int64_t i = 0; i < COUNTS_SIZE; i++) {
+    glbIdx[i] = i*numRanks + myRank;
+  }
+  rank.resize(COUNTS_SIZE);
+  locIdx.resize(COUNTS_SIZE);
+  Global.globalIdxToLocalIdx(glbIdx.data(), COUNTS_SIZE, rank.data(), locIdx.data());
+}
+
 void copyCountsToGlobalCounts(counts_array_t& localCounts,
                               DistributedArray<int64_t>& GlobalCounts) {
-  int myRank = 0;
-  int numRanks = 0;
-  myRank = shmem_my_pe();
-  numRanks = shmem_n_pes();
+  int numRanks = shmem_n_pes();
 
   // Now, each rank has an array of counts, like this
   //  [r0d0, r0d1, ... r0d255]  | on rank 0
@@ -260,19 +294,14 @@ void copyCountsToGlobalCounts(counts_array_t& localCounts,
   //  [r0d2, r1d2, r2d2, ...]   | on rank 1 ...
   //  ...
 
+  std::vector<int64_t> dstRanks, dstLocIdx;
+  transposedPositions(GlobalCounts, dstRanks, dstLocIdx);
+
   for (int64_t i = 0; i < COUNTS_SIZE;) {
     // compute the number of elements that go to a particular destination rank
-    int64_t dstGlobalIdx = i*numRanks + myRank;
-    auto dst = GlobalCounts.globalIdxToLocalIdx(dstGlobalIdx);
-
-    int dstRank = dst.rank;
-    int nToSameRank = 0;
-    while (i+nToSameRank < COUNTS_SIZE) {
-      int64_t ii = (i+nToSameRank)*numRanks + myRank;
-      int nextRank = GlobalCounts.globalIdxToLocalIdx(ii).rank;
-      if (nextRank != dstRank) {
-        break;
-      }
+    int dstRank = dstRanks[i];
+    int nToSameRank = 1;
+    while (i+nToSameRank < COUNTS_SIZE && dstRanks[i+nToSameRank] == dstRank) {
       nToSameRank++;
     }
     assert(nToSameRank >= 1);
@@ -280,12 +309,12 @@ void copyCountsToGlobalCounts(counts_array_t& localCounts,
 
     int64_t* GCA = &GlobalCounts.localPart()[0]; // it's symmetric
 
-    shmem_int64_iput( GCA + dst.locIdx, // dst region on the remote PE
-                      &localCounts[i],  // src region on the local PE
-                      numRanks,         // stride for destination array
-                      1,                // stride for source array
-                      nToSameRank,      // number of elements
-                      dstRank           // destination rank
+    shmem_int64_iput( GCA + dstLocIdx[i], // dst region on the remote PE
+                      &localCounts[i],    // src region on the local PE
+                      numRanks,           // stride for destination array
+                      1,                  // stride for source array
+                      nToSameRank,        // number of elements
+                      dstRank             // destination rank
                     );
 
     i += nToSameRank;
@@ -309,7 +338,8 @@ void exclusiveScan(const DistributedArray<int64_t>& Src,
 
   // allocate a remotely accessible array
   // only rank 0's values will be used
-  int64_t* PerRankStarts = (int64_t*) shmem_malloc(sizeof(int64_t) * numRanks);
+  int64_t* PerRankStarts = (int64_t*) mem_shmem_malloc(sizeof(int64_t) * numRanks,
+                                                        "PerRankStarts", MEM_PER_PE);
 
   // Send the total from each rank to rank 0
   shmem_int64_p(PerRankStarts + myRank, myTotal, 0);
@@ -346,15 +376,12 @@ void exclusiveScan(const DistributedArray<int64_t>& Src,
     }
   }
 
-  shmem_free(PerRankStarts);
+  mem_shmem_free(PerRankStarts);
 }
 
 void copyStartsFromGlobalStarts(DistributedArray<int64_t>& GlobalStarts,
                                 counts_array_t& localStarts) {
-  int myRank = 0;
-  int numRanks = 0;
-  myRank = shmem_my_pe();
-  numRanks = shmem_n_pes();
+  int numRanks = shmem_n_pes();
 
   // starts look like this:
   //  [r0d0, r1d0, r2d0, ...]   | on rank 0
@@ -368,30 +395,26 @@ void copyStartsFromGlobalStarts(DistributedArray<int64_t>& GlobalStarts,
   //  ...
   //
 
+  std::vector<int64_t> srcRanks, srcLocIdx;
+  transposedPositions(GlobalStarts, srcRanks, srcLocIdx);
+
   for (int64_t i = 0; i < COUNTS_SIZE;) {
     // compute the number of elements that come from a particular src rank
-    int64_t srcGlobalIdx = i*numRanks + myRank;
-    auto src = GlobalStarts.globalIdxToLocalIdx(srcGlobalIdx);
-    int srcRank = src.rank;
-    int nToSameRank = 0;
-    while (i+nToSameRank < COUNTS_SIZE) {
-      int64_t ii = (i+nToSameRank)*numRanks + myRank;
-      int nextRank = GlobalStarts.globalIdxToLocalIdx(ii).rank;
-      if (nextRank != srcRank) {
-        break;
-      }
+    int srcRank = srcRanks[i];
+    int nToSameRank = 1;
+    while (i+nToSameRank < COUNTS_SIZE && srcRanks[i+nToSameRank] == srcRank) {
       nToSameRank++;
     }
     assert(nToSameRank >= 1);
 
     int64_t* GSA = GlobalStarts.localPart(); // it's symmetric
 
-    shmem_int64_iget(  &localStarts[i],  // dst region on the local PE
-                       GSA + src.locIdx, // src region on the remote PE
-                       1,                // stride for destination array
-                       numRanks,         // stride for source array
-                       nToSameRank,      // number of elements
-                       srcRank           // source rank
+    shmem_int64_iget(  &localStarts[i],    // dst region on the local PE
+                       GSA + srcLocIdx[i], // src region on the remote PE
+                       1,                  // stride for destination array
+                       numRanks,           // stride for source array
+                       nToSameRank,        // number of elements
+                       srcRank             // source rank
                     );
 
     i += nToSameRank;
@@ -401,10 +424,188 @@ void copyStartsFromGlobalStarts(DistributedArray<int64_t>& GlobalStarts,
   shmem_barrier_all();
 }
 
-// shuffles the data from A into B
+// The two-level shuffle. Direct puts send one message per element, and
+// with P PEs every PE talks to all P. Here every element first moves
+// inside its node to the PE with the same local rank as its destination.
+// That PE sends everything its node has for one destination PE as one
+// message, and the destination places the elements itself:
+//   1. pack by destination local rank, one put to each PE of the node
+//   2. regroup by destination node, one put to each PE of the column,
+//      at an offset reserved with an atomic add on the receiver
+//   3. scatter the received elements into the local part of B
+// A PE then sends at most ppn + nodes messages per shuffle, the same
+// aggregation a 2D conveyor does. shmem_team_split_2d, with ranks placed
+// on nodes in blocks of ppn, gives the node teams of stage 1 and the
+// column teams, one PE of each node, of stage 2.
+struct ShuffleRec {
+  int64_t dstIdx;  // global index in B
+  SortElement elt;
+};
+
+class NodeShuffle {
+ public:
+  // collective; the PEs must fill whole nodes of ppn
+  NodeShuffle(int ppn, int64_t perRank) : ppn_(ppn) {
+    int myRank = shmem_my_pe();
+    assert(shmem_n_pes() % ppn == 0);
+    int ok = shmem_team_split_2d(SHMEM_TEAM_WORLD, ppn, NULL, 0, &nodeTeam_,
+                                 NULL, 0, &columnTeam_);
+    assert(ok == 0);
+    (void)ok;
+    myLocal_ = myRank % ppn;
+    nodeBase_ = myRank - myLocal_;
+    counts_ = (int64_t*) mem_shmem_malloc(sizeof(int64_t) * (ppn + ppn*ppn + 3),
+                                          "node shuffle counts", MEM_PER_PE);
+    nodeCounts_ = counts_ + ppn;
+    cursor_ = nodeCounts_ + ppn*ppn;
+    *cursor_ = 0;
+    inbox_ = (ShuffleRec*) mem_shmem_malloc(sizeof(ShuffleRec) * perRank,
+                                            "node shuffle inbox", MEM_PER_ELT);
+    stagingCap_ = 0;
+    staging_ = nullptr;
+    shmem_barrier_all();
+  }
+
+  ~NodeShuffle() {
+    shmem_barrier_all();
+    if (staging_ != nullptr)
+      mem_shmem_free(staging_);
+    mem_shmem_free(inbox_);
+    mem_shmem_free(counts_);
+    shmem_team_destroy(nodeTeam_);
+    shmem_team_destroy(columnTeam_);
+    mem_private("node shuffle pack", 0);
+  }
+
+  // move A's elements to their places in B; starts[b] is where this
+  // rank's next element of bucket b goes
+  void shuffle(const DistributedArray<SortElement>& A,
+               DistributedArray<SortElement>& B,
+               int digit, counts_array_t& starts) {
+    int64_t locN = A.numElementsHere();
+    const SortElement* localPart = A.localPart();
+
+    // where every element goes, and how many go to each local rank
+    dstIdx_.resize(locN);
+    dstRank_.resize(locN);
+    dstLoc_.resize(locN);
+    for (int64_t i = 0; i < locN; i++)
+      dstIdx_[i] = starts[getBucket(localPart[i], digit)]++;
+    B.globalIdxToLocalIdx(dstIdx_.data(), locN, dstRank_.data(), dstLoc_.data());
+    std::fill(counts_, counts_ + ppn_, 0);
+    for (int64_t i = 0; i < locN; i++)
+      counts_[dstRank_[i] % ppn_]++;
+
+    // nodeCounts_[l*ppn + k]: what local rank l sends to local rank k
+    shmem_fcollectmem(nodeTeam_, nodeCounts_, counts_, ppn_ * sizeof(int64_t));
+    int64_t need = 0;
+    for (int l = 0; l < ppn_; l++)
+      need += nodeCounts_[l*ppn_ + myLocal_];
+    reserveStaging(need);
+
+    // 1. pack by destination local rank and put each part at its offset
+    //    in the staging area of that local rank on this node
+    std::vector<int64_t> first(ppn_ + 1, 0);
+    for (int k = 0; k < ppn_; k++)
+      first[k+1] = first[k] + counts_[k];
+    pack_.resize(std::max(locN, need));
+    mem_private("node shuffle pack", pack_.capacity() * sizeof(ShuffleRec));
+    {
+      std::vector<int64_t> next(first.begin(), first.end() - 1);
+      for (int64_t i = 0; i < locN; i++) {
+        ShuffleRec& r = pack_[next[dstRank_[i] % ppn_]++];
+        r.dstIdx = dstIdx_[i];
+        r.elt = localPart[i];
+      }
+    }
+    for (int k = 0; k < ppn_; k++) {
+      int64_t offset = 0;
+      for (int l = 0; l < myLocal_; l++)
+        offset += nodeCounts_[l*ppn_ + k];
+      if (counts_[k] > 0)
+        shmem_putmem_nbi(staging_ + offset, &pack_[first[k]],
+                         counts_[k] * sizeof(ShuffleRec), nodeBase_ + k);
+    }
+    shmem_quiet();
+    shmem_team_sync(nodeTeam_);
+
+    // 2. regroup what this node has for this local rank by destination
+    //    node, and send one message to each destination PE; node m is
+    //    member m of the column team
+    int nodes = shmem_team_n_pes(columnTeam_);
+    std::vector<int64_t> perNode(nodes + 1, 0);
+    std::vector<int64_t> stagedNode(need);
+    for (int64_t i = 0; i < need; i++) {
+      stagedNode[i] = B.globalIdxToLocalIdx(staging_[i].dstIdx).rank / ppn_;
+      perNode[stagedNode[i] + 1]++;
+    }
+    for (int m = 0; m < nodes; m++)
+      perNode[m+1] += perNode[m];
+    {
+      std::vector<int64_t> next(perNode.begin(), perNode.end() - 1);
+      for (int64_t i = 0; i < need; i++)
+        pack_[next[stagedNode[i]]++] = staging_[i];
+    }
+    int myNode = shmem_team_my_pe(columnTeam_);
+    for (int k = 1; k <= nodes; k++) {
+      int m = (myNode + k) % nodes;  // spread the receivers
+      int64_t cnt = perNode[m+1] - perNode[m];
+      if (cnt == 0)
+        continue;
+      int dst = shmem_team_translate_pe(columnTeam_, m, SHMEM_TEAM_WORLD);
+      int64_t offset = shmem_int64_atomic_fetch_add(cursor_, cnt, dst);
+      shmem_putmem_nbi(inbox_ + offset, &pack_[perNode[m]], cnt * sizeof(ShuffleRec), dst);
+    }
+    shmem_quiet();
+    shmem_barrier_all();
+
+    // 3. place what arrived; every element of this part of B arrives once
+    int myRank = shmem_my_pe();
+    int64_t received = shmem_int64_atomic_fetch(cursor_, myRank);
+    assert(received == B.numElementsHere());
+    SortElement* GB = B.localPart();
+    int64_t base = myRank * B.numElementsPerRank();
+    for (int64_t i = 0; i < received; i++)
+      GB[inbox_[i].dstIdx - base] = inbox_[i].elt;
+    // the next shuffle's reservations come after several barriers
+    shmem_int64_atomic_set(cursor_, 0, myRank);
+  }
+
+ private:
+  // collective: grow the staging area to the largest need of any PE
+  void reserveStaging(int64_t need) {
+    int64_t* in = cursor_ + 1;   // symmetric scratch for the reduction
+    in[0] = need;
+    shmem_int64_max_reduce(SHMEM_TEAM_WORLD, in + 1, in, 1);
+    int64_t most = in[1];
+    if (most <= stagingCap_)
+      return;
+    if (staging_ != nullptr)
+      mem_shmem_free(staging_);
+    stagingCap_ = most + most / 8;
+    staging_ = (ShuffleRec*) mem_shmem_malloc(sizeof(ShuffleRec) * stagingCap_,
+                                              "node shuffle staging", MEM_PER_ELT);
+  }
+
+  int ppn_;
+  int myLocal_;
+  int nodeBase_;
+  shmem_team_t nodeTeam_;
+  shmem_team_t columnTeam_;  // this local rank on every node
+  int64_t* counts_;      // symmetric: ppn counts, ppn*ppn node counts, cursor, scratch
+  int64_t* nodeCounts_;
+  int64_t* cursor_;
+  ShuffleRec* inbox_;    // symmetric, one slot per element of the local part of B
+  ShuffleRec* staging_;  // symmetric, grown as needed
+  int64_t stagingCap_;
+  std::vector<int64_t> dstIdx_, dstRank_, dstLoc_;
+  std::vector<ShuffleRec> pack_;
+};
+
+// shuffles the data from A into B, through 'node' when it is set
 void globalShuffle(DistributedArray<SortElement>& A,
                    DistributedArray<SortElement>& B,
-                   int digit) {
+                   int digit, NodeShuffle* node) {
   int myRank = 0;
   int numRanks = 0;
   myRank = shmem_my_pe();
@@ -440,11 +641,13 @@ void globalShuffle(DistributedArray<SortElement>& A,
 
   // create a distributed array storing the result of this transposition
   auto GlobalCounts = DistributedArray<int64_t>::create("GlobalCounts",
-                                                        COUNTS_SIZE*numRanks);
+                                                        COUNTS_SIZE*numRanks,
+                                                        MEM_FIXED);
   // and one storing the start positions for each task
   // (that will be the result of a scan operation)
   auto GlobalStarts = DistributedArray<int64_t>::create("GlobalStarts",
-                                                        COUNTS_SIZE*numRanks);
+                                                        COUNTS_SIZE*numRanks,
+                                                        MEM_FIXED);
 
   // copy the per-bucket counts to the global counts array
   copyCountsToGlobalCounts(*counts, GlobalCounts);
@@ -455,6 +658,11 @@ void globalShuffle(DistributedArray<SortElement>& A,
   // copy the per-bucket starts from the global counts array
   copyStartsFromGlobalStarts(GlobalStarts, *starts);
 
+  if (node != nullptr) {
+    node->shuffle(A, B, digit, *starts);
+    return;
+  }
+
   // Now go through the data in B assigning each element its final
   // position and sending that data to the other ranks
   // Leave the result in B
@@ -475,7 +683,8 @@ void globalShuffle(DistributedArray<SortElement>& A,
 
 // Sort the data in A, using B as scratch space.
 void mySort(DistributedArray<SortElement>& A,
-            DistributedArray<SortElement>& B) {
+            DistributedArray<SortElement>& B,
+            NodeShuffle* node) {
   int myRank = 0;
   int numRanks = 0;
   myRank = shmem_my_pe();
@@ -483,8 +692,8 @@ void mySort(DistributedArray<SortElement>& A,
 
   assert(N_DIGITS % 2 == 0);
   for (int digit = 0; digit < N_DIGITS; digit += 2) {
-    globalShuffle(A, B, digit);
-    globalShuffle(B, A, digit+1);
+    globalShuffle(A, B, digit, node);
+    globalShuffle(B, A, digit+1, node);
   }
 }
 
@@ -497,6 +706,18 @@ int main(int argc, char *argv[]) {
   bool printSome = false;
   bool verify = true;
   /* END_IGNORE_FOR_LINE_COUNT */
+  int64_t memPes = 0; // estimate the symmetric heap for this many PEs
+  int64_t memN = 0;   // and this problem size; 0 means this run's
+  const char* pages = nullptr;  // page size policy for the arrays
+  const char* numa = nullptr;   // NUMA binding for the arrays
+  int touchThreads = 1;         // threads for the first touch
+  int warmup = 0;               // untimed sorts before the trials
+  int trials = 1;               // timed sorts
+  int pesPerNode = 0;           // for GB/s/node; 0 counts the PEs that share memory
+  const char* jsonFile = nullptr; // benchmark records, see common/bench_harness.h
+  const char* inputFile = nullptr;  // 16-byte (key, val) records to sort instead of random ones
+  const char* outputFile = nullptr; // where to write the sorted records
+  bool nodeShuffle = false;     // aggregate per node, see NodeShuffle
 
   int64_t n = 100*1000*1000;
   for (int i = 1; i < argc; i++) {
@@ -510,6 +731,33 @@ int main(int argc, char *argv[]) {
       verify = true;
     } else if (std::string(argv[i]) == "--no-verify") {
       verify = false;
+    } else if (std::string(argv[i]) == "--mem-pes") {
+      memPes = std::stoll(argv[++i]);
+    } else if (std::string(argv[i]) == "--mem-n") {
+      memN = std::stoll(argv[++i]);
+    } else if (std::string(argv[i]) == "--pages") {
+      pages = argv[++i];
+    } else if (std::string(argv[i]) == "--numa") {
+      numa = argv[++i];
+    } else if (std::string(argv[i]) == "--touch-threads") {
+      touchThreads = std::stoi(argv[++i]);
+    } else if (std::string(argv[i]) == "--warmup") {
+      warmup = std::stoi(argv[++i]);
+    } else if (std::string(argv[i]) == "--trials") {
+      trials = std::stoi(argv[++i]);
+    } else if (std::string(argv[i]) == "--pes-per-node") {
+      pesPerNode = std::stoi(argv[++i]);
+    } else if (std::string(argv[i]) == "--json") {
+      jsonFile = argv[++i];
+    } else if (std::string(argv[i]) == "--input") {
+      inputFile = argv[++i];
+    } else if (std::string(argv[i]) == "--output") {
+      outputFile = argv[++i];
+    } else if (std::string(argv[i]) == "--shuffle") {
+      std::string b = argv[++i];
+      if (b == "node") nodeShuffle = true;
+      else if (b != "direct")
+        std::cerr << "unknown --shuffle " << b << ", using direct\n";
     }
     /* END_IGNORE_FOR_LINE_COUNT */
   }
@@ -519,26 +767,64 @@ int main(int argc, char *argv[]) {
   myRank = shmem_my_pe();
   numRanks = shmem_n_pes();
 
+  if (mem_policy_set(pages, numa, touchThreads) != 0 && myRank == 0)
+    std::cerr << "bad --pages or --numa, keeping the defaults\n";
+  bench_set(warmup, trials, pesPerNode, jsonFile);
+  // the input file decides the problem size
+  if (inputFile != nullptr) {
+    n = bin_records(inputFile, sizeof(SortElement));
+    if (lgp_reduce_min_l(n) < 0) {
+      if (myRank == 0)
+        std::cerr << "cannot read the records of " << inputFile << "\n";
+      return 1;
+    }
+  }
+  if (outputFile != nullptr) {
+    int64_t ok = myRank == 0 ? bin_create(outputFile, sizeof(SortElement), n) : 1;
+    if (lgp_reduce_min_l(ok) == 0)
+      return 1;
+  }
+  int ppn = bench_pes_per_node();
+  if (nodeShuffle && numRanks % ppn != 0) {
+    if (myRank == 0)
+      std::cerr << "--shuffle node needs whole nodes of " << ppn << " PEs, using direct\n";
+    nodeShuffle = false;
+  }
+  bench_param("n", n);
+  bench_param("input", inputFile);
+  bench_param("pages", mem_policy_name());
+  bench_param("numa", numa);
+  bench_param("shuffle", nodeShuffle ? "node" : "direct");
+
   if (myRank == 0) {
     std::cout << "Total number of shmem PEs: " << numRanks << "\n";
     std::cout << "Problem size: " << n << "\n";
+    std::cout << "Pages: " << mem_policy_name()
+              << ", first touch threads: " << mem_policy().touch_threads << "\n";
+    std::cout << "Warmup sorts: " << bench_options().warmup
+              << ", timed trials: " << bench_options().trials << "\n";
+    std::cout << "Shuffle: " << (nodeShuffle ? "node" : "direct")
+              << ", " << ppn << " PEs per node\n";
     flushOutput();
   }
 
   // create distributed arrays A and B
   auto A = DistributedArray<SortElement>::create("A", n);
   auto B = DistributedArray<SortElement>::create("B", n);
-
-  // set the keys to random values and the values to global indices
-  {
-    auto start = std::chrono::steady_clock::now();
-    if (myRank == 0) {
-      std::cout << "Generating random values\n";
-      /* BEGIN_IGNORE_FOR_LINE_COUNT (printing) */
-      flushOutput();
-      /* END_IGNORE_FOR_LINE_COUNT */
+  std::unique_ptr<NodeShuffle> node;
+  if (nodeShuffle)
+    node = std::make_unique<NodeShuffle>(ppn, B.numElementsPerRank());
+
+  // set the keys to random values and the values to global indices,
+  // or read this rank's block of --input; every trial sorts the same input
+  auto generate = [&]() {
+    if (inputFile != nullptr) {
+      if (!bin_read(inputFile, A.localPart(), sizeof(SortElement),
+                    A.localIdxToGlobalIdx(0), A.numElementsHere()))
+        shmem_global_exit(1);
+      shmem_barrier_all();
+      return;
     }
-
     auto rng = pcg64(myRank);
     int64_t locN = A.numElementsHere();
     for (int64_t i = 0; i < locN; i++) {
@@ -548,9 +834,29 @@ int main(int argc, char *argv[]) {
     }
 
     shmem_barrier_all();
+  };
+
+  {
+    auto start = std::chrono::steady_clock::now();
+    if (myRank == 0) {
+      std::cout << (inputFile ? "Reading the input\n" : "Generating random values\n");
+      /* BEGIN_IGNORE_FOR_LINE_COUNT (printing) */
+      flushOutput();
+      /* END_IGNORE_FOR_LINE_COUNT */
+    }
+
+    generate();
     auto end = std::chrono::steady_clock::now();
     std::chrono::duration<double> elapsed = end - start;
-    if (myRank == 0) {
+    if (myRank == 0 && inputFile != nullptr) {
+      // the barrier at the end of generate() makes this the slowest rank's time
+      double bytes = (double)n * sizeof(SortElement);
+      std::cout << "Read " << bytes/1.0e6 << " MB from " << inputFile << " in "
+                << elapsed.count() << " s, " << bytes/elapsed.count()/1.0e9 << " GB/s\n";
+      /* BEGIN_IGNORE_FOR_LINE_COUNT (printing) */
+      flushOutput();
+      /* END_IGNORE_FOR_LINE_COUNT */
+    } else if (myRank == 0) {
       std::cout << "Generated random values in " << elapsed.count() << " s\n";
       /* BEGIN_IGNORE_FOR_LINE_COUNT (printing) */
       flushOutput();
@@ -575,37 +881,90 @@ int main(int argc, char *argv[]) {
       /* END_IGNORE_FOR_LINE_COUNT */
     }
 
-    shmem_barrier_all();
-    auto start = std::chrono::steady_clock::now();
+    Bench bench("shmem_lsbsort", nodeShuffle ? "agp_node" : "agp");
 
+    // PAPI is set up before any timing starts
+#ifdef USE_PAPI
     int papi_ok = 1, eventset = PAPI_NULL;
     long long val[1] = {0};
 
     if (PAPI_library_init(PAPI_VER_CURRENT) != PAPI_VER_CURRENT) papi_ok = 0;
     if (papi_ok && PAPI_create_eventset(&eventset) != PAPI_OK) papi_ok = 0;
     if (papi_ok && PAPI_add_named_event(eventset, "cray_pm:::PM_ENERGY:NODE") != PAPI_OK) papi_ok = 0;
-    if (papi_ok && PAPI_start(eventset) != PAPI_OK) papi_ok = 0;
-  
-
-    mySort(A, B);
+    double energy = 0.0;
+#endif
+
+    TlbCounter tlb;
+    int64_t tlbMisses = 0;
+    for (int it = 0; it < bench.iterations(); it++) {
+      // the previous sort consumed the input
+      if (it > 0)
+        generate();
+      bool timed = !bench.is_warmup(it);
+
+      shmem_barrier_all();
+#ifdef USE_PAPI
+      if (timed && papi_ok && PAPI_start(eventset) != PAPI_OK) papi_ok = 0;
+#endif
+      tlb.start();
+      auto start = std::chrono::steady_clock::now();
+      mySort(A, B, node.get());
+      auto end = std::chrono::steady_clock::now();
+      int64_t misses = tlb.stop();
+#ifdef USE_PAPI
+      if (timed && papi_ok && PAPI_stop(eventset, val) == PAPI_OK)
+        energy += (double) val[0];
+#endif
+
+      std::chrono::duration<double> elapsed = end - start;
+      bench.record(it, elapsed.count());
+      if (timed)
+        tlbMisses = (misses < 0 || tlbMisses < 0) ? -1 : tlbMisses + misses;
+    }
 
-    double energy, total_energy=0;
-    if (papi_ok && PAPI_stop(eventset, val) == PAPI_OK)
-          energy = (double) val[0];
-    
-    total_energy = lgp_reduce_add_l(energy)/(double)64;
+#ifdef USE_PAPI
+    // every PE of a node reads the same node counter
+    double total_energy = lgp_reduce_add_d(energy) / bench_pes_per_node() / bench_options().trials;
     T0_fprintf(stderr, "Energy: %lf\n", total_energy);
+#endif
 
-    shmem_barrier_all();
-    auto end = std::chrono::steady_clock::now();
-    std::chrono::duration<double> elapsed = end - start;
+    // each of the N_DIGITS shuffles moves every element once
+    BenchResult res = bench.finish(n, (double)N_DIGITS * sizeof(SortElement) * n / numRanks);
     if (myRank == 0) {
-      std::cout << "Sorted " << n << " values in " << elapsed.count() << "\n";;
-      std::cout << "That's " << n/elapsed.count()/1000.0/1000.0
-                << " M elements sorted / s\n";
+      std::cout << "Sorted " << n << " values in " << res.median << "\n";;
+      std::cout << "That's " << res.elements_per_s/1000.0/1000.0
+                << " M elements sorted / s, " << res.gb_per_s_per_node << " GB/s/node\n";
+      std::cout << "min " << res.min << " max " << res.max
+                << " s over the PEs and " << res.trials << " trials\n";
       flushOutput();
     }
+    if (lgp_reduce_min_l(tlbMisses) >= 0) {
+      int64_t allMisses = lgp_reduce_add_l(tlbMisses);
+      if (myRank == 0) {
+        std::cout << "dTLB misses: " << allMisses << ", "
+                  << allMisses/(double)n/bench_options().trials << " per element\n";
+        flushOutput();
+      }
+    }
+    shmem_barrier_all();
+  }
+
+  // write the sorted records back, each rank its own block; the sort
+  // time above does not include this
+  if (outputFile != nullptr) {
+    shmem_barrier_all();
+    auto start = std::chrono::steady_clock::now();
+    if (!bin_write(outputFile, A.localPart(), sizeof(SortElement),
+                   A.localIdxToGlobalIdx(0), A.numElementsHere()))
+      shmem_global_exit(1);
     shmem_barrier_all();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    if (myRank == 0) {
+      double bytes = (double)n * sizeof(SortElement);
+      std::cout << "Wrote " << bytes/1.0e6 << " MB to " << outputFile << " in "
+                << elapsed.count() << " s, " << bytes/elapsed.count()/1.0e9 << " GB/s\n";
+      flushOutput();
+    }
   }
 
   /* BEGIN_IGNORE_FOR_LINE_COUNT (printing and verification code) */
@@ -629,6 +988,9 @@ int main(int argc, char *argv[]) {
 
   /* END_IGNORE_FOR_LINE_COUNT */
 
+  node.reset();
+  mem_report(stderr, n, memPes, memN);
+
   // this seems to cause crashes/hangs with openmpi shmem / osss-ucx
   //shmem_finalize();
 
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <array>
 #include <chrono>
 #include <iomanip>
@@ -19,7 +20,18 @@ extern "C" {
 #include <spmat.h>
 }
 
+#ifdef USE_PAPI
 #include <papi.h>
+#endif
+
+#include "bench_harness.h"
+#include "binary_io.h"
+#include "convey_prof.h"
+#include "energy_sampler.h"
+#include "fast_div.h"
+#include "mem_account.h"
+#include "mem_policy.h"
+#include "stream_store.h"
 
 #define RADIX 16
 #define N_DIGITS (64/RADIX)
@@ -28,6 +40,13 @@ extern "C" {
 #define MASK (N_BUCKETS - 1)
 using counts_array_t = std::array<int64_t, COUNTS_SIZE>;
 
+// how globalShuffle moves the elements once every rank knows its starts
+enum class ShuffleBackend {
+  Conveyor, // one conveyor message per element, with its local index
+  Put,      // one blocking shmem_putmem per element
+  Bulk,     // pack by destination rank, then one shmem_putmem_nbi per rank
+};
+
 // the elements to sort
 struct SortElement {
   uint64_t key = 0; // to sort by
@@ -91,15 +110,17 @@ struct DistributedArray {
   int64_t numElementsTotal_ = 0;    // number of elements on all ranks
   int64_t numElementsPerRank_ = 0 ; // number per rank
   int64_t numElementsHere_ = 0;     // number this rank
+  FastDivider perRankDiv_;          // divides by numElementsPerRank_
   int myRank_ = 0;
   int numRanks_ = 0;
 
+  // 'scale' says how the per-rank size grows, for the memory accounting
   static DistributedArray<EltType>
-  create(std::string name, int64_t totalNumElements);
+  create(std::string name, int64_t totalNumElements, int scale = MEM_PER_ELT);
 
   ~DistributedArray() {
     if (localPart_ != nullptr) {
-      shmem_free(localPart_);
+      mem_shmem_free(localPart_);
     }
   }
 
@@ -110,12 +131,18 @@ struct DistributedArray {
   // convert a global index into a local index
   inline RankAndLocalIndex globalIdxToLocalIdx(int64_t glbIdx) const {
     RankAndLocalIndex ret;
-    int64_t rank = glbIdx / numElementsPerRank_;
+    int64_t rank = perRankDiv_.divide(glbIdx);
     int64_t locIdx = glbIdx - rank*numElementsPerRank_;
     ret.rank = rank;
     ret.locIdx = locIdx;
     return ret;
   }
+  // convert n global indices at once into separate rank and local
+  // index arrays; the loop vectorizes
+  inline void globalIdxToLocalIdx(const int64_t* glbIdx, int64_t n,
+                                  int64_t* rank, int64_t* locIdx) const {
+    perRankDiv_.divide_block(glbIdx, n, rank, locIdx);
+  }
 
   // accessors
   inline const std::string& name() const { return name_; }
@@ -136,7 +163,8 @@ struct DistributedArray {
 
 template<typename EltType>
 DistributedArray<EltType>
-DistributedArray<EltType>::create(std::string name, int64_t totalNumElements) {
+DistributedArray<EltType>::create(std::string name, int64_t totalNumElements,
+                                  int scale) {
   int myRank = 0;
   int numRanks = 0;
   myRank = shmem_my_pe();
@@ -151,10 +179,13 @@ DistributedArray<EltType>::create(std::string name, int64_t totalNumElements) {
 
   DistributedArray<EltType> ret;
   ret.name_ = std::move(name);
-  ret.localPart_ = (EltType*) shmem_malloc(eltsPerRank * sizeof(EltType));
+  ret.localPart_ = (EltType*) mem_shmem_malloc(eltsPerRank * sizeof(EltType),
+                                               ret.name_.c_str(), scale);
+  mem_place(ret.localPart_, eltsPerRank * sizeof(EltType));
   ret.numElementsTotal_ = totalNumElements;
   ret.numElementsPerRank_ = eltsPerRank;
   ret.numElementsHere_ = eltsHere;
+  ret.perRankDiv_ = FastDivider(eltsPerRank > 0 ? eltsPerRank : 1);
   ret.myRank_ = myRank;
   ret.numRanks_ = numRanks;
 
@@ -250,12 +281,25 @@ inline int getBucket(SortElement x, int d) {
   return (x.key >> (RADIX*d)) & MASK;
 }
 
+// compute bucket i's position in the transposed counts/starts array,
+// [r0d0, r1d0, ...], for every bucket i at once
+static void transposedPositions(const DistributedArray<int64_t>& Global,
+                                std::vector<int64_t>& rank,
+                                std::vector<int64_t>& locIdx) {
+  int64_t myRank = shmem_my_pe();
+  int64_t numRanks = shmem_n_pes();
+  std::vector<int64_t> glbIdx(COUNTS_SIZE);
+  for (int64_t i = 0; i < COUNTS_SIZE; i++) {
+    glbIdx[i] = i*numRanks + myRank;
+  }
+  rank.resize(COUNTS_SIZE);
+  locIdx.resize(COUNTS_SIZE);
+  Global.globalIdxToLocalIdx(glbIdx.data(), COUNTS_SIZE, rank.data(), locIdx.data());
+}
+
 void copyCountsToGlobalCounts(counts_array_t& localCounts,
                               DistributedArray<int64_t>& GlobalCounts, convey_t * request) {
-  int myRank = 0;
-  int numRanks = 0;
-  myRank = shmem_my_pe();
-  numRanks = shmem_n_pes();
+  ConveyPhase phase("counts");
 
   // Now, each rank has an array of counts, like this
   //  [r0d0, r0d1, ... r0d255]  | on rank 0
@@ -270,22 +314,21 @@ void copyCountsToGlobalCounts(counts_array_t& localCounts,
   //  [r0d2, r1d2, r2d2, ...]   | on rank 1 ...
   //  ...
 
+  std::vector<int64_t> dstRank, dstLocIdx;
+  transposedPositions(GlobalCounts, dstRank, dstLocIdx);
+
   int64_t i = 0;
-  convey_begin(request, sizeof(IdxValue), alignof(IdxValue));
-  while (convey_advance(request, i == COUNTS_SIZE)) {
+  cprof_begin(request, sizeof(IdxValue), alignof(IdxValue), "request");
+  while (cprof_advance(request, i == COUNTS_SIZE)) {
     int64_t* GCA = &GlobalCounts.localPart()[0]; // it's symmetric
     for (; i < COUNTS_SIZE; i++) {
-      int64_t dstGlobalIdx = i*numRanks + myRank;
-      auto dst = GlobalCounts.globalIdxToLocalIdx(dstGlobalIdx);
-      int dstRank = dst.rank;
-
-      IdxValue payload = { .locIdx = dst.locIdx, .value = localCounts[i] };
-      if (! convey_push(request, &payload, dst.rank))
+      IdxValue payload = { .locIdx = dstLocIdx[i], .value = localCounts[i] };
+      if (! cprof_push(request, &payload, dstRank[i]))
         break;
     }
 
     IdxValue local;
-    while( convey_pull(request, &local, NULL) == convey_OK)
+    while( cprof_pull(request, &local, NULL) == convey_OK)
       GCA[local.locIdx] = local.value;
 
   }
@@ -309,7 +352,8 @@ void exclusiveScan(const DistributedArray<int64_t>& Src,
 
   // allocate a remotely accessible array
   // only rank 0's values will be used
-  int64_t* PerRankStarts = (int64_t*) shmem_malloc(sizeof(int64_t) * numRanks);
+  int64_t* PerRankStarts = (int64_t*) mem_shmem_malloc(sizeof(int64_t) * numRanks,
+                                                        "PerRankStarts", MEM_PER_PE);
 
   // Send the total from each rank to rank 0
   shmem_int64_p(PerRankStarts + myRank, myTotal, 0);
@@ -346,16 +390,13 @@ void exclusiveScan(const DistributedArray<int64_t>& Src,
     }
   }
 
-  shmem_free(PerRankStarts);
+  mem_shmem_free(PerRankStarts);
 }
 
 void copyStartsFromGlobalStarts(DistributedArray<int64_t>& GlobalStarts,
                                 counts_array_t& localStarts, convey_t* request,
                                 convey_t* reply) {
-  int myRank = 0;
-  int numRanks = 0;
-  myRank = shmem_my_pe();
-  numRanks = shmem_n_pes();
+  ConveyPhase phase("starts");
 
   // starts look like this:
   //  [r0d0, r1d0, r2d0, ...]   | on rank 0
@@ -369,37 +410,34 @@ void copyStartsFromGlobalStarts(DistributedArray<int64_t>& GlobalStarts,
   //  ...
   //
 
-  convey_begin(request, sizeof(IdxValue), alignof(IdxValue));
-  convey_begin(reply, sizeof(IdxValue), alignof(IdxValue));
+  cprof_begin(request, sizeof(IdxValue), alignof(IdxValue), "request");
+  cprof_begin(reply, sizeof(IdxValue), alignof(IdxValue), "reply");
 
   int64_t* GSA = GlobalStarts.localPart(); // it's symmetric
+  std::vector<int64_t> srcRank, srcLocIdx;
+  transposedPositions(GlobalStarts, srcRank, srcLocIdx);
 
   int64_t i = 0;
   bool more;
-  while (more = convey_advance(request, i == COUNTS_SIZE),
-	 more | convey_advance(reply, !more)) {
+  while (more = cprof_advance(request, i == COUNTS_SIZE),
+	 more | cprof_advance(reply, !more)) {
     for (; i < COUNTS_SIZE; i++) {
-      int64_t srcGlobalIdx = i*numRanks + myRank;
-      auto src = GlobalStarts.globalIdxToLocalIdx(srcGlobalIdx);
-      int srcRank = src.rank;
-      int64_t srcIndex = src.locIdx;
-
-      IdxValue packet = { .locIdx = i, .value = srcIndex };
-      if (! convey_push(request, &packet, srcRank))
+      IdxValue packet = { .locIdx = i, .value = srcLocIdx[i] };
+      if (! cprof_push(request, &packet, srcRank[i]))
 	break;
     }
 
     IdxValue* p;
     int64_t from;
-    while ((p = (IdxValue*)convey_apull(request, &from)) != NULL) {
+    while ((p = (IdxValue*)cprof_apull(request, &from)) != NULL) {
       IdxValue packet = { .locIdx = p->locIdx, .value = GSA[p->value] };
-      if (! convey_push(reply, &packet, from)) {
-	convey_unpull(request);
+      if (! cprof_push(reply, &packet, from)) {
+	cprof_unpull(request);
 	break;
       }
     }
 
-    while ((p = (IdxValue*)convey_apull(reply, NULL)) != NULL)
+    while ((p = (IdxValue*)cprof_apull(reply, NULL)) != NULL)
       localStarts[p->locIdx] = p->value;
   }
 
@@ -409,10 +447,114 @@ void copyStartsFromGlobalStarts(DistributedArray<int64_t>& GlobalStarts,
   shmem_barrier_all();
 }
 
-// shuffles the data from A into B
+// Each rank's elements of one bucket land in the contiguous global range
+// [starts[b], starts[b] + counts[b]), and these ranges advance with b. So
+// once a rank has packed its elements by bucket, the ones for each
+// destination rank are one contiguous run of the staging buffer. The ranks
+// trade run lengths with shmem_alltoallmem and each run goes out with one
+// shmem_putmem_nbi into the receiver's part of B, after the runs of the
+// lower ranks: one put per pair of ranks and no per-element header. The
+// receiver then holds runs ordered by sender, each ordered by bucket, and
+// its part of the output is ordered by bucket, then sender. A stable local
+// counting sort by bucket puts the elements in place.
+// 'exch' is symmetric and holds 4*numRanks int64_t.
+void bulkShuffle(DistributedArray<SortElement>& A,
+                 DistributedArray<SortElement>& B,
+                 int digit, const counts_array_t& counts,
+                 const counts_array_t& starts, std::vector<SortElement>& stage,
+                 int64_t* exch) {
+  int numRanks = shmem_n_pes();
+  int64_t locN = A.numElementsHere();
+  const SortElement* localPart = A.localPart();
+  SortElement* GB = B.localPart(); // it's symmetric
+
+  // stable local counting sort into the staging buffer
+  auto offsets = std::make_unique<counts_array_t>();
+  int64_t sum = 0;
+  for (int64_t b = 0; b < COUNTS_SIZE; b++) {
+    (*offsets)[b] = sum;
+    sum += counts[b];
+  }
+  stage.resize(std::max(locN, B.numElementsHere()));
+  mem_private("stage", stage.capacity() * sizeof(SortElement));
+  for (int64_t i = 0; i < locN; i++) {
+    SortElement elt = localPart[i];
+    stage[(*offsets)[getBucket(elt, digit)]++] = elt;
+  }
+
+  // how many elements go to each rank, split where a bucket crosses ranks
+  int64_t* sendCounts = exch;
+  int64_t* recvCounts = exch + numRanks;
+  int64_t* recvOffsets = exch + 2*numRanks;
+  int64_t* sendOffsets = exch + 3*numRanks;
+  std::fill(sendCounts, sendCounts + numRanks, 0);
+  for (int64_t b = 0; b < COUNTS_SIZE; b++) {
+    int64_t dstGlobalIdx = starts[b];
+    int64_t left = counts[b];
+    while (left > 0) {
+      auto dst = B.globalIdxToLocalIdx(dstGlobalIdx);
+      int64_t n = std::min(left, B.numElementsPerRank() - dst.locIdx);
+      sendCounts[dst.rank] += n;
+      dstGlobalIdx += n;
+      left -= n;
+    }
+  }
+
+  // each receiver places the senders' runs one after the other
+  shmem_alltoallmem(SHMEM_TEAM_WORLD, recvCounts, sendCounts, sizeof(int64_t));
+  sum = 0;
+  for (int s = 0; s < numRanks; s++) {
+    recvOffsets[s] = sum;
+    sum += recvCounts[s];
+  }
+  shmem_alltoallmem(SHMEM_TEAM_WORLD, sendOffsets, recvOffsets, sizeof(int64_t));
+
+  // in place, nobody may write into A until every rank has packed its part
+  if (&A == &B)
+    shmem_barrier_all();
+
+  const SortElement* src = stage.data();
+  for (int r = 0; r < numRanks; r++) {
+    if (sendCounts[r] > 0)
+      shmem_putmem_nbi(GB + sendOffsets[r], src, sendCounts[r] * sizeof(SortElement), r);
+    src += sendCounts[r];
+  }
+
+  shmem_quiet();
+  shmem_barrier_all();
+
+  // order the received runs by bucket; the staging buffer is free again
+  int64_t locB = B.numElementsHere();
+  std::copy(GB, GB + locB, stage.begin());
+  offsets->fill(0);
+  for (int64_t i = 0; i < locB; i++)
+    (*offsets)[getBucket(stage[i], digit)]++;
+  sum = 0;
+  for (int64_t b = 0; b < COUNTS_SIZE; b++) {
+    int64_t c = (*offsets)[b];
+    (*offsets)[b] = sum;
+    sum += c;
+  }
+  for (int64_t i = 0; i < locB; i++) {
+    SortElement elt = stage[i];
+    GB[(*offsets)[getBucket(elt, digit)]++] = elt;
+  }
+
+  // nobody reads B before every rank has put its part in order
+  shmem_barrier_all();
+}
+
+// shuffles the data from A into B; A and B may be the same array, in
+// which case each rank's part is first copied out to 'stage'. With
+// 'streamLines' > 0 the conveyor backend writes full cache lines of B
+// with non-temporal stores, through that many line buffers
+// (stream_store.h). 'exch' is the bulk backend's symmetric count
+// exchange buffer, NULL for the others.
 void globalShuffle(DistributedArray<SortElement>& A,
                    DistributedArray<SortElement>& B,
-                   int digit, convey_t* request, convey_t* reply) {
+                   int digit, convey_t* request, convey_t* reply,
+                   ShuffleBackend backend, int64_t streamLines,
+                   std::vector<SortElement>& stage, int64_t* exch) {
   int myRank = 0;
   int numRanks = 0;
   myRank = shmem_my_pe();
@@ -448,11 +590,13 @@ void globalShuffle(DistributedArray<SortElement>& A,
 
   // create a distributed array storing the result of this transposition
   auto GlobalCounts = DistributedArray<int64_t>::create("GlobalCounts",
-                                                        COUNTS_SIZE*numRanks);
+                                                        COUNTS_SIZE*numRanks,
+                                                        MEM_FIXED);
   // and one storing the start positions for each task
   // (that will be the result of a scan operation)
   auto GlobalStarts = DistributedArray<int64_t>::create("GlobalStarts",
-                                                        COUNTS_SIZE*numRanks);
+                                                        COUNTS_SIZE*numRanks,
+                                                        MEM_FIXED);
 
   // copy the per-bucket counts to the global counts array
   copyCountsToGlobalCounts(*counts, GlobalCounts, request);
@@ -463,14 +607,43 @@ void globalShuffle(DistributedArray<SortElement>& A,
   // copy the per-bucket starts from the global counts array
   copyStartsFromGlobalStarts(GlobalStarts, *starts, request, reply);
 
+  if (backend == ShuffleBackend::Bulk) {
+    bulkShuffle(A, B, digit, *counts, *starts, stage, exch);
+    return;
+  }
+
+  SortElement* GB = B.localPart(); // it's symmetric
+
+  if (&A == &B) {
+    stage.assign(localPart, localPart + locN);
+    mem_private("stage", stage.capacity() * sizeof(SortElement));
+    localPart = stage.data();
+    shmem_barrier_all();
+  }
+
+  if (backend == ShuffleBackend::Put) {
+    for (int64_t i = 0; i < locN; i++) {
+      SortElement elt = localPart[i];
+      int64_t &next = (*starts)[getBucket(elt, digit)];
+      auto dst = B.globalIdxToLocalIdx(next);
+      next += 1;
+      shmem_putmem(GB + dst.locIdx, &elt, sizeof(SortElement), dst.rank);
+    }
+    shmem_quiet();
+    shmem_barrier_all();
+    return;
+  }
+
   // Now go through the data in B assigning each element its final
   // position and sending that data to the other ranks
   // Leave the result in B
-  convey_begin(request, sizeof(IdxSortElement), alignof(IdxSortElement));
+  ConveyPhase phase("shuffle");
+  cprof_begin(request, sizeof(IdxSortElement), alignof(IdxSortElement), "request");
 
-  SortElement* GB = B.localPart(); // it's symmetric
+  // the elements of a bucket run arrive at consecutive local indices
+  StreamWriter<SortElement> out(GB, streamLines, streamLines > 0);
   int64_t i = 0;
-  while (convey_advance(request, i == locN)) {
+  while (cprof_advance(request, i == locN)) {
     for (; i < locN; i++) {
       SortElement elt = localPart[i];
       int bucket = getBucket(elt, digit);
@@ -482,39 +655,50 @@ void globalShuffle(DistributedArray<SortElement>& A,
 
       assert(0 <= dst.rank && dst.rank < numRanks);
       IdxSortElement payload = { .locIdx = dst.locIdx, .value = elt };
-      if (! convey_push(request, &payload, dst.rank))
+      if (! cprof_push(request, &payload, dst.rank))
         break;
 
       next += 1;
     }
 
     IdxSortElement* local;
-    while((local = (IdxSortElement*)convey_apull(request, NULL)) != NULL) {
-      GB[local->locIdx] = local->value;
+    while((local = (IdxSortElement*)cprof_apull(request, NULL)) != NULL) {
+      out.put(local->locIdx, local->value);
     }
 
   }
+  out.finish();
   convey_reset(request);
 
 }
 
-// Sort the data in A, using B as scratch space.
+// Sort the data in A, using B as scratch space. When B is A itself, the
+// sort runs in place: the only full-size copy besides A is the private
+// staging buffer, which is not on the symmetric heap.
 void mySort(DistributedArray<SortElement>& A,
-            DistributedArray<SortElement>& B) {
+            DistributedArray<SortElement>& B,
+            ShuffleBackend backend, int64_t streamLines) {
   int myRank = 0;
   int numRanks = 0;
   myRank = shmem_my_pe();
   numRanks = shmem_n_pes();
 
-  convey_t* request = convey_new(SIZE_MAX, 0, NULL, convey_opt_SCATTER);
-  convey_t* reply = convey_new(SIZE_MAX, 0, NULL, 0);
+  convey_t* request = mem_convey_new(SIZE_MAX, 0, NULL, convey_opt_SCATTER, "request");
+  convey_t* reply = mem_convey_new(SIZE_MAX, 0, NULL, 0, "reply");
+  std::vector<SortElement> stage; // for the bulk backend or in place
+  int64_t* exch = NULL;
+  if (backend == ShuffleBackend::Bulk)
+    exch = (int64_t*) mem_shmem_malloc(4 * numRanks * sizeof(int64_t), "bulk counts", MEM_PER_PE);
   assert(N_DIGITS % 2 == 0);
   for (int digit = 0; digit < N_DIGITS; digit += 2) {
-    globalShuffle(A, B, digit,   request, reply);
-    globalShuffle(B, A, digit+1, request, reply);
+    globalShuffle(A, B, digit,   request, reply, backend, streamLines, stage, exch);
+    globalShuffle(B, A, digit+1, request, reply, backend, streamLines, stage, exch);
   }
-  convey_free(request);
-  convey_free(reply);
+  if (exch)
+    mem_shmem_free(exch);
+  mem_convey_free(request);
+  mem_convey_free(reply);
+  mem_private("stage", 0);
 }
 
 int main(int argc, char *argv[]) {
@@ -526,6 +710,26 @@ int main(int argc, char *argv[]) {
   bool printSome = false;
   bool verify = true;
   /* END_IGNORE_FOR_LINE_COUNT */
+  const char* profFile = nullptr;
+  const char* matrixPrefix = nullptr;
+  const char* tracePrefix = nullptr;  // per PE conveyor traces for tools/convey_replay
+  const char* energyFile = nullptr;
+  double energyInterval = 0.01;
+  ShuffleBackend backend = ShuffleBackend::Conveyor;
+  bool lean = false;
+  int64_t streamLines = 4096;   // line buffers for non-temporal stores on the conveyor receive path, 0 for none
+  const char* memEvent = "PAPI_L3_TCM"; // PAPI event for the memory traffic
+  int64_t memPes = 0; // estimate the symmetric heap for this many PEs
+  int64_t memN = 0;   // and this problem size; 0 means this run's
+  const char* pages = nullptr;  // page size policy for the arrays
+  const char* numa = nullptr;   // NUMA binding for the arrays
+  int touchThreads = 1;         // threads for the first touch
+  int warmup = 0;               // untimed sorts before the trials
+  int trials = 1;               // timed sorts
+  int pesPerNode = 0;           // for GB/s/node; 0 counts the PEs that share memory
+  const char* jsonFile = nullptr; // benchmark records, see common/bench_harness.h
+  const char* inputFile = nullptr;  // 16-byte (key, val) records to sort instead of random ones
+  const char* outputFile = nullptr; // where to write the sorted records
 
   int64_t n = 100*1000*1000;
   for (int i = 1; i < argc; i++) {
@@ -540,6 +744,53 @@ int main(int argc, char *argv[]) {
       verify = true;
     } else if (std::string(argv[i]) == "--no-verify") {
       verify = false;
+    } else if (std::string(argv[i]) == "--prof") {
+      profFile = argv[++i];
+    } else if (std::string(argv[i]) == "--comm-matrix") {
+      matrixPrefix = argv[++i];
+    } else if (std::string(argv[i]) == "--trace") {
+      tracePrefix = argv[++i];
+    } else if (std::string(argv[i]) == "--energy") {
+      energyFile = argv[++i];
+    } else if (std::string(argv[i]) == "--energy-interval") {
+      energyInterval = std::stod(argv[++i]);
+    } else if (std::string(argv[i]) == "--shuffle") {
+      std::string b = argv[++i];
+      if (b == "conveyor") backend = ShuffleBackend::Conveyor;
+      else if (b == "put") backend = ShuffleBackend::Put;
+      else if (b == "bulk") backend = ShuffleBackend::Bulk;
+      else if (shmem_my_pe() == 0)
+        std::cerr << "unknown --shuffle " << b << ", using conveyor\n";
+    } else if (std::string(argv[i]) == "--lean") {
+      // no B on the symmetric heap; a private copy of the local part takes
+      // its place, so the memory per node stays at 32 bytes per element
+      lean = true;
+    } else if (std::string(argv[i]) == "--stream-lines") {
+      streamLines = std::stoll(argv[++i]);
+    } else if (std::string(argv[i]) == "--papi-event") {
+      memEvent = argv[++i];
+    } else if (std::string(argv[i]) == "--mem-pes") {
+      memPes = std::stoll(argv[++i]);
+    } else if (std::string(argv[i]) == "--mem-n") {
+      memN = std::stoll(argv[++i]);
+    } else if (std::string(argv[i]) == "--pages") {
+      pages = argv[++i];
+    } else if (std::string(argv[i]) == "--numa") {
+      numa = argv[++i];
+    } else if (std::string(argv[i]) == "--touch-threads") {
+      touchThreads = std::stoi(argv[++i]);
+    } else if (std::string(argv[i]) == "--warmup") {
+      warmup = std::stoi(argv[++i]);
+    } else if (std::string(argv[i]) == "--trials") {
+      trials = std::stoi(argv[++i]);
+    } else if (std::string(argv[i]) == "--pes-per-node") {
+      pesPerNode = std::stoi(argv[++i]);
+    } else if (std::string(argv[i]) == "--json") {
+      jsonFile = argv[++i];
+    } else if (std::string(argv[i]) == "--input") {
+      inputFile = argv[++i];
+    } else if (std::string(argv[i]) == "--output") {
+      outputFile = argv[++i];
     }
     /* END_IGNORE_FOR_LINE_COUNT */
   }
@@ -549,26 +800,68 @@ int main(int argc, char *argv[]) {
   myRank = shmem_my_pe();
   numRanks = shmem_n_pes();
 
+  if (mem_policy_set(pages, numa, touchThreads) != 0 && myRank == 0)
+    std::cerr << "bad --pages or --numa, keeping the defaults\n";
+  bench_set(warmup, trials, pesPerNode, jsonFile);
+  // the input file decides the problem size
+  if (inputFile != nullptr) {
+    n = bin_records(inputFile, sizeof(SortElement));
+    if (lgp_reduce_min_l(n) < 0) {
+      if (myRank == 0)
+        std::cerr << "cannot read the records of " << inputFile << "\n";
+      return 1;
+    }
+  }
+  if (outputFile != nullptr) {
+    int64_t ok = myRank == 0 ? bin_create(outputFile, sizeof(SortElement), n) : 1;
+    if (lgp_reduce_min_l(ok) == 0)
+      return 1;
+  }
+  bench_param("n", n);
+  bench_param("input", inputFile);
+  bench_param("pages", mem_policy_name());
+  bench_param("numa", numa);
+  const char* backendName = backend == ShuffleBackend::Bulk ? "bulk" :
+                            backend == ShuffleBackend::Put ? "put" : "conveyor";
+  bench_param("lean", lean ? "yes" : "no");
+  bench_param("stream_lines", streamLines);
+
   if (myRank == 0) {
     std::cout << "Total number of shmem PEs: " << numRanks << "\n";
     std::cout << "Problem size: " << n << "\n";
+    std::cout << "Pages: " << mem_policy_name()
+              << ", first touch threads: " << mem_policy().touch_threads << "\n";
+    std::cout << "Warmup sorts: " << bench_options().warmup
+              << ", timed trials: " << bench_options().trials << "\n";
+    std::cout << "Shuffle backend: " << backendName
+              << (lean ? ", in place (halves the symmetric heap, not the memory per node)" : "") << "\n";
+    if (backend == ShuffleBackend::Conveyor)
+      std::cout << "Line buffers for streaming stores on receive: " << streamLines << "\n";
     flushOutput();
   }
 
-  // create distributed arrays A and B
-  auto A = DistributedArray<SortElement>::create("A", n);
-  auto B = DistributedArray<SortElement>::create("B", n);
+  if (matrixPrefix)
+    cprof_enable_matrix();
+  if (tracePrefix)
+    cprof_enable_trace(tracePrefix);
+  if (energyFile)
+    energy_start(energyFile, energyInterval);
 
-  // set the keys to random values and the values to global indices
-  {
-    auto start = std::chrono::steady_clock::now();
-    if (myRank == 0) {
-      std::cout << "Generating random values\n";
-      /* BEGIN_IGNORE_FOR_LINE_COUNT (printing) */
-      flushOutput();
-      /* END_IGNORE_FOR_LINE_COUNT */
+  // create distributed arrays A and B; --lean sorts A in place
+  auto A = DistributedArray<SortElement>::create("A", n);
+  auto B = lean ? DistributedArray<SortElement>()
+                : DistributedArray<SortElement>::create("B", n);
+
+  // set the keys to random values and the values to global indices,
+  // or read this rank's block of --input; every trial sorts the same input
+  auto generate = [&]() {
+    if (inputFile != nullptr) {
+      if (!bin_read(inputFile, A.localPart(), sizeof(SortElement),
+                    A.localIdxToGlobalIdx(0), A.numElementsHere()))
+        shmem_global_exit(1);
+      shmem_barrier_all();
+      return;
     }
-
     auto rng = pcg64(myRank);
     int64_t locN = A.numElementsHere();
     for (int64_t i = 0; i < locN; i++) {
@@ -578,9 +871,31 @@ int main(int argc, char *argv[]) {
     }
 
     shmem_barrier_all();
+  };
+
+  {
+    energy_mark("generate");
+    MemPhase memPhase("generate");
+    auto start = std::chrono::steady_clock::now();
+    if (myRank == 0) {
+      std::cout << (inputFile ? "Reading the input\n" : "Generating random values\n");
+      /* BEGIN_IGNORE_FOR_LINE_COUNT (printing) */
+      flushOutput();
+      /* END_IGNORE_FOR_LINE_COUNT */
+    }
+
+    generate();
     auto end = std::chrono::steady_clock::now();
     std::chrono::duration<double> elapsed = end - start;
-    if (myRank == 0) {
+    if (myRank == 0 && inputFile != nullptr) {
+      // the barrier at the end of generate() makes this the slowest rank's time
+      double bytes = (double)n * sizeof(SortElement);
+      std::cout << "Read " << bytes/1.0e6 << " MB from " << inputFile << " in "
+                << elapsed.count() << " s, " << bytes/elapsed.count()/1.0e9 << " GB/s\n";
+      /* BEGIN_IGNORE_FOR_LINE_COUNT (printing) */
+      flushOutput();
+      /* END_IGNORE_FOR_LINE_COUNT */
+    } else if (myRank == 0) {
       std::cout << "Generated random values in " << elapsed.count() << " s\n";
       /* BEGIN_IGNORE_FOR_LINE_COUNT (printing) */
       flushOutput();
@@ -608,37 +923,133 @@ int main(int argc, char *argv[]) {
       /* END_IGNORE_FOR_LINE_COUNT */
     }
 
-    shmem_barrier_all();
-    auto start = std::chrono::steady_clock::now();
+    energy_mark("sort");
+    MemPhase memPhase("sort");
+    Bench bench("shmem_lsbsort_convey", backendName);
 
+    // PAPI is set up before any timing starts
+#ifdef USE_PAPI
     int papi_ok = 1, eventset = PAPI_NULL;
     long long val[1] = {0};
 
     if (PAPI_library_init(PAPI_VER_CURRENT) != PAPI_VER_CURRENT) papi_ok = 0;
     if (papi_ok && PAPI_create_eventset(&eventset) != PAPI_OK) papi_ok = 0;
     if (papi_ok && PAPI_add_named_event(eventset, "cray_pm:::PM_ENERGY:NODE") != PAPI_OK) papi_ok = 0;
-    if (papi_ok && PAPI_start(eventset) != PAPI_OK) papi_ok = 0;
-  
-
-    mySort(A, B);
+    double energy = 0.0;
+#endif
+
+    // one event set, since PAPI runs only one per thread on the CPU
+    EventCounter events((std::string("PAPI_TLB_DM,") + memEvent).c_str());
+    int64_t tlbMisses = 0;
+    int64_t memEvents = 0;
+    stream_stats() = StreamStats();
+    for (int it = 0; it < bench.iterations(); it++) {
+      // the previous sort consumed the input
+      if (it > 0)
+        generate();
+      bool timed = !bench.is_warmup(it);
+
+      shmem_barrier_all();
+#ifdef USE_PAPI
+      if (timed && papi_ok && PAPI_start(eventset) != PAPI_OK) papi_ok = 0;
+#endif
+      events.start();
+      auto start = std::chrono::steady_clock::now();
+      mySort(A, lean ? A : B, backend, streamLines);
+      auto end = std::chrono::steady_clock::now();
+      int64_t counts[2];
+      events.stop(counts);
+      int64_t misses = counts[0];
+#ifdef USE_PAPI
+      if (timed && papi_ok && PAPI_stop(eventset, val) == PAPI_OK)
+        energy += (double) val[0];
+#endif
+
+      std::chrono::duration<double> elapsed = end - start;
+      bench.record(it, elapsed.count());
+      if (timed) {
+        tlbMisses = (misses < 0 || tlbMisses < 0) ? -1 : tlbMisses + misses;
+        memEvents = (counts[1] < 0 || memEvents < 0) ? -1 : memEvents + counts[1];
+      }
+    }
 
-    double energy, total_energy=0;
-    if (papi_ok && PAPI_stop(eventset, val) == PAPI_OK)
-          energy = (double) val[0];
-    
-    total_energy = lgp_reduce_add_l(energy)/(double)64;
+#ifdef USE_PAPI
+    // every PE of a node reads the same node counter
+    double total_energy = lgp_reduce_add_d(energy) / bench_pes_per_node() / bench_options().trials;
     T0_fprintf(stderr, "Energy: %lf\n", total_energy);
+#endif
 
-    shmem_barrier_all();
-    auto end = std::chrono::steady_clock::now();
-    std::chrono::duration<double> elapsed = end - start;
+    // each of the N_DIGITS shuffles moves every element once
+    BenchResult res = bench.finish(n, (double)N_DIGITS * sizeof(SortElement) * n / numRanks);
+    if (myRank == 0) {
+      std::cout << "Sorted " << n << " values in " << res.median << "\n";;
+      std::cout << "That's " << res.elements_per_s/1000.0/1000.0
+                << " M elements sorted / s, " << res.gb_per_s_per_node << " GB/s/node\n";
+      std::cout << "min " << res.min << " max " << res.max
+                << " s over the PEs and " << res.trials << " trials\n";
+      flushOutput();
+    }
+    if (lgp_reduce_min_l(tlbMisses) >= 0) {
+      int64_t allMisses = lgp_reduce_add_l(tlbMisses);
+      if (myRank == 0) {
+        std::cout << "dTLB misses: " << allMisses << ", "
+                  << allMisses/(double)n/bench_options().trials << " per element\n";
+        flushOutput();
+      }
+    }
+    // compare --stream-lines 0 and > 0 for the receive side's traffic
+    if (lgp_reduce_min_l(memEvents) >= 0) {
+      int64_t all = lgp_reduce_add_l(memEvents);
+      if (myRank == 0) {
+        std::cout << memEvent << ": " << all << ", "
+                  << all/(double)n/bench_options().trials << " per element\n";
+        flushOutput();
+      }
+    }
+    if (backend == ShuffleBackend::Conveyor) {
+      int64_t streamed = lgp_reduce_add_l(stream_stats().streamed);
+      int64_t plain = lgp_reduce_add_l(stream_stats().plain);
+      if (myRank == 0 && streamed + plain > 0) {
+        std::cout << "Received elements in full streamed lines: "
+                  << 100.0*streamed/(streamed + plain) << "%\n";
+        flushOutput();
+      }
+    }
+    // --lean moves the second full-size copy from the symmetric heap to
+    // private memory, so the private peak belongs next to the symmetric one
+    int64_t peakSym = lgp_reduce_max_l(MemAccount::get().sym_peak());
+    int64_t peakPriv = lgp_reduce_max_l(MemAccount::get().priv_peak());
     if (myRank == 0) {
-      std::cout << "Sorted " << n << " values in " << elapsed.count() << "\n";;
-      std::cout << "That's " << n/elapsed.count()/1000.0/1000.0
-                << " M elements sorted / s\n";
+      std::cout << "Peak symmetric heap per PE: " << peakSym/1.0e6
+                << " MB (conveyor buffers estimated)\n";
+      std::cout << "Peak private memory per PE: " << peakPriv/1.0e6 << " MB\n";
       flushOutput();
     }
     shmem_barrier_all();
+
+    // where the conveyor time went, per phase; --prof adds every rank's counters
+    cprof_finish_trace();
+    cprof_report(stderr, profFile);
+    if (matrixPrefix)
+      cprof_write_matrix(matrixPrefix);
+  }
+
+  // write the sorted records back, each rank its own block; the sort
+  // time above does not include this
+  if (outputFile != nullptr) {
+    shmem_barrier_all();
+    auto start = std::chrono::steady_clock::now();
+    if (!bin_write(outputFile, A.localPart(), sizeof(SortElement),
+                   A.localIdxToGlobalIdx(0), A.numElementsHere()))
+      shmem_global_exit(1);
+    shmem_barrier_all();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    if (myRank == 0) {
+      double bytes = (double)n * sizeof(SortElement);
+      std::cout << "Wrote " << bytes/1.0e6 << " MB to " << outputFile << " in "
+                << elapsed.count() << " s, " << bytes/elapsed.count()/1.0e9 << " GB/s\n";
+      flushOutput();
+    }
   }
 
   /* BEGIN_IGNORE_FOR_LINE_COUNT (printing and verification code) */
@@ -650,6 +1061,8 @@ int main(int argc, char *argv[]) {
 
   bool sorted = true;
   if (verify) {
+    energy_mark("verify");
+    MemPhase memPhase("verify");
     sorted = A.checkSorted();
     if (myRank == 0) {
       if (sorted) {
@@ -662,6 +1075,9 @@ int main(int argc, char *argv[]) {
 
   /* END_IGNORE_FOR_LINE_COUNT */
 
+  energy_stop();
+  mem_report(stderr, n, memPes, memN);
+
   // this seems to cause crashes/hangs with openmpi shmem / osss-ucx
   //shmem_finalize();
 
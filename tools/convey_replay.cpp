@@ -0,0 +1,529 @@
+/*! \file convey_replay.cpp
+ * \brief Replay conveyor traces through aggregation and network models on one box.
+ *
+ * Reads the prefix.<pe>.trace files that the kernels write after
+ * cprof_enable_trace() (common/convey_prof.h) and replays every push at its
+ * recorded time through a model of the conveyor's aggregation:
+ *   --topology direct   one buffer per destination PE
+ *   --topology 2d       on-node destinations are direct; off-node items go
+ *                       first to the PE on this node with the destination's
+ *                       local rank, which aggregates them for the network
+ *   --buffer bytes      the size of every buffer; a full buffer is sent
+ *   --item-bytes n      replace the traced item sizes, e.g. to try packing
+ *   --header bytes      added to every message
+ *   --flush full|advance  send partial buffers only when their PE is done
+ *                       with the conveyor, or at every advance
+ * and of the network:
+ *   inter-node  a message waits for its node's NIC, takes bytes / --bw and
+ *               arrives --latency later
+ *   intra-node  the same with the sending PE, --intra-bw and --intra-latency
+ *   --overhead  CPU time per message before it can start
+ *
+ * The replay is open loop: pushes happen when they did in the traced run,
+ * even if the model delivers their cause (a request) later. It reports per
+ * phase and conveyor the messages, their fill and the buffered bytes, and
+ * per phase the traced and the predicted time. The predicted time of one
+ * pass through a phase runs from its first begin to its last delivery or
+ * push, whichever is later.
+ *
+ *     ./ig_block -M 8 -R ig && tools/convey_replay --trace ig --topology 2d --buffer 16384
+ */
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <queue>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/* must match common/convey_prof.h */
+enum { CPROF_EV_PUSH = 0, CPROF_EV_ADVANCE = 1, CPROF_EV_BEGIN = 2, CPROF_EV_END = 3 };
+
+struct cprof_trace_rec_t {
+  uint64_t t_ns;
+  uint32_t dst;
+  uint16_t phase;
+  uint8_t conv;
+  uint8_t kind;
+};
+
+struct pe_trace_t {
+  std::vector<cprof_trace_rec_t> recs;
+  std::vector<std::string> phases;
+  std::vector<std::string> convs;
+  std::vector<uint32_t> item_size;
+};
+
+struct options_t {
+  std::string prefix;
+  bool two_d = false;
+  int64_t buffer = 65536;
+  int64_t item_bytes = 0;           /* 0 keeps the traced sizes */
+  int64_t header = 16;
+  bool flush_advance = false;
+  double latency = 2.0e-6;
+  double bw = 100.0e9;              /* bytes/s per node */
+  double intra_latency = 0.3e-6;
+  double intra_bw = 20.0e9;         /* bytes/s per PE */
+  double overhead = 0.5e-6;
+  int64_t ppn = 0;                  /* 0 takes the traced PEs per node */
+  const char *csv = NULL;
+};
+
+static bool read_string(FILE *fp, std::string &s) {
+  uint16_t len;
+  if (fread(&len, 2, 1, fp) != 1)
+    return false;
+  s.resize(len);
+  return len == 0 || fread(&s[0], 1, len, fp) == len;
+}
+
+/* one PE's trace; npes and ppn come from its header */
+static bool read_trace(const std::string &path, pe_trace_t &t, int64_t *npes, int64_t *ppn) {
+  FILE *fp = fopen(path.c_str(), "rb");
+  if (fp == NULL)
+    return false;
+  char h[64];
+  bool ok = fread(h, sizeof(h), 1, fp) == 1 && memcmp(h, "CPTRACE1", 8) == 0;
+  uint32_t ids[4];
+  uint64_t nrecs = 0, footer = 0;
+  if (ok) {
+    memcpy(ids, h + 8, sizeof(ids));
+    memcpy(&nrecs, h + 24, 8);
+    memcpy(&footer, h + 32, 8);
+    *npes = ids[1];
+    *ppn = ids[2] > 0 ? ids[2] : 1;
+    t.recs.resize(nrecs);
+    ok = nrecs == 0 || fread(t.recs.data(), sizeof(cprof_trace_rec_t), nrecs, fp) == nrecs;
+  }
+  uint32_t n = 0;
+  ok = ok && fseek(fp, (long)footer, SEEK_SET) == 0 && fread(&n, 4, 1, fp) == 1;
+  t.phases.resize(ok ? n : 0);
+  for (uint32_t k = 0; ok && k < n; k++)
+    ok = read_string(fp, t.phases[k]);
+  ok = ok && fread(&n, 4, 1, fp) == 1;
+  t.convs.resize(ok ? n : 0);
+  t.item_size.resize(ok ? n : 0);
+  for (uint32_t k = 0; ok && k < n; k++)
+    ok = fread(&t.item_size[k], 4, 1, fp) == 1 && read_string(fp, t.convs[k]);
+  fclose(fp);
+  return ok;
+}
+
+/* what the replay counts for one (phase, conveyor) */
+struct traffic_t {
+  int64_t items = 0;
+  int64_t msgs_intra = 0, msgs_inter = 0;
+  double bytes_intra = 0.0, bytes_inter = 0.0;
+};
+
+/* one pass through a phase: from the first begin to the last end or delivery */
+struct pass_t {
+  double begin = 1e300, end = 0.0;   /* traced */
+  double last = 0.0;                  /* predicted: last delivery or push */
+};
+
+/* an item waiting at a relay for the network hop */
+struct relay_item_t {
+  uint32_t dst;
+  uint32_t bytes;
+};
+
+struct buffer_t {
+  int64_t bytes = 0;
+  int64_t items = 0;
+  int phase = 0, pass = 0;
+  double last_t = 0.0;
+  std::vector<relay_item_t> relay;   /* items that still need the network hop */
+};
+
+class Replay {
+ public:
+  Replay(const options_t &opt, std::vector<pe_trace_t> &pes, int64_t ppn)
+    : opt_(opt), pes_(pes), npes_(pes.size()), ppn_(ppn),
+      nic_free_((pes.size() + ppn - 1) / ppn, 0.0), pe_free_(pes.size(), 0.0),
+      occupied_(pes.size(), 0), peak_(pes.size(), 0), pass_of_(pes.size()) {
+    const pe_trace_t &p0 = pes[0];
+    nconv_ = p0.convs.size();
+    traffic_.resize(p0.phases.size() * (nconv_ > 0 ? nconv_ : 1));
+    passes_.resize(p0.phases.size());
+    done_at_.assign(npes_ * (nconv_ > 0 ? nconv_ : 1), -1.0);
+    for (int64_t pe = 0; pe < npes_; pe++)
+      pass_of_[pe].assign(p0.phases.size(), -1);
+  }
+
+  void run() {
+    struct ev_t {
+      double t;
+      int64_t pe;
+      int64_t idx;     /* record index, or -1 - relay message for an arrival */
+      bool operator>(const ev_t &o) const { return t > o.t; }
+    };
+    std::priority_queue<ev_t, std::vector<ev_t>, std::greater<ev_t> > q;
+    std::vector<size_t> next(npes_, 0);
+    for (int64_t pe = 0; pe < npes_; pe++)
+      if (!pes_[pe].recs.empty())
+        q.push(ev_t{pes_[pe].recs[0].t_ns * 1.0e-9, pe, 0});
+
+    while (!q.empty()) {
+      ev_t e = q.top();
+      q.pop();
+      if (e.idx < 0) {
+        arrive(e.t, e.pe, -1 - e.idx);
+      } else {
+        record(e.t, e.pe, pes_[e.pe].recs[e.idx]);
+        if (++next[e.pe] < pes_[e.pe].recs.size())
+          q.push(ev_t{pes_[e.pe].recs[next[e.pe]].t_ns * 1.0e-9, e.pe, (int64_t)next[e.pe]});
+      }
+      for (size_t k = 0; k < arrivals_.size(); k++)
+        q.push(ev_t{arrivals_[k].first, arrivals_[k].second.first, -1 - arrivals_[k].second.second});
+      arrivals_.clear();
+    }
+
+    // what is left: partial buffers nobody flushed, sent when their PE was done
+    // with the conveyor or when their last item came, whichever is later
+    for (int round = 0; round < 2 && !buffers_.empty(); round++) {
+      std::vector<std::pair<uint64_t, double> > left;
+      for (auto &b : buffers_) {
+        int64_t conv = b.first / ((uint64_t)npes_ * npes_);
+        int64_t pe = (b.first / npes_) % npes_;
+        left.push_back(std::make_pair(b.first, std::max(b.second.last_t, done_at_[pe * nconv_ + conv])));
+      }
+      std::sort(left.begin(), left.end(),
+                [](const std::pair<uint64_t, double> &a, const std::pair<uint64_t, double> &b) {
+                  return a.second < b.second;
+                });
+      for (size_t k = 0; k < left.size(); k++)
+        if (buffers_.count(left[k].first))
+          send(left[k].second, left[k].first);
+      // relay messages sent above arrive now and may leave partial buffers of their own
+      for (size_t k = 0; k < arrivals_.size(); k++)
+        arrive(arrivals_[k].first, arrivals_[k].second.first, arrivals_[k].second.second);
+      arrivals_.clear();
+    }
+  }
+
+  void report(FILE *out) const {
+    const pe_trace_t &p0 = pes_[0];
+    int64_t pushes = 0;
+    for (size_t k = 0; k < traffic_.size(); k++)
+      pushes += traffic_[k].items;
+    int64_t peak_max = 0;
+    double peak_sum = 0.0;
+    for (int64_t pe = 0; pe < npes_; pe++) {
+      peak_max = std::max(peak_max, peak_[pe]);
+      peak_sum += peak_[pe];
+    }
+    fprintf(out, "%ld PEs, %ld per node, %ld pushes; %s, buffer %ld B, item bytes %s, header %ld B, flush %s\n",
+            npes_, ppn_, pushes, opt_.two_d ? "2d" : "direct", opt_.buffer,
+            opt_.item_bytes > 0 ? std::to_string(opt_.item_bytes).c_str() : "as traced",
+            opt_.header, opt_.flush_advance ? "advance" : "full");
+    fprintf(out, "network: %.2lf us %.1lf GB/s/node, on node %.2lf us %.1lf GB/s/PE, %.2lf us per message\n",
+            opt_.latency * 1e6, opt_.bw * 1e-9, opt_.intra_latency * 1e6, opt_.intra_bw * 1e-9,
+            opt_.overhead * 1e6);
+    fprintf(out, "buffered bytes per PE: peak max %.1lf KB, mean %.1lf KB\n",
+            peak_max * 1e-3, peak_sum / npes_ * 1e-3);
+
+    fprintf(out, "%-16s %-10s %12s %12s %12s %7s %7s\n", "phase", "conveyor", "items",
+            "msgs node", "msgs net", "fill%", "net MB");
+    for (size_t p = 0; p < p0.phases.size(); p++)
+      for (int64_t c = 0; c < nconv_; c++) {
+        const traffic_t &t = traffic_[p * nconv_ + c];
+        if (t.items == 0)
+          continue;
+        int64_t msgs = t.msgs_intra + t.msgs_inter;
+        double fill = msgs > 0 ? 100.0 * (t.bytes_intra + t.bytes_inter) / (msgs * (double)opt_.buffer) : 0.0;
+        fprintf(out, "%-16s %-10s %12ld %12ld %12ld %7.1lf %7.1lf\n", p0.phases[p].c_str(),
+                p0.convs[c].c_str(), t.items, t.msgs_intra, t.msgs_inter, fill, t.bytes_inter * 1e-6);
+      }
+
+    fprintf(out, "%-16s %7s %12s %12s %8s\n", "phase", "passes", "traced s", "predicted s", "ratio");
+    for (size_t p = 0; p < p0.phases.size(); p++) {
+      double traced = 0.0, predicted = 0.0;
+      for (size_t k = 0; k < passes_[p].size(); k++) {
+        const pass_t &ps = passes_[p][k];
+        traced += ps.end - ps.begin;
+        predicted += std::max(ps.last, ps.begin) - ps.begin;
+      }
+      if (passes_[p].empty())
+        continue;
+      fprintf(out, "%-16s %7zu %12.6lf %12.6lf %8.3lf\n", p0.phases[p].c_str(), passes_[p].size(),
+              traced, predicted, traced > 0.0 ? predicted / traced : 0.0);
+    }
+  }
+
+  void write_csv(const char *path) const {
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) {
+      fprintf(stderr, "ERROR: can't open %s\n", path);
+      return;
+    }
+    const pe_trace_t &p0 = pes_[0];
+    fprintf(fp, "phase,conveyor,topology,buffer,item_bytes,header,flush,items,msgs_node,msgs_net,"
+                "bytes_node,bytes_net,traced_s,predicted_s\n");
+    for (size_t p = 0; p < p0.phases.size(); p++) {
+      double traced = 0.0, predicted = 0.0;
+      for (size_t k = 0; k < passes_[p].size(); k++) {
+        traced += passes_[p][k].end - passes_[p][k].begin;
+        predicted += std::max(passes_[p][k].last, passes_[p][k].begin) - passes_[p][k].begin;
+      }
+      for (int64_t c = 0; c < nconv_; c++) {
+        const traffic_t &t = traffic_[p * nconv_ + c];
+        if (t.items == 0)
+          continue;
+        fprintf(fp, "%s,%s,%s,%ld,%ld,%ld,%s,%ld,%ld,%ld,%.0lf,%.0lf,%.9lf,%.9lf\n", p0.phases[p].c_str(),
+                p0.convs[c].c_str(), opt_.two_d ? "2d" : "direct", opt_.buffer, opt_.item_bytes,
+                opt_.header, opt_.flush_advance ? "advance" : "full", t.items, t.msgs_intra,
+                t.msgs_inter, t.bytes_intra, t.bytes_inter, traced, predicted);
+      }
+    }
+    fclose(fp);
+  }
+
+ private:
+  int64_t node(int64_t pe) const { return pe / ppn_; }
+
+  uint64_t key(int64_t conv, int64_t pe, int64_t to) const {
+    return ((uint64_t)conv * npes_ + pe) * npes_ + to;
+  }
+
+  /* the first hop from pe toward dst */
+  int64_t next_hop(int64_t pe, int64_t dst) const {
+    if (!opt_.two_d || node(pe) == node(dst))
+      return dst;
+    int64_t relay = node(pe) * ppn_ + dst % ppn_;
+    return relay < npes_ ? relay : dst;
+  }
+
+  int64_t item_bytes(int64_t conv) const {
+    return opt_.item_bytes > 0 ? opt_.item_bytes : pes_[0].item_size[conv];
+  }
+
+  pass_t& pass(int phase, int k) {
+    if ((int)passes_[phase].size() <= k)
+      passes_[phase].resize(k + 1);
+    return passes_[phase][k];
+  }
+
+  void record(double t, int64_t pe, const cprof_trace_rec_t &r) {
+    if (r.phase >= passes_.size() || (r.kind <= CPROF_EV_ADVANCE && r.conv >= nconv_) ||
+        (r.kind == CPROF_EV_PUSH && r.dst >= npes_))
+      return;   // names PE 0 does not have; the PEs did not trace the same program
+    switch (r.kind) {
+    case CPROF_EV_BEGIN: {
+      pass_t &ps = pass(r.phase, ++pass_of_[pe][r.phase]);
+      ps.begin = std::min(ps.begin, t);
+      break;
+    }
+    case CPROF_EV_END: {
+      pass_t &ps = pass(r.phase, std::max(pass_of_[pe][r.phase], 0));
+      ps.end = std::max(ps.end, t);
+      break;
+    }
+    case CPROF_EV_PUSH: {
+      int k = std::max(pass_of_[pe][r.phase], 0);
+      pass_t &ps = pass(r.phase, k);
+      ps.last = std::max(ps.last, t);
+      traffic_[r.phase * nconv_ + r.conv].items++;
+      append(t, r.conv, pe, r.dst, r.phase, k);
+      break;
+    }
+    case CPROF_EV_ADVANCE:
+      if (r.dst && done_at_[pe * nconv_ + r.conv] < 0.0)
+        done_at_[pe * nconv_ + r.conv] = t;
+      if (opt_.flush_advance || r.dst)
+        flush(t, r.conv, pe);
+      break;
+    }
+  }
+
+  void append(double t, int64_t conv, int64_t pe, int64_t dst, int phase, int k) {
+    int64_t to = next_hop(pe, dst);
+    uint64_t bk = key(conv, pe, to);
+    buffer_t &b = buffers_[bk];
+    if (b.items == 0) {
+      b.phase = phase;
+      b.pass = k;
+    }
+    int64_t size = item_bytes(conv);
+    b.bytes += size;
+    b.items++;
+    b.last_t = t;
+    if (to != dst)
+      b.relay.push_back(relay_item_t{(uint32_t)dst, (uint32_t)size});
+    occupied_[pe] += size;
+    peak_[pe] = std::max(peak_[pe], occupied_[pe]);
+    if (b.bytes + size > opt_.buffer)
+      send(t, bk);
+  }
+
+  /* send every partial buffer of pe on conv */
+  void flush(double t, int64_t conv, int64_t pe) {
+    std::vector<uint64_t> keys;
+    uint64_t lo = key(conv, pe, 0), hi = key(conv, pe, npes_ - 1);
+    if (buffers_.size() < (size_t)npes_) {
+      for (auto &b : buffers_)
+        if (b.first >= lo && b.first <= hi)
+          keys.push_back(b.first);
+    } else {
+      for (int64_t to = 0; to < npes_; to++)
+        if (buffers_.count(key(conv, pe, to)))
+          keys.push_back(key(conv, pe, to));
+    }
+    for (size_t k = 0; k < keys.size(); k++)
+      send(t, keys[k]);
+  }
+
+  void send(double t, uint64_t bk) {
+    buffer_t &b = buffers_[bk];
+    int64_t conv = bk / ((uint64_t)npes_ * npes_);
+    int64_t pe = (bk / npes_) % npes_;
+    int64_t to = bk % npes_;
+    double bytes = b.bytes + opt_.header;
+    traffic_t &tr = traffic_[b.phase * nconv_ + conv];
+    double arrive;
+    if (node(pe) == node(to)) {
+      double start = std::max(t + opt_.overhead, pe_free_[pe]);
+      pe_free_[pe] = start + bytes / opt_.intra_bw;
+      arrive = pe_free_[pe] + opt_.intra_latency;
+      tr.msgs_intra++;
+      tr.bytes_intra += bytes;
+    } else {
+      double &nic = nic_free_[node(pe)];
+      double start = std::max(t + opt_.overhead, nic);
+      nic = start + bytes / opt_.bw;
+      arrive = nic + opt_.latency;
+      tr.msgs_inter++;
+      tr.bytes_inter += bytes;
+    }
+    pass_t &ps = pass(b.phase, b.pass);
+    ps.last = std::max(ps.last, arrive);
+    occupied_[pe] -= b.bytes;
+
+    if (!b.relay.empty()) {
+      relay_msg_t m;
+      m.conv = conv;
+      m.phase = b.phase;
+      m.pass = b.pass;
+      m.items.swap(b.relay);
+      relay_msgs_.push_back(m);
+      arrivals_.push_back(std::make_pair(arrive, std::make_pair(to, (int64_t)relay_msgs_.size() - 1)));
+    }
+    buffers_.erase(bk);
+  }
+
+  /* a relay message reaches pe, which buffers its items for the network hop */
+  void arrive(double t, int64_t pe, int64_t m) {
+    relay_msg_t msg;
+    std::swap(msg, relay_msgs_[m]);
+    for (size_t k = 0; k < msg.items.size(); k++) {
+      int64_t dst = msg.items[k].dst;
+      uint64_t bk = key(msg.conv, pe, dst);
+      buffer_t &b = buffers_[bk];
+      if (b.items == 0) {
+        b.phase = msg.phase;
+        b.pass = msg.pass;
+      }
+      b.bytes += msg.items[k].bytes;
+      b.items++;
+      b.last_t = t;
+      occupied_[pe] += msg.items[k].bytes;
+      peak_[pe] = std::max(peak_[pe], occupied_[pe]);
+      if (b.bytes + msg.items[k].bytes > opt_.buffer)
+        send(t, bk);
+    }
+    // a relay that is already done with the conveyor forwards at once
+    if (opt_.flush_advance || done_at_[pe * nconv_ + msg.conv] >= 0.0)
+      for (size_t k = 0; k < msg.items.size(); k++)
+        if (buffers_.count(key(msg.conv, pe, msg.items[k].dst)))
+          send(t, key(msg.conv, pe, msg.items[k].dst));
+  }
+
+  struct relay_msg_t {
+    int64_t conv = 0;
+    int phase = 0, pass = 0;
+    std::vector<relay_item_t> items;
+  };
+
+  const options_t &opt_;
+  std::vector<pe_trace_t> &pes_;
+  int64_t npes_, ppn_, nconv_;
+  std::vector<double> nic_free_, pe_free_;
+  std::vector<int64_t> occupied_, peak_;
+  std::vector<std::vector<int> > pass_of_;     /* the current pass of each PE through each phase */
+  std::vector<double> done_at_;               /* when each PE said done to each conveyor */
+  std::vector<traffic_t> traffic_;
+  std::vector<std::vector<pass_t> > passes_;
+  std::unordered_map<uint64_t, buffer_t> buffers_;
+  std::vector<relay_msg_t> relay_msgs_;
+  std::vector<std::pair<double, std::pair<int64_t, int64_t> > > arrivals_;
+};
+
+static void usage() {
+  fprintf(stderr,
+          "usage: convey_replay --trace prefix [--topology direct|2d] [--buffer bytes]\n"
+          "         [--item-bytes n] [--header bytes] [--flush full|advance]\n"
+          "         [--latency us] [--bw GB/s/node] [--intra-latency us] [--intra-bw GB/s/PE]\n"
+          "         [--overhead us] [--pes-per-node n] [--csv file]\n");
+}
+
+int main(int argc, char *argv[]) {
+  options_t opt;
+  for (int i = 1; i < argc; i++) {
+    std::string a = argv[i];
+    if (i + 1 >= argc) {
+      usage();
+      return 1;
+    }
+    const char *v = argv[++i];
+    if (a == "--trace") opt.prefix = v;
+    else if (a == "--topology") opt.two_d = std::string(v) == "2d";
+    else if (a == "--buffer") opt.buffer = atoll(v);
+    else if (a == "--item-bytes") opt.item_bytes = atoll(v);
+    else if (a == "--header") opt.header = atoll(v);
+    else if (a == "--flush") opt.flush_advance = std::string(v) == "advance";
+    else if (a == "--latency") opt.latency = atof(v) * 1e-6;
+    else if (a == "--bw") opt.bw = atof(v) * 1e9;
+    else if (a == "--intra-latency") opt.intra_latency = atof(v) * 1e-6;
+    else if (a == "--intra-bw") opt.intra_bw = atof(v) * 1e9;
+    else if (a == "--overhead") opt.overhead = atof(v) * 1e-6;
+    else if (a == "--pes-per-node") opt.ppn = atoll(v);
+    else if (a == "--csv") opt.csv = v;
+    else {
+      usage();
+      return 1;
+    }
+  }
+  if (opt.prefix.empty() || opt.buffer <= 0) {
+    usage();
+    return 1;
+  }
+
+  std::vector<pe_trace_t> pes(1);
+  int64_t npes = 0, ppn = 1;
+  if (!read_trace(opt.prefix + ".0.trace", pes[0], &npes, &ppn) || npes < 1) {
+    fprintf(stderr, "ERROR: can't read %s.0.trace\n", opt.prefix.c_str());
+    return 1;
+  }
+  pes.resize(npes);
+  for (int64_t pe = 1; pe < npes; pe++) {
+    int64_t n, p;
+    std::string path = opt.prefix + "." + std::to_string(pe) + ".trace";
+    if (!read_trace(path, pes[pe], &n, &p) || n != npes) {
+      fprintf(stderr, "ERROR: can't read %s\n", path.c_str());
+      return 1;
+    }
+  }
+  if (opt.ppn > 0)
+    ppn = opt.ppn;
+
+  Replay replay(opt, pes, ppn);
+  replay.run();
+  replay.report(stdout);
+  if (opt.csv)
+    replay.write_csv(opt.csv);
+  return 0;
+}
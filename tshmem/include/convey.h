@@ -0,0 +1,55 @@
+/*! \file convey.h
+ * \brief Threaded stand-in for the bale conveyor API.
+ *
+ * A conveyor is a matrix of lock-free single-producer/single-consumer rings,
+ * one per (source, destination) pair. convey_push() appends to the ring of
+ * the destination, convey_pull() drains the rings addressed to this PE, and
+ * convey_advance() only tracks termination.
+ */
+#ifndef TSHMEM_CONVEY_H
+#define TSHMEM_CONVEY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct convey convey_t;
+
+enum convey_error {
+  convey_OK = 0,
+  convey_FAIL = -1,
+  convey_error_ALLOC = -2,
+  convey_error_STATE = -3,
+  convey_error_RANGE = -4,
+  convey_NEAR = -5,
+};
+
+enum convey_option {
+  convey_opt_RECKLESS = 0x1,
+  convey_opt_PROGRESS = 0x2,
+  convey_opt_SCATTER  = 0x4,
+  convey_opt_ALERT    = 0x8,
+  convey_opt_DYNAMIC  = 0x10,
+  convey_opt_QUIET    = 0x20,
+};
+
+typedef struct convey_alc8r convey_alc8r_t;
+convey_t* convey_new(size_t max_bytes, size_t n_local, const convey_alc8r_t* alloc, uint64_t options);
+int   convey_begin(convey_t* c, size_t item_size, size_t align);
+bool  convey_push(convey_t* c, const void* item, int64_t pe);
+int   convey_pull(convey_t* c, void* item, int64_t* from);
+void* convey_apull(convey_t* c, int64_t* from);
+int   convey_unpull(convey_t* c);
+bool  convey_advance(convey_t* c, bool done);
+int   convey_reset(convey_t* c);
+int   convey_free(convey_t* c);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TSHMEM_CONVEY_H */
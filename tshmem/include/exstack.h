@@ -0,0 +1,42 @@
+/*! \file exstack.h
+ * \brief Threaded stand-in for bale's exstack (bulk-synchronous) and exstack2
+ * (asynchronous) aggregation libraries.
+ */
+#ifndef TSHMEM_EXSTACK_H
+#define TSHMEM_EXSTACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct exstack exstack_t;
+typedef struct exstack2 exstack2_t;
+
+exstack_t* exstack_init(int64_t buf_cnt, size_t pkg_size);
+int64_t exstack_push(exstack_t* Xstk, void* push_item, int64_t pe);
+int64_t exstack_pop(exstack_t* Xstk, void* pop_item, int64_t* from);
+int64_t exstack_pop_thread(exstack_t* Xstk, void* pop_item, int64_t pe);
+void    exstack_unpop(exstack_t* Xstk);
+void    exstack_exchange(exstack_t* Xstk);
+int64_t exstack_proceed(exstack_t* Xstk, int done_pushing);
+void    exstack_reset(exstack_t* Xstk);
+void    exstack_clear(exstack_t* Xstk);
+void    exstack_free(exstack_t* Xstk);
+
+exstack2_t* exstack2_init(int64_t buf_cnt, size_t pkg_size);
+int64_t exstack2_push(exstack2_t* Xstk2, void* push_item, int64_t pe);
+int64_t exstack2_pop(exstack2_t* Xstk2, void* pop_item, int64_t* from);
+void    exstack2_unpop(exstack2_t* Xstk2);
+int64_t exstack2_proceed(exstack2_t* Xstk2, int im_done);
+void    exstack2_reset(exstack2_t* Xstk2);
+void    exstack2_clear(exstack2_t* Xstk2);
+void    exstack2_free(exstack2_t* Xstk2);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TSHMEM_EXSTACK_H */
@@ -0,0 +1,57 @@
+/*! \file libgetput.h
+ * \brief Threaded stand-in for bale's libgetput (lgp_*) layer, on top of the
+ * threaded shmem.h in this directory.
+ */
+#ifndef TSHMEM_LIBGETPUT_H
+#define TSHMEM_LIBGETPUT_H
+
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <shmem.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define THREADS shmem_n_pes()
+#define MYTHREAD shmem_my_pe()
+
+typedef struct minavgmaxL_t { int64_t min; int64_t avg; int64_t max; } minavgmaxL_t;
+typedef struct minavgmaxD_t { double min; double avg; double max; } minavgmaxD_t;
+
+#define lgp_local_part(t, p) ((t*)(p))
+
+void    lgp_init(int argc, char* argv[]);
+void    lgp_finalize(void);
+void    lgp_global_exit(int status);
+void    lgp_barrier(void);
+void*   lgp_all_alloc(size_t num, size_t size);
+void    lgp_all_free(void* ptr);
+double  wall_seconds(void);
+int     T0_fprintf(FILE* stream, const char* fmt, ...);
+int     T0_printf(const char* fmt, ...);
+
+int64_t lgp_get_int64(int64_t* p, int64_t index);
+void    lgp_put_int64(int64_t* p, int64_t index, int64_t val);
+void    lgp_atomic_add(int64_t* p, int64_t index, int64_t val);
+int64_t lgp_fetch_and_add(int64_t* p, int64_t index, int64_t val);
+int64_t lgp_fetch_and_inc(int64_t* p, int64_t index);
+
+int64_t lgp_reduce_add_l(int64_t myval);
+int64_t lgp_reduce_min_l(int64_t myval);
+int64_t lgp_reduce_max_l(int64_t myval);
+double  lgp_reduce_add_d(double myval);
+double  lgp_reduce_min_d(double myval);
+double  lgp_reduce_max_d(double myval);
+int64_t lgp_min_avg_max_l(minavgmaxL_t* s, int64_t myval, int64_t dem);
+int64_t lgp_min_avg_max_d(minavgmaxD_t* s, double myval, int64_t dem);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TSHMEM_LIBGETPUT_H */
@@ -0,0 +1,211 @@
+/*! \file shmem.h
+ * \brief Threaded shared-memory stand-in for OpenSHMEM 1.5.
+ *
+ * Every PE is a thread of one process. Symmetric allocations come from
+ * per-PE heaps that are carved identically on every PE, so a remote
+ * address is just the same offset in the peer's heap. Only the subset of
+ * the API used by the kernels in this repository is provided.
+ */
+#ifndef TSHMEM_SHMEM_H
+#define TSHMEM_SHMEM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <unistd.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SHMEM_MAJOR_VERSION 1
+#define SHMEM_MINOR_VERSION 5
+#define TSHMEM 1
+
+#define SHMEM_THREAD_SINGLE     0
+#define SHMEM_THREAD_FUNNELED   1
+#define SHMEM_THREAD_SERIALIZED 2
+#define SHMEM_THREAD_MULTIPLE   3
+
+#define SHMEM_CTX_PRIVATE    (1L << 0)
+#define SHMEM_CTX_SERIALIZED (1L << 1)
+#define SHMEM_CTX_NOSTORE    (1L << 2)
+
+#define SHMEM_CMP_EQ 0
+#define SHMEM_CMP_NE 1
+#define SHMEM_CMP_GT 2
+#define SHMEM_CMP_GE 3
+#define SHMEM_CMP_LT 4
+#define SHMEM_CMP_LE 5
+
+typedef struct tshmem_team* shmem_team_t;
+typedef struct tshmem_ctx* shmem_ctx_t;
+
+typedef struct {
+  int num_contexts;
+} shmem_team_config_t;
+
+extern shmem_team_t SHMEM_TEAM_WORLD;
+extern shmem_team_t SHMEM_TEAM_SHARED;
+#define SHMEM_TEAM_INVALID ((shmem_team_t) 0)
+extern shmem_ctx_t SHMEM_CTX_DEFAULT;
+#define SHMEM_CTX_INVALID ((shmem_ctx_t) 0)
+
+/* setup */
+void shmem_init(void);
+int  shmem_init_thread(int requested, int* provided);
+void shmem_query_thread(int* provided);
+void shmem_finalize(void);
+void shmem_global_exit(int status);
+int  shmem_my_pe(void);
+int  shmem_n_pes(void);
+int  shmem_pe_accessible(int pe);
+int  shmem_addr_accessible(const void* addr, int pe);
+void* shmem_ptr(const void* dest, int pe);
+
+/* symmetric heap */
+void* shmem_malloc(size_t size);
+void* shmem_calloc(size_t count, size_t size);
+void* shmem_align(size_t alignment, size_t size);
+void  shmem_free(void* ptr);
+
+/* RMA */
+void shmem_putmem(void* dest, const void* source, size_t nelems, int pe);
+void shmem_getmem(void* dest, const void* source, size_t nelems, int pe);
+void shmem_putmem_nbi(void* dest, const void* source, size_t nelems, int pe);
+void shmem_getmem_nbi(void* dest, const void* source, size_t nelems, int pe);
+
+#define TSHMEM_DECL_RMA(NAME, T)                                             \
+  void   shmem_##NAME##_put(T* dest, const T* src, size_t n, int pe);        \
+  void   shmem_##NAME##_get(T* dest, const T* src, size_t n, int pe);        \
+  void   shmem_##NAME##_put_nbi(T* dest, const T* src, size_t n, int pe);    \
+  void   shmem_##NAME##_get_nbi(T* dest, const T* src, size_t n, int pe);    \
+  void   shmem_##NAME##_p(T* dest, T value, int pe);                         \
+  T      shmem_##NAME##_g(const T* src, int pe);                             \
+  void   shmem_##NAME##_iput(T* dest, const T* src, ptrdiff_t dst,           \
+                             ptrdiff_t sst, size_t n, int pe);               \
+  void   shmem_##NAME##_iget(T* dest, const T* src, ptrdiff_t dst,           \
+                             ptrdiff_t sst, size_t n, int pe);               \
+  void   shmem_ctx_##NAME##_put_nbi(shmem_ctx_t ctx, T* dest, const T* src,  \
+                                    size_t n, int pe);                       \
+  void   shmem_ctx_##NAME##_get_nbi(shmem_ctx_t ctx, T* dest, const T* src,  \
+                                    size_t n, int pe);                       \
+  void   shmem_ctx_##NAME##_p(shmem_ctx_t ctx, T* dest, T value, int pe);    \
+  T      shmem_ctx_##NAME##_g(shmem_ctx_t ctx, const T* src, int pe);
+
+TSHMEM_DECL_RMA(char, char)
+TSHMEM_DECL_RMA(int, int)
+TSHMEM_DECL_RMA(long, long)
+TSHMEM_DECL_RMA(longlong, long long)
+TSHMEM_DECL_RMA(int64, int64_t)
+TSHMEM_DECL_RMA(uint64, uint64_t)
+TSHMEM_DECL_RMA(double, double)
+
+/* atomics */
+#define TSHMEM_DECL_AMO(NAME, T)                                                 \
+  T    shmem_##NAME##_atomic_fetch(const T* src, int pe);                        \
+  void shmem_##NAME##_atomic_set(T* dest, T value, int pe);                      \
+  T    shmem_##NAME##_atomic_swap(T* dest, T value, int pe);                     \
+  T    shmem_##NAME##_atomic_compare_swap(T* dest, T cond, T value, int pe);     \
+  T    shmem_##NAME##_atomic_fetch_add(T* dest, T value, int pe);                \
+  T    shmem_##NAME##_atomic_fetch_inc(T* dest, int pe);                         \
+  void shmem_##NAME##_atomic_add(T* dest, T value, int pe);                      \
+  void shmem_##NAME##_atomic_inc(T* dest, int pe);                               \
+  void shmem_ctx_##NAME##_atomic_add(shmem_ctx_t ctx, T* dest, T value, int pe); \
+  T    shmem_ctx_##NAME##_atomic_fetch_add(shmem_ctx_t ctx, T* dest, T value,    \
+                                           int pe);                              \
+  void shmem_##NAME##_wait_until(T* ivar, int cmp, T value);
+
+TSHMEM_DECL_AMO(int, int)
+TSHMEM_DECL_AMO(long, long)
+TSHMEM_DECL_AMO(int64, int64_t)
+TSHMEM_DECL_AMO(uint64, uint64_t)
+
+/* ordering and synchronization */
+void shmem_quiet(void);
+void shmem_fence(void);
+void shmem_barrier_all(void);
+void shmem_sync_all(void);
+
+/* contexts */
+int  shmem_ctx_create(long options, shmem_ctx_t* ctx);
+int  shmem_team_create_ctx(shmem_team_t team, long options, shmem_ctx_t* ctx);
+void shmem_ctx_destroy(shmem_ctx_t ctx);
+void shmem_ctx_quiet(shmem_ctx_t ctx);
+void shmem_ctx_fence(shmem_ctx_t ctx);
+void shmem_ctx_putmem(shmem_ctx_t ctx, void* dest, const void* src, size_t n, int pe);
+void shmem_ctx_getmem(shmem_ctx_t ctx, void* dest, const void* src, size_t n, int pe);
+void shmem_ctx_putmem_nbi(shmem_ctx_t ctx, void* dest, const void* src, size_t n, int pe);
+void shmem_ctx_getmem_nbi(shmem_ctx_t ctx, void* dest, const void* src, size_t n, int pe);
+
+/* teams */
+int  shmem_team_my_pe(shmem_team_t team);
+int  shmem_team_n_pes(shmem_team_t team);
+int  shmem_team_translate_pe(shmem_team_t src_team, int src_pe, shmem_team_t dest_team);
+int  shmem_team_split_strided(shmem_team_t parent, int start, int stride, int size,
+                              const shmem_team_config_t* config, long config_mask,
+                              shmem_team_t* new_team);
+int  shmem_team_split_2d(shmem_team_t parent, int xrange,
+                         const shmem_team_config_t* xaxis_config, long xaxis_mask,
+                         shmem_team_t* xaxis_team,
+                         const shmem_team_config_t* yaxis_config, long yaxis_mask,
+                         shmem_team_t* yaxis_team);
+void shmem_team_destroy(shmem_team_t team);
+int  shmem_team_sync(shmem_team_t team);
+
+#define SHMEM_MAX_NAME_LEN 256
+void shmem_info_get_version(int* major, int* minor);
+void shmem_info_get_name(char* name);
+
+/* collectives */
+int shmem_broadcastmem(shmem_team_t team, void* dest, const void* source, size_t nelems, int pe_root);
+int shmem_collectmem(shmem_team_t team, void* dest, const void* source, size_t nelems);
+int shmem_fcollectmem(shmem_team_t team, void* dest, const void* source, size_t nelems);
+int shmem_alltoallmem(shmem_team_t team, void* dest, const void* source, size_t nelems);
+
+#define TSHMEM_DECL_REDUCE(NAME, T)                                                     \
+  int shmem_##NAME##_sum_reduce(shmem_team_t team, T* dest, const T* src, size_t n);    \
+  int shmem_##NAME##_max_reduce(shmem_team_t team, T* dest, const T* src, size_t n);    \
+  int shmem_##NAME##_min_reduce(shmem_team_t team, T* dest, const T* src, size_t n);
+
+#define TSHMEM_DECL_BITWISE(NAME, T)                                                    \
+  int shmem_##NAME##_and_reduce(shmem_team_t team, T* dest, const T* src, size_t n);    \
+  int shmem_##NAME##_or_reduce(shmem_team_t team, T* dest, const T* src, size_t n);
+
+TSHMEM_DECL_REDUCE(int, int)
+TSHMEM_DECL_REDUCE(long, long)
+TSHMEM_DECL_REDUCE(longlong, long long)
+TSHMEM_DECL_REDUCE(int64, int64_t)
+TSHMEM_DECL_REDUCE(uint64, uint64_t)
+TSHMEM_DECL_REDUCE(size, size_t)
+TSHMEM_DECL_REDUCE(double, double)
+TSHMEM_DECL_BITWISE(int8, int8_t)
+TSHMEM_DECL_BITWISE(int, int)
+TSHMEM_DECL_BITWISE(int64, int64_t)
+TSHMEM_DECL_BITWISE(uint64, uint64_t)
+
+/* thread-safe getopt for programs that parse their options per PE */
+int    tshmem_getopt(int argc, char* const argv[], const char* optstring);
+char** tshmem_optarg_ptr(void);
+int*   tshmem_optind_ptr(void);
+int*   tshmem_opterr_ptr(void);
+int*   tshmem_optopt_ptr(void);
+
+int tshmem_user_main(int argc, char* argv[]);
+
+#ifdef __cplusplus
+}
+#endif
+
+/* Each PE runs the program's main() on its own thread, so main is renamed
+ * and getopt's globals become per-thread. */
+#ifndef TSHMEM_RUNTIME
+#define main   tshmem_user_main
+#define getopt tshmem_getopt
+#define optarg (*tshmem_optarg_ptr())
+#define optind (*tshmem_optind_ptr())
+#define opterr (*tshmem_opterr_ptr())
+#define optopt (*tshmem_optopt_ptr())
+#endif
+
+#endif /* TSHMEM_SHMEM_H */
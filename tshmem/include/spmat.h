@@ -0,0 +1,11 @@
+/*! \file spmat.h
+ * \brief The kernels only need spmat.h for the libraries it pulls in.
+ */
+#ifndef TSHMEM_SPMAT_H
+#define TSHMEM_SPMAT_H
+
+#include <libgetput.h>
+#include <exstack.h>
+#include <convey.h>
+
+#endif /* TSHMEM_SPMAT_H */
@@ -0,0 +1,1092 @@
+/*! \file tshmem.cpp
+ * \brief Threaded shared-memory runtime behind include/{shmem,libgetput,convey,exstack}.h.
+ *
+ * One process, one thread per PE. The number of PEs comes from TSHMEM_NPES
+ * (default: the number of hardware threads) and the per-PE symmetric heap
+ * size from SHMEM_SYMMETRIC_SIZE (default 512M). Build a kernel against it with
+ *   c++ -O3 -pthread -Itshmem/include kernel.cpp tshmem/tshmem.cpp -ldl
+ */
+#define TSHMEM_RUNTIME 1
+
+#include <shmem.h>
+#include <libgetput.h>
+#include <convey.h>
+#include <exstack.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+
+namespace {
+
+int g_npes = 0;
+bool g_oversubscribed = false;
+thread_local int tl_pe = -1;
+
+[[noreturn]] void fatal(const char* msg) {
+  std::fprintf(stderr, "tshmem: PE %d: %s\n", tl_pe, msg);
+  std::abort();
+}
+
+inline void relax(unsigned& spins) {
+  if (++spins < 64 && !g_oversubscribed) {
+#if defined(__x86_64__)
+    __builtin_ia32_pause();
+#endif
+  } else {
+    sched_yield();
+  }
+}
+
+// Sense-reversing central barrier.
+struct Barrier {
+  int n = 0;
+  alignas(64) std::atomic<int> count{0};
+  alignas(64) std::atomic<unsigned> gen{0};
+
+  void wait() {
+    unsigned g = gen.load(std::memory_order_acquire);
+    if (count.fetch_add(1, std::memory_order_acq_rel) == n - 1) {
+      count.store(0, std::memory_order_relaxed);
+      gen.fetch_add(1, std::memory_order_release);
+    } else {
+      unsigned spins = 0;
+      while (gen.load(std::memory_order_acquire) == g) relax(spins);
+    }
+  }
+};
+
+// --------------------------------------------------------------------------
+// symmetric heaps
+
+struct Heap {
+  char* base = nullptr;
+  size_t size = 0;
+  std::map<size_t, size_t> free_;  // offset -> length
+  std::map<size_t, size_t> used_;  // offset -> length
+};
+
+std::vector<Heap> g_heaps;
+
+size_t parse_size(const char* s, size_t dflt) {
+  if (s == nullptr || *s == '\0') return dflt;
+  char* end = nullptr;
+  double v = std::strtod(s, &end);
+  switch (*end) {
+    case 'k': case 'K': v *= 1024.0; break;
+    case 'm': case 'M': v *= 1024.0 * 1024.0; break;
+    case 'g': case 'G': v *= 1024.0 * 1024.0 * 1024.0; break;
+    default: break;
+  }
+  return (size_t) v;
+}
+
+void* heap_alloc(Heap& h, size_t align, size_t size) {
+  if (size == 0) size = 1;
+  if (align < 64) align = 64;
+  size = (size + 63) & ~(size_t) 63;
+  for (auto it = h.free_.begin(); it != h.free_.end(); ++it) {
+    size_t off = it->first, len = it->second;
+    size_t aligned = (off + align - 1) & ~(align - 1);
+    if (aligned + size > off + len) continue;
+    h.free_.erase(it);
+    if (aligned > off) h.free_[off] = aligned - off;
+    if (aligned + size < off + len) h.free_[aligned + size] = off + len - aligned - size;
+    h.used_[aligned] = size;
+    return h.base + aligned;
+  }
+  return nullptr;
+}
+
+void heap_free(Heap& h, void* p) {
+  size_t off = (char*) p - h.base;
+  auto it = h.used_.find(off);
+  if (it == h.used_.end()) fatal("shmem_free of a pointer not from shmem_malloc");
+  size_t len = it->second;
+  h.used_.erase(it);
+  auto next = h.free_.lower_bound(off);
+  if (next != h.free_.end() && next->first == off + len) {
+    len += next->second;
+    h.free_.erase(next);
+  }
+  auto prev = h.free_.lower_bound(off);
+  if (prev != h.free_.begin()) {
+    --prev;
+    if (prev->first + prev->second == off) {
+      prev->second += len;
+      return;
+    }
+  }
+  h.free_[off] = len;
+}
+
+inline char* translate(const void* addr, int pe) {
+  const Heap& mine = g_heaps[tl_pe];
+  const char* a = (const char*) addr;
+  if (a < mine.base || a >= mine.base + mine.size) {
+    fatal("remote access to an address outside the symmetric heap");
+  }
+  if ((unsigned) pe >= (unsigned) g_npes) fatal("PE out of range");
+  return g_heaps[pe].base + (a - mine.base);
+}
+
+}  // namespace
+
+// --------------------------------------------------------------------------
+// teams
+
+struct tshmem_team {
+  std::vector<int> members;   // team PE -> world PE
+  std::vector<int> index;     // world PE -> team PE (or -1)
+  Barrier barrier;
+  std::vector<const void*> slots;
+  std::vector<void*> dslots;
+  std::vector<int> splits;    // per team PE, number of splits performed
+};
+
+struct tshmem_ctx {
+  int dummy;
+};
+
+shmem_team_t SHMEM_TEAM_WORLD = nullptr;
+shmem_team_t SHMEM_TEAM_SHARED = nullptr;
+static tshmem_ctx g_default_ctx;
+shmem_ctx_t SHMEM_CTX_DEFAULT = &g_default_ctx;
+
+namespace {
+
+std::mutex g_team_mutex;
+std::map<std::tuple<shmem_team_t, int, int>, tshmem_team*> g_team_registry;
+
+tshmem_team* make_team(const std::vector<int>& members) {
+  tshmem_team* t = new tshmem_team;
+  t->members = members;
+  t->index.assign(g_npes, -1);
+  for (size_t i = 0; i < members.size(); i++) t->index[members[i]] = (int) i;
+  t->barrier.n = (int) members.size();
+  t->slots.assign(members.size(), nullptr);
+  t->dslots.assign(members.size(), nullptr);
+  t->splits.assign(members.size(), 0);
+  return t;
+}
+
+inline int team_me(shmem_team_t t) { return t->index[tl_pe]; }
+
+// Run a collective over 'team': every member publishes 'src', then the
+// members read each other's buffers between two barriers.
+template<typename F>
+void team_exchange(shmem_team_t team, const void* src, void* dst, F body) {
+  int me = team_me(team);
+  team->slots[me] = src;
+  team->dslots[me] = dst;
+  team->barrier.wait();
+  body(me);
+  team->barrier.wait();
+}
+
+// Collectively create an object shared by all members of 'team'.
+template<typename T, typename F>
+T* team_shared_new(shmem_team_t team, F make) {
+  T* obj = nullptr;
+  int me = team_me(team);
+  if (me == 0) obj = make();
+  team->slots[me] = obj;
+  team->barrier.wait();
+  obj = (T*) team->slots[0];
+  team->barrier.wait();
+  return obj;
+}
+
+}  // namespace
+
+// --------------------------------------------------------------------------
+// program entry: one thread per PE
+
+namespace {
+
+using start_fn = void* (*)(void*);
+struct StartArgs {
+  start_fn fn;
+  void* arg;
+  int pe;
+};
+
+void* inherit_pe(void* p) {
+  StartArgs a = *(StartArgs*) p;
+  delete (StartArgs*) p;
+  tl_pe = a.pe;
+  return a.fn(a.arg);
+}
+
+}  // namespace
+
+// Threads spawned by a PE (helper, progress or sampler threads) act as that
+// PE, the same way threads of an OpenSHMEM process share its PE number.
+extern "C" int pthread_create(pthread_t* thread, const pthread_attr_t* attr,
+                              start_fn fn, void* arg) {
+  using real_fn = int (*)(pthread_t*, const pthread_attr_t*, start_fn, void*);
+  static real_fn real = (real_fn) dlsym(RTLD_NEXT, "pthread_create");
+  if (tl_pe < 0) return real(thread, attr, fn, arg);
+  return real(thread, attr, inherit_pe, new StartArgs{fn, arg, tl_pe});
+}
+
+int main(int argc, char* argv[]) {
+  const char* env = std::getenv("TSHMEM_NPES");
+  g_npes = env ? std::atoi(env) : (int) std::thread::hardware_concurrency();
+  if (g_npes < 1) g_npes = 1;
+  g_oversubscribed = g_npes > (int) std::thread::hardware_concurrency();
+
+  size_t heap_size = parse_size(std::getenv("SHMEM_SYMMETRIC_SIZE"), (size_t) 512 << 20);
+  g_heaps.resize(g_npes);
+  for (int pe = 0; pe < g_npes; pe++) {
+    void* p = mmap(nullptr, heap_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) fatal("cannot reserve the symmetric heap");
+    g_heaps[pe].base = (char*) p;
+    g_heaps[pe].size = heap_size;
+    g_heaps[pe].free_[0] = heap_size;
+  }
+
+  std::vector<int> world(g_npes);
+  for (int pe = 0; pe < g_npes; pe++) world[pe] = pe;
+  SHMEM_TEAM_WORLD = make_team(world);
+  SHMEM_TEAM_SHARED = SHMEM_TEAM_WORLD;
+
+  std::vector<int> rc(g_npes, 0);
+  std::vector<std::thread> threads;
+  for (int pe = 0; pe < g_npes; pe++) {
+    threads.emplace_back([&, pe]() {
+      tl_pe = pe;
+      // getopt may permute argv, so every PE gets its own copy
+      std::vector<char*> args(argv, argv + argc);
+      args.push_back(nullptr);
+      rc[pe] = tshmem_user_main(argc, args.data());
+    });
+  }
+  for (auto& t : threads) t.join();
+  for (int pe = 0; pe < g_npes; pe++)
+    if (rc[pe] != 0) return rc[pe];
+  return 0;
+}
+
+// --------------------------------------------------------------------------
+// setup
+
+extern "C" {
+
+void shmem_init(void) { shmem_barrier_all(); }
+int shmem_init_thread(int requested, int* provided) {
+  (void) requested;
+  if (provided) *provided = SHMEM_THREAD_MULTIPLE;
+  shmem_barrier_all();
+  return 0;
+}
+void shmem_query_thread(int* provided) { *provided = SHMEM_THREAD_MULTIPLE; }
+void shmem_finalize(void) { shmem_barrier_all(); }
+void shmem_global_exit(int status) { std::exit(status); }
+int shmem_my_pe(void) { return tl_pe; }
+int shmem_n_pes(void) { return g_npes; }
+void shmem_info_get_version(int* major, int* minor) { *major = 1; *minor = 5; }
+void shmem_info_get_name(char* name) { strcpy(name, "tshmem"); }
+int shmem_pe_accessible(int pe) { return pe >= 0 && pe < g_npes; }
+int shmem_addr_accessible(const void* addr, int pe) {
+  const Heap& mine = g_heaps[tl_pe];
+  const char* a = (const char*) addr;
+  return pe >= 0 && pe < g_npes && a >= mine.base && a < mine.base + mine.size;
+}
+void* shmem_ptr(const void* dest, int pe) {
+  return shmem_addr_accessible(dest, pe) ? translate(dest, pe) : nullptr;
+}
+
+// --------------------------------------------------------------------------
+// symmetric heap
+
+void* shmem_align(size_t alignment, size_t size) {
+  void* p = heap_alloc(g_heaps[tl_pe], alignment, size);
+  shmem_barrier_all();
+  return p;
+}
+void* shmem_malloc(size_t size) { return shmem_align(64, size); }
+void* shmem_calloc(size_t count, size_t size) {
+  void* p = heap_alloc(g_heaps[tl_pe], 64, count * size);
+  if (p) std::memset(p, 0, count * size);
+  shmem_barrier_all();
+  return p;
+}
+void shmem_free(void* ptr) {
+  shmem_barrier_all();
+  if (ptr) heap_free(g_heaps[tl_pe], ptr);
+}
+
+// --------------------------------------------------------------------------
+// RMA: all transfers complete immediately
+
+void shmem_putmem(void* dest, const void* src, size_t n, int pe) {
+  std::memcpy(translate(dest, pe), src, n);
+}
+void shmem_getmem(void* dest, const void* src, size_t n, int pe) {
+  std::memcpy(dest, translate(src, pe), n);
+}
+void shmem_putmem_nbi(void* dest, const void* src, size_t n, int pe) { shmem_putmem(dest, src, n, pe); }
+void shmem_getmem_nbi(void* dest, const void* src, size_t n, int pe) { shmem_getmem(dest, src, n, pe); }
+void shmem_ctx_putmem(shmem_ctx_t, void* dest, const void* src, size_t n, int pe) { shmem_putmem(dest, src, n, pe); }
+void shmem_ctx_getmem(shmem_ctx_t, void* dest, const void* src, size_t n, int pe) { shmem_getmem(dest, src, n, pe); }
+void shmem_ctx_putmem_nbi(shmem_ctx_t, void* dest, const void* src, size_t n, int pe) { shmem_putmem(dest, src, n, pe); }
+void shmem_ctx_getmem_nbi(shmem_ctx_t, void* dest, const void* src, size_t n, int pe) { shmem_getmem(dest, src, n, pe); }
+
+#define TSHMEM_DEF_RMA(NAME, T)                                                          \
+  void shmem_##NAME##_put(T* d, const T* s, size_t n, int pe) {                          \
+    shmem_putmem(d, s, n * sizeof(T), pe);                                               \
+  }                                                                                      \
+  void shmem_##NAME##_get(T* d, const T* s, size_t n, int pe) {                          \
+    shmem_getmem(d, s, n * sizeof(T), pe);                                               \
+  }                                                                                      \
+  void shmem_##NAME##_put_nbi(T* d, const T* s, size_t n, int pe) {                      \
+    shmem_putmem(d, s, n * sizeof(T), pe);                                               \
+  }                                                                                      \
+  void shmem_##NAME##_get_nbi(T* d, const T* s, size_t n, int pe) {                      \
+    shmem_getmem(d, s, n * sizeof(T), pe);                                               \
+  }                                                                                      \
+  void shmem_##NAME##_p(T* d, T v, int pe) { *(T*) translate(d, pe) = v; }               \
+  T shmem_##NAME##_g(const T* s, int pe) { return *(const T*) translate(s, pe); }        \
+  void shmem_##NAME##_iput(T* d, const T* s, ptrdiff_t dst, ptrdiff_t sst, size_t n,     \
+                           int pe) {                                                     \
+    T* r = (T*) translate(d, pe);                                                        \
+    for (size_t i = 0; i < n; i++) r[i * dst] = s[i * sst];                              \
+  }                                                                                      \
+  void shmem_##NAME##_iget(T* d, const T* s, ptrdiff_t dst, ptrdiff_t sst, size_t n,     \
+                           int pe) {                                                     \
+    const T* r = (const T*) translate(s, pe);                                            \
+    for (size_t i = 0; i < n; i++) d[i * dst] = r[i * sst];                              \
+  }                                                                                      \
+  void shmem_ctx_##NAME##_put_nbi(shmem_ctx_t, T* d, const T* s, size_t n, int pe) {     \
+    shmem_putmem(d, s, n * sizeof(T), pe);                                               \
+  }                                                                                      \
+  void shmem_ctx_##NAME##_get_nbi(shmem_ctx_t, T* d, const T* s, size_t n, int pe) {     \
+    shmem_getmem(d, s, n * sizeof(T), pe);                                               \
+  }                                                                                      \
+  void shmem_ctx_##NAME##_p(shmem_ctx_t, T* d, T v, int pe) { shmem_##NAME##_p(d, v, pe); } \
+  T shmem_ctx_##NAME##_g(shmem_ctx_t, const T* s, int pe) { return shmem_##NAME##_g(s, pe); }
+
+TSHMEM_DEF_RMA(char, char)
+TSHMEM_DEF_RMA(int, int)
+TSHMEM_DEF_RMA(long, long)
+TSHMEM_DEF_RMA(longlong, long long)
+TSHMEM_DEF_RMA(int64, int64_t)
+TSHMEM_DEF_RMA(uint64, uint64_t)
+TSHMEM_DEF_RMA(double, double)
+
+// --------------------------------------------------------------------------
+// atomics
+
+static inline bool cmp_holds(long long a, int cmp, long long b) {
+  switch (cmp) {
+    case SHMEM_CMP_EQ: return a == b;
+    case SHMEM_CMP_NE: return a != b;
+    case SHMEM_CMP_GT: return a > b;
+    case SHMEM_CMP_GE: return a >= b;
+    case SHMEM_CMP_LT: return a < b;
+    case SHMEM_CMP_LE: return a <= b;
+    default: return true;
+  }
+}
+
+#define TSHMEM_DEF_AMO(NAME, T)                                                          \
+  T shmem_##NAME##_atomic_fetch(const T* s, int pe) {                                    \
+    return __atomic_load_n((const T*) translate(s, pe), __ATOMIC_SEQ_CST);               \
+  }                                                                                      \
+  void shmem_##NAME##_atomic_set(T* d, T v, int pe) {                                    \
+    __atomic_store_n((T*) translate(d, pe), v, __ATOMIC_SEQ_CST);                        \
+  }                                                                                      \
+  T shmem_##NAME##_atomic_swap(T* d, T v, int pe) {                                      \
+    return __atomic_exchange_n((T*) translate(d, pe), v, __ATOMIC_SEQ_CST);              \
+  }                                                                                      \
+  T shmem_##NAME##_atomic_compare_swap(T* d, T c, T v, int pe) {                         \
+    __atomic_compare_exchange_n((T*) translate(d, pe), &c, v, false, __ATOMIC_SEQ_CST,   \
+                                __ATOMIC_SEQ_CST);                                       \
+    return c;                                                                            \
+  }                                                                                      \
+  T shmem_##NAME##_atomic_fetch_add(T* d, T v, int pe) {                                 \
+    return __atomic_fetch_add((T*) translate(d, pe), v, __ATOMIC_SEQ_CST);               \
+  }                                                                                      \
+  T shmem_##NAME##_atomic_fetch_inc(T* d, int pe) {                                      \
+    return shmem_##NAME##_atomic_fetch_add(d, 1, pe);                                    \
+  }                                                                                      \
+  void shmem_##NAME##_atomic_add(T* d, T v, int pe) {                                    \
+    __atomic_fetch_add((T*) translate(d, pe), v, __ATOMIC_RELAXED);                      \
+  }                                                                                      \
+  void shmem_##NAME##_atomic_inc(T* d, int pe) { shmem_##NAME##_atomic_add(d, 1, pe); }  \
+  void shmem_ctx_##NAME##_atomic_add(shmem_ctx_t, T* d, T v, int pe) {                   \
+    shmem_##NAME##_atomic_add(d, v, pe);                                                 \
+  }                                                                                      \
+  T shmem_ctx_##NAME##_atomic_fetch_add(shmem_ctx_t, T* d, T v, int pe) {                \
+    return shmem_##NAME##_atomic_fetch_add(d, v, pe);                                    \
+  }                                                                                      \
+  void shmem_##NAME##_wait_until(T* ivar, int cmp, T value) {                            \
+    unsigned spins = 0;                                                                  \
+    while (!cmp_holds((long long) __atomic_load_n(ivar, __ATOMIC_ACQUIRE), cmp,          \
+                      (long long) value))                                                \
+      relax(spins);                                                                      \
+  }
+
+TSHMEM_DEF_AMO(int, int)
+TSHMEM_DEF_AMO(long, long)
+TSHMEM_DEF_AMO(int64, int64_t)
+TSHMEM_DEF_AMO(uint64, uint64_t)
+
+// --------------------------------------------------------------------------
+// ordering and synchronization
+
+void shmem_quiet(void) { std::atomic_thread_fence(std::memory_order_seq_cst); }
+void shmem_fence(void) { std::atomic_thread_fence(std::memory_order_seq_cst); }
+void shmem_barrier_all(void) {
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  SHMEM_TEAM_WORLD->barrier.wait();
+}
+void shmem_sync_all(void) { SHMEM_TEAM_WORLD->barrier.wait(); }
+
+int shmem_ctx_create(long, shmem_ctx_t* ctx) {
+  *ctx = new tshmem_ctx;
+  return 0;
+}
+int shmem_team_create_ctx(shmem_team_t, long options, shmem_ctx_t* ctx) {
+  return shmem_ctx_create(options, ctx);
+}
+void shmem_ctx_destroy(shmem_ctx_t ctx) {
+  if (ctx != SHMEM_CTX_DEFAULT) delete ctx;
+}
+void shmem_ctx_quiet(shmem_ctx_t) { shmem_quiet(); }
+void shmem_ctx_fence(shmem_ctx_t) { shmem_fence(); }
+
+// --------------------------------------------------------------------------
+// teams
+
+int shmem_team_my_pe(shmem_team_t team) { return team ? team_me(team) : -1; }
+int shmem_team_n_pes(shmem_team_t team) { return team ? (int) team->members.size() : -1; }
+int shmem_team_translate_pe(shmem_team_t src, int src_pe, shmem_team_t dst) {
+  if (!src || !dst || src_pe < 0 || src_pe >= (int) src->members.size()) return -1;
+  return dst->index[src->members[src_pe]];
+}
+
+// Split 'parent' by color: members with the same color end up in the same
+// team, ordered by their rank in the parent.
+static shmem_team_t split_by_color(shmem_team_t parent, int color) {
+  int me = team_me(parent);
+  int seq = parent->splits[me]++;
+  std::vector<int> colors(parent->members.size());
+  parent->slots[me] = (const void*) (intptr_t) color;
+  parent->barrier.wait();
+  for (size_t i = 0; i < colors.size(); i++) colors[i] = (int) (intptr_t) parent->slots[i];
+  parent->barrier.wait();
+  if (color < 0) return SHMEM_TEAM_INVALID;
+
+  std::lock_guard<std::mutex> lock(g_team_mutex);
+  auto key = std::make_tuple(parent, seq, color);
+  auto it = g_team_registry.find(key);
+  if (it != g_team_registry.end()) return it->second;
+  std::vector<int> members;
+  for (size_t i = 0; i < colors.size(); i++)
+    if (colors[i] == color) members.push_back(parent->members[i]);
+  tshmem_team* t = make_team(members);
+  g_team_registry[key] = t;
+  return t;
+}
+
+int shmem_team_split_strided(shmem_team_t parent, int start, int stride, int size,
+                             const shmem_team_config_t*, long, shmem_team_t* new_team) {
+  int me = team_me(parent);
+  int color = -1;
+  if (stride == 0) stride = 1;
+  int rel = me - start;
+  if (rel % stride == 0 && rel / stride >= 0 && rel / stride < size) color = 0;
+  *new_team = split_by_color(parent, color);
+  return 0;
+}
+
+int shmem_team_split_2d(shmem_team_t parent, int xrange,
+                        const shmem_team_config_t*, long, shmem_team_t* xaxis_team,
+                        const shmem_team_config_t*, long, shmem_team_t* yaxis_team) {
+  int me = team_me(parent);
+  int n = (int) parent->members.size();
+  if (xrange > n) xrange = n;
+  *xaxis_team = split_by_color(parent, me / xrange);
+  *yaxis_team = split_by_color(parent, me % xrange);
+  return 0;
+}
+
+void shmem_team_destroy(shmem_team_t) {
+  // teams live in the registry until the program exits
+}
+int shmem_team_sync(shmem_team_t team) {
+  team->barrier.wait();
+  return 0;
+}
+
+// --------------------------------------------------------------------------
+// collectives
+
+int shmem_broadcastmem(shmem_team_t team, void* dest, const void* source, size_t n, int root) {
+  team_exchange(team, source, dest, [&](int me) {
+    if (me != root) std::memcpy(dest, team->slots[root], n);
+  });
+  return 0;
+}
+
+int shmem_fcollectmem(shmem_team_t team, void* dest, const void* source, size_t n) {
+  team_exchange(team, source, dest, [&](int) {
+    for (size_t r = 0; r < team->members.size(); r++)
+      std::memcpy((char*) dest + r * n, team->slots[r], n);
+  });
+  return 0;
+}
+
+int shmem_collectmem(shmem_team_t team, void* dest, const void* source, size_t n) {
+  std::vector<size_t> sizes(team->members.size());
+  size_t mine = n;
+  shmem_fcollectmem(team, sizes.data(), &mine, sizeof(size_t));
+  team_exchange(team, source, dest, [&](int) {
+    size_t off = 0;
+    for (size_t r = 0; r < team->members.size(); r++) {
+      std::memcpy((char*) dest + off, team->slots[r], sizes[r]);
+      off += sizes[r];
+    }
+  });
+  return 0;
+}
+
+int shmem_alltoallmem(shmem_team_t team, void* dest, const void* source, size_t n) {
+  team_exchange(team, source, dest, [&](int me) {
+    for (size_t r = 0; r < team->members.size(); r++)
+      std::memcpy((char*) dest + r * n, (const char*) team->slots[r] + me * n, n);
+  });
+  return 0;
+}
+
+}  // extern "C"
+
+template<typename T, typename Op>
+static int team_reduce(shmem_team_t team, T* dest, const T* src, size_t n, Op op) {
+  std::vector<T> acc(n);
+  team_exchange(team, src, dest, [&](int) {
+    const T* first = (const T*) team->slots[0];
+    std::copy(first, first + n, acc.begin());
+    for (size_t r = 1; r < team->members.size(); r++) {
+      const T* s = (const T*) team->slots[r];
+      for (size_t i = 0; i < n; i++) acc[i] = op(acc[i], s[i]);
+    }
+  });
+  std::copy(acc.begin(), acc.end(), dest);
+  return 0;
+}
+
+extern "C" {
+
+#define TSHMEM_DEF_REDUCE(NAME, T)                                                       \
+  int shmem_##NAME##_sum_reduce(shmem_team_t t, T* d, const T* s, size_t n) {            \
+    return team_reduce(t, d, s, n, [](T a, T b) { return (T) (a + b); });                \
+  }                                                                                      \
+  int shmem_##NAME##_max_reduce(shmem_team_t t, T* d, const T* s, size_t n) {            \
+    return team_reduce(t, d, s, n, [](T a, T b) { return a > b ? a : b; });              \
+  }                                                                                      \
+  int shmem_##NAME##_min_reduce(shmem_team_t t, T* d, const T* s, size_t n) {            \
+    return team_reduce(t, d, s, n, [](T a, T b) { return a < b ? a : b; });              \
+  }
+
+#define TSHMEM_DEF_BITWISE(NAME, T)                                                      \
+  int shmem_##NAME##_and_reduce(shmem_team_t t, T* d, const T* s, size_t n) {            \
+    return team_reduce(t, d, s, n, [](T a, T b) { return (T) (a & b); });                \
+  }                                                                                      \
+  int shmem_##NAME##_or_reduce(shmem_team_t t, T* d, const T* s, size_t n) {             \
+    return team_reduce(t, d, s, n, [](T a, T b) { return (T) (a | b); });                \
+  }
+
+TSHMEM_DEF_REDUCE(int, int)
+TSHMEM_DEF_REDUCE(long, long)
+TSHMEM_DEF_REDUCE(longlong, long long)
+TSHMEM_DEF_REDUCE(int64, int64_t)
+TSHMEM_DEF_REDUCE(uint64, uint64_t)
+TSHMEM_DEF_REDUCE(size, size_t)
+TSHMEM_DEF_REDUCE(double, double)
+TSHMEM_DEF_BITWISE(int8, int8_t)
+TSHMEM_DEF_BITWISE(int, int)
+TSHMEM_DEF_BITWISE(int64, int64_t)
+TSHMEM_DEF_BITWISE(uint64, uint64_t)
+
+// --------------------------------------------------------------------------
+// getopt with per-thread state (POSIX semantics, no argument permutation)
+
+static thread_local char* tl_optarg = nullptr;
+static thread_local int tl_optind = 1;
+static thread_local int tl_opterr = 1;
+static thread_local int tl_optopt = 0;
+static thread_local int tl_optpos = 1;
+
+char** tshmem_optarg_ptr(void) { return &tl_optarg; }
+int* tshmem_optind_ptr(void) { return &tl_optind; }
+int* tshmem_opterr_ptr(void) { return &tl_opterr; }
+int* tshmem_optopt_ptr(void) { return &tl_optopt; }
+
+int tshmem_getopt(int argc, char* const argv[], const char* optstring) {
+  tl_optarg = nullptr;
+  if (tl_optind >= argc || argv[tl_optind] == nullptr) return -1;
+  const char* arg = argv[tl_optind];
+  if (tl_optpos == 1) {
+    if (arg[0] != '-' || arg[1] == '\0') return -1;
+    if (std::strcmp(arg, "--") == 0) {
+      tl_optind++;
+      return -1;
+    }
+  }
+  int c = (unsigned char) arg[tl_optpos];
+  const char* spec = (c == ':') ? nullptr : std::strchr(optstring, c);
+  if (spec == nullptr) {
+    tl_optopt = c;
+    if (tl_opterr && tl_pe == 0 && optstring[0] != ':')
+      std::fprintf(stderr, "%s: invalid option -- '%c'\n", argv[0], c);
+    if (arg[++tl_optpos] == '\0') {
+      tl_optind++;
+      tl_optpos = 1;
+    }
+    return '?';
+  }
+  if (spec[1] == ':') {
+    if (arg[tl_optpos + 1] != '\0') {
+      tl_optarg = (char*) &arg[tl_optpos + 1];
+    } else if (tl_optind + 1 < argc) {
+      tl_optarg = argv[++tl_optind];
+    } else {
+      tl_optopt = c;
+      tl_optind++;
+      tl_optpos = 1;
+      return optstring[0] == ':' ? ':' : '?';
+    }
+    tl_optind++;
+    tl_optpos = 1;
+  } else if (arg[++tl_optpos] == '\0') {
+    tl_optind++;
+    tl_optpos = 1;
+  }
+  return c;
+}
+
+// --------------------------------------------------------------------------
+// libgetput
+
+void lgp_init(int, char*[]) { shmem_init(); }
+void lgp_finalize(void) { shmem_barrier_all(); }
+void lgp_global_exit(int status) { shmem_global_exit(status); }
+void lgp_barrier(void) { shmem_barrier_all(); }
+void* lgp_all_alloc(size_t num, size_t size) {
+  size_t per_pe = (num + g_npes - 1) / g_npes;
+  return shmem_malloc(per_pe * size);
+}
+void lgp_all_free(void* ptr) { shmem_free(ptr); }
+
+double wall_seconds(void) {
+  struct timeval tp;
+  gettimeofday(&tp, nullptr);
+  return (double) tp.tv_sec + (double) tp.tv_usec * 1.e-6;
+}
+
+int T0_fprintf(FILE* stream, const char* fmt, ...) {
+  if (tl_pe != 0) return 0;
+  va_list ap;
+  va_start(ap, fmt);
+  int ret = std::vfprintf(stream, fmt, ap);
+  va_end(ap);
+  std::fflush(stream);
+  return ret;
+}
+
+int T0_printf(const char* fmt, ...) {
+  if (tl_pe != 0) return 0;
+  va_list ap;
+  va_start(ap, fmt);
+  int ret = std::vprintf(fmt, ap);
+  va_end(ap);
+  std::fflush(stdout);
+  return ret;
+}
+
+// bale's global index convention for shared arrays is cyclic
+int64_t lgp_get_int64(int64_t* p, int64_t index) {
+  return shmem_int64_g(p + index / g_npes, (int) (index % g_npes));
+}
+void lgp_put_int64(int64_t* p, int64_t index, int64_t val) {
+  shmem_int64_p(p + index / g_npes, val, (int) (index % g_npes));
+}
+void lgp_atomic_add(int64_t* p, int64_t index, int64_t val) {
+  shmem_int64_atomic_add(p + index / g_npes, val, (int) (index % g_npes));
+}
+int64_t lgp_fetch_and_add(int64_t* p, int64_t index, int64_t val) {
+  return shmem_int64_atomic_fetch_add(p + index / g_npes, val, (int) (index % g_npes));
+}
+int64_t lgp_fetch_and_inc(int64_t* p, int64_t index) { return lgp_fetch_and_add(p, index, 1); }
+
+int64_t lgp_reduce_add_l(int64_t v) { shmem_int64_sum_reduce(SHMEM_TEAM_WORLD, &v, &v, 1); return v; }
+int64_t lgp_reduce_min_l(int64_t v) { shmem_int64_min_reduce(SHMEM_TEAM_WORLD, &v, &v, 1); return v; }
+int64_t lgp_reduce_max_l(int64_t v) { shmem_int64_max_reduce(SHMEM_TEAM_WORLD, &v, &v, 1); return v; }
+double lgp_reduce_add_d(double v) { shmem_double_sum_reduce(SHMEM_TEAM_WORLD, &v, &v, 1); return v; }
+double lgp_reduce_min_d(double v) { shmem_double_min_reduce(SHMEM_TEAM_WORLD, &v, &v, 1); return v; }
+double lgp_reduce_max_d(double v) { shmem_double_max_reduce(SHMEM_TEAM_WORLD, &v, &v, 1); return v; }
+
+int64_t lgp_min_avg_max_l(minavgmaxL_t* s, int64_t myval, int64_t dem) {
+  s->min = lgp_reduce_min_l(myval);
+  s->max = lgp_reduce_max_l(myval);
+  s->avg = lgp_reduce_add_l(myval) / dem;
+  return 0;
+}
+int64_t lgp_min_avg_max_d(minavgmaxD_t* s, double myval, int64_t dem) {
+  s->min = lgp_reduce_min_d(myval);
+  s->max = lgp_reduce_max_d(myval);
+  s->avg = lgp_reduce_add_d(myval) / (double) dem;
+  return 0;
+}
+
+}  // extern "C"
+
+// --------------------------------------------------------------------------
+// conveyors
+
+namespace {
+
+struct Ring {
+  alignas(64) std::atomic<uint64_t> tail{0};  // written by the producer
+  alignas(64) std::atomic<uint64_t> head{0};  // written by the consumer
+  char* data = nullptr;
+};
+
+struct ConveyPE {
+  size_t stride = 0;
+  uint64_t cap = 0;         // slots per ring, a power of two
+  uint64_t mask = 0;        // cap - 1
+  bool done_sent = false;
+  bool finished = false;
+  int cursor = 0;
+  int pend_src = -1;        // ring holding the item handed out by the last pull
+  std::vector<uint64_t> head_cache;  // producer's view of remote heads
+  char pad[64];
+};
+
+}  // namespace
+
+struct convey {
+  int npes = 0;
+  size_t ring_bytes = 0;
+  std::vector<Ring> rings;  // rings[dst * npes + src]
+  std::vector<ConveyPE> pes;
+  alignas(64) std::atomic<int> done_count{0};
+
+  Ring& ring(int dst, int src) { return rings[(size_t) dst * npes + src]; }
+};
+
+namespace {
+
+inline void release_pending(convey_t* c, ConveyPE& s) {
+  if (s.pend_src >= 0) {
+    Ring& r = c->ring(tl_pe, s.pend_src);
+    r.head.store(r.head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    s.pend_src = -1;
+  }
+}
+
+}  // namespace
+
+extern "C" {
+
+convey_t* convey_new(size_t max_bytes, size_t, const convey_alc8r_t*, uint64_t) {
+  size_t ring_bytes = parse_size(std::getenv("TSHMEM_CONVEY_BYTES"), 16384);
+  if (max_bytes != SIZE_MAX && max_bytes / g_npes < ring_bytes) {
+    ring_bytes = std::max<size_t>(max_bytes / g_npes, 64);
+  }
+  return team_shared_new<convey>(SHMEM_TEAM_WORLD, [&]() {
+    convey* c = new convey;
+    c->npes = g_npes;
+    c->ring_bytes = ring_bytes;
+    c->rings = std::vector<Ring>((size_t) g_npes * g_npes);
+    for (auto& r : c->rings) r.data = (char*) std::aligned_alloc(64, ring_bytes);
+    c->pes.resize(g_npes);
+    for (auto& s : c->pes) s.head_cache.assign(g_npes, 0);
+    return c;
+  });
+}
+
+int convey_begin(convey_t* c, size_t item_size, size_t align) {
+  shmem_barrier_all();
+  ConveyPE& s = c->pes[tl_pe];
+  if (align == 0) align = 1;
+  s.stride = (item_size + align - 1) / align * align;
+  uint64_t slots = c->ring_bytes / s.stride;
+  if (slots == 0) fatal("conveyor item larger than the ring");
+  // a power of two, so the slot index is a mask rather than a divide
+  s.cap = 1;
+  while (s.cap * 2 <= slots) s.cap *= 2;
+  s.mask = s.cap - 1;
+  s.done_sent = false;
+  s.finished = false;
+  s.pend_src = -1;
+  if (tl_pe == 0) c->done_count.store(0, std::memory_order_relaxed);
+  shmem_barrier_all();
+  return convey_OK;
+}
+
+bool convey_push(convey_t* c, const void* item, int64_t pe) {
+  ConveyPE& s = c->pes[tl_pe];
+  Ring& r = c->ring((int) pe, tl_pe);
+  uint64_t tail = r.tail.load(std::memory_order_relaxed);
+  if (tail - s.head_cache[pe] >= s.cap) {
+    s.head_cache[pe] = r.head.load(std::memory_order_acquire);
+    if (tail - s.head_cache[pe] >= s.cap) return false;
+  }
+  std::memcpy(r.data + (tail & s.mask) * s.stride, item, s.stride);
+  r.tail.store(tail + 1, std::memory_order_release);
+  return true;
+}
+
+void* convey_apull(convey_t* c, int64_t* from) {
+  ConveyPE& s = c->pes[tl_pe];
+  release_pending(c, s);
+  for (int k = 0; k < c->npes; k++) {
+    int src = s.cursor + k;
+    if (src >= c->npes) src -= c->npes;
+    Ring& r = c->ring(tl_pe, src);
+    uint64_t head = r.head.load(std::memory_order_relaxed);
+    if (head != r.tail.load(std::memory_order_acquire)) {
+      s.cursor = src;
+      s.pend_src = src;
+      if (from) *from = src;
+      return r.data + (head & s.mask) * s.stride;
+    }
+  }
+  return nullptr;
+}
+
+int convey_pull(convey_t* c, void* item, int64_t* from) {
+  void* p = convey_apull(c, from);
+  if (p == nullptr) return convey_FAIL;
+  std::memcpy(item, p, c->pes[tl_pe].stride);
+  return convey_OK;
+}
+
+int convey_unpull(convey_t* c) {
+  ConveyPE& s = c->pes[tl_pe];
+  if (s.pend_src < 0) return convey_error_STATE;
+  s.pend_src = -1;
+  return convey_OK;
+}
+
+bool convey_advance(convey_t* c, bool done) {
+  ConveyPE& s = c->pes[tl_pe];
+  release_pending(c, s);
+  if (s.finished) return false;
+  if (done && !s.done_sent) {
+    s.done_sent = true;
+    c->done_count.fetch_add(1, std::memory_order_acq_rel);
+  }
+  if (c->done_count.load(std::memory_order_acquire) == c->npes) {
+    bool empty = true;
+    for (int src = 0; src < c->npes && empty; src++) {
+      Ring& r = c->ring(tl_pe, src);
+      empty = r.head.load(std::memory_order_relaxed) == r.tail.load(std::memory_order_acquire);
+    }
+    if (empty) {
+      s.finished = true;
+      return false;
+    }
+  }
+  if (g_oversubscribed) sched_yield();
+  return true;
+}
+
+int convey_reset(convey_t* c) {
+  ConveyPE& s = c->pes[tl_pe];
+  release_pending(c, s);
+  return convey_OK;
+}
+
+int convey_free(convey_t* c) {
+  if (c == nullptr) return convey_OK;
+  shmem_barrier_all();
+  if (tl_pe == 0) {
+    for (auto& r : c->rings) std::free(r.data);
+    delete c;
+  }
+  shmem_barrier_all();
+  return convey_OK;
+}
+
+}  // extern "C"
+
+// --------------------------------------------------------------------------
+// exstack: per-pair buffers swapped at collective exchanges
+
+struct exstack {
+  int npes = 0;
+  int64_t buf_cnt = 0;
+  size_t pkg = 0;
+  // send[src][dst] and recv[dst][src] buffers of buf_cnt packages
+  std::vector<char*> send, recv;
+  std::vector<int64_t> send_cnt, recv_cnt, recv_pos;
+  std::vector<int> cursor, last_src;
+  std::vector<int> done;
+};
+
+extern "C" {
+
+exstack_t* exstack_init(int64_t buf_cnt, size_t pkg_size) {
+  return team_shared_new<exstack>(SHMEM_TEAM_WORLD, [&]() {
+    exstack* x = new exstack;
+    size_t pairs = (size_t) g_npes * g_npes;
+    x->npes = g_npes;
+    x->buf_cnt = buf_cnt;
+    x->pkg = pkg_size;
+    x->send.resize(pairs);
+    x->recv.resize(pairs);
+    for (size_t i = 0; i < pairs; i++) {
+      x->send[i] = (char*) std::malloc(buf_cnt * pkg_size);
+      x->recv[i] = (char*) std::malloc(buf_cnt * pkg_size);
+    }
+    x->send_cnt.assign(pairs, 0);
+    x->recv_cnt.assign(pairs, 0);
+    x->recv_pos.assign(pairs, 0);
+    x->cursor.assign(g_npes, 0);
+    x->last_src.assign(g_npes, -1);
+    x->done.assign(g_npes, 0);
+    return x;
+  });
+}
+
+int64_t exstack_push(exstack_t* x, void* item, int64_t pe) {
+  size_t k = (size_t) tl_pe * x->npes + pe;
+  if (x->send_cnt[k] == x->buf_cnt) return 0;
+  std::memcpy(x->send[k] + x->send_cnt[k] * x->pkg, item, x->pkg);
+  x->send_cnt[k]++;
+  return 1;
+}
+
+void exstack_exchange(exstack_t* x) {
+  shmem_barrier_all();
+  for (int src = 0; src < x->npes; src++) {
+    size_t s = (size_t) src * x->npes + tl_pe;
+    size_t d = (size_t) tl_pe * x->npes + src;
+    std::memcpy(x->recv[d], x->send[s], x->send_cnt[s] * x->pkg);
+    x->recv_cnt[d] = x->send_cnt[s];
+    x->recv_pos[d] = 0;
+  }
+  shmem_barrier_all();
+  for (int dst = 0; dst < x->npes; dst++) x->send_cnt[(size_t) tl_pe * x->npes + dst] = 0;
+  x->cursor[tl_pe] = 0;
+}
+
+int64_t exstack_pop(exstack_t* x, void* item, int64_t* from) {
+  for (int& src = x->cursor[tl_pe]; src < x->npes; src++) {
+    size_t d = (size_t) tl_pe * x->npes + src;
+    if (x->recv_pos[d] < x->recv_cnt[d]) {
+      std::memcpy(item, x->recv[d] + x->recv_pos[d] * x->pkg, x->pkg);
+      x->recv_pos[d]++;
+      x->last_src[tl_pe] = src;
+      if (from) *from = src;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int64_t exstack_pop_thread(exstack_t* x, void* item, int64_t pe) {
+  size_t d = (size_t) tl_pe * x->npes + pe;
+  if (x->recv_pos[d] == x->recv_cnt[d]) return 0;
+  std::memcpy(item, x->recv[d] + x->recv_pos[d] * x->pkg, x->pkg);
+  x->recv_pos[d]++;
+  x->last_src[tl_pe] = (int) pe;
+  return 1;
+}
+
+void exstack_unpop(exstack_t* x) {
+  int src = x->last_src[tl_pe];
+  if (src >= 0) {
+    x->recv_pos[(size_t) tl_pe * x->npes + src]--;
+    x->cursor[tl_pe] = std::min(x->cursor[tl_pe], src);
+    x->last_src[tl_pe] = -1;
+  }
+}
+
+int64_t exstack_proceed(exstack_t* x, int done_pushing) {
+  x->done[tl_pe] = done_pushing ? 1 : 0;
+  int all = done_pushing ? 1 : 0;
+  shmem_int_and_reduce(SHMEM_TEAM_WORLD, &all, &all, 1);
+  return !all;
+}
+
+void exstack_reset(exstack_t* x) {
+  for (int p = 0; p < x->npes; p++) {
+    x->send_cnt[(size_t) tl_pe * x->npes + p] = 0;
+    x->recv_cnt[(size_t) tl_pe * x->npes + p] = 0;
+    x->recv_pos[(size_t) tl_pe * x->npes + p] = 0;
+  }
+  x->done[tl_pe] = 0;
+  shmem_barrier_all();
+}
+
+void exstack_clear(exstack_t* x) { exstack_reset(x); }
+
+void exstack_free(exstack_t* x) {
+  if (x == nullptr) return;
+  shmem_barrier_all();
+  if (tl_pe == 0) {
+    for (auto p : x->send) std::free(p);
+    for (auto p : x->recv) std::free(p);
+    delete x;
+  }
+  shmem_barrier_all();
+}
+
+}  // extern "C"
+
+// --------------------------------------------------------------------------
+// exstack2: the asynchronous model maps directly onto a conveyor
+
+struct exstack2 {
+  convey_t* c;
+};
+
+extern "C" {
+
+exstack2_t* exstack2_init(int64_t buf_cnt, size_t pkg_size) {
+  convey_t* c = convey_new(buf_cnt * pkg_size * g_npes, 0, nullptr, 0);
+  convey_begin(c, pkg_size, 0);
+  return new exstack2{c};
+}
+int64_t exstack2_push(exstack2_t* x, void* item, int64_t pe) { return convey_push(x->c, item, pe) ? 1 : 0; }
+int64_t exstack2_pop(exstack2_t* x, void* item, int64_t* from) {
+  return convey_pull(x->c, item, from) == convey_OK ? 1 : 0;
+}
+void exstack2_unpop(exstack2_t* x) { convey_unpull(x->c); }
+int64_t exstack2_proceed(exstack2_t* x, int im_done) { return convey_advance(x->c, im_done != 0) ? 1 : 0; }
+void exstack2_reset(exstack2_t* x) {
+  size_t stride = x->c->pes[tl_pe].stride;
+  convey_reset(x->c);
+  convey_begin(x->c, stride, 0);
+}
+void exstack2_clear(exstack2_t* x) { exstack2_reset(x); }
+void exstack2_free(exstack2_t* x) {
+  if (x == nullptr) return;
+  convey_free(x->c);
+  delete x;
+}
+
+}  // extern "C"